@@ -0,0 +1,54 @@
+/// \file bench/alloc_counter.cc
+/// \brief Global operator new replacement counting allocations.
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "bench_util.hh"
+
+namespace
+{
+  std::atomic<size_t> allocations(0);
+  std::atomic<size_t> bytes(0);
+}
+
+void* operator new(size_t size)
+{
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  bytes.fetch_add(size, std::memory_order_relaxed);
+  if (void* p = malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+  free(p);
+}
+
+namespace aibo
+{
+  namespace bench
+  {
+    size_t allocationCount()
+    {
+      return allocations.load(std::memory_order_relaxed);
+    }
+
+    size_t allocatedBytes()
+    {
+      return bytes.load(std::memory_order_relaxed);
+    }
+  } // namespace bench
+} // namespace aibo
@@ -0,0 +1,300 @@
+/// \file bench/audio_bench.cc
+/// \brief Capture-to-publish latency of MicrophoneStream, and paced
+/// playback with SpeakerStream against FakeUrbiServer, with their
+/// memory use compared to whole-clip syncGetSound() and sendSound().
+///
+/// Usage: audio_bench [-f capture] [-x speed] [-t seconds] [-c chunk]
+///                    [-r ring] [-b block_ms] [-w wav] [-l seconds]
+///                    [-L lead_ms] [-d delay_us]
+///   -f  URBI stream or urbi_record log with "aibo_micro" BIN sounds
+///       (default: synthetic 440 Hz tone)
+///   -x  capture feed speed, 1 for real time, 0 for as fast as
+///       possible (default: 1)
+///   -t  capture duration (default: 3)
+///   -c  microphone chunk bytes (default: 1024)
+///   -r  microphone ring bytes (default: 32768)
+///   -b  syncGetSound() block compared against, in ms (default: 1000)
+///   -w  WAV file to play (default: synthetic tone)
+///   -l  length of the synthetic clip (default: 3)
+///   -L  audio kept queued on the robot, in ms (default: 100)
+///   -d  emulated link delay in microseconds (default: 0)
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <unistd.h>
+
+#include "aibo_server/audio_stream.hh"
+#include "aibo_server/fake_urbi_server.hh"
+
+#include "bench_util.hh"
+#include "ers7_stream.hh"
+
+namespace
+{
+  /// A captured microphone binary.
+  struct Capture
+  {
+    std::string message;
+    /// Seconds of audio.
+    double duration;
+  };
+
+  /// 16-bit stereo 440 Hz tone, frames [first, first + count).
+  void tone(char* out, unsigned long long first, size_t count)
+  {
+    for (size_t i = 0; i < count; ++i)
+    {
+      int v = static_cast<int>(8000 * sin(2 * M_PI * 440
+					  * (first + i) / 16000.0));
+      for (size_t ch = 0; ch < 2; ++ch)
+      {
+	out[4 * i + 2 * ch] = v & 0xff;
+	out[4 * i + 2 * ch + 1] = (v >> 8) & 0xff;
+      }
+    }
+  }
+
+  /// One second of micro.val messages, 2048 bytes per 32 ms cycle.
+  std::vector<Capture> synthesize()
+  {
+    std::vector<Capture> res;
+    for (int i = 0; i < 31; ++i)
+    {
+      char header[96];
+      snprintf(header, sizeof header,
+	       "[%08d:aibo_micro] BIN 2048 raw 2 16000 16 1\n", i * 32);
+      std::string data(2048, 0);
+      tone(&data[0], i * 512, 512);
+      Capture c;
+      c.message = header + data + "\n";
+      c.duration = 0.032;
+      res.push_back(c);
+    }
+    return res;
+  }
+
+  /// Split a capture into sound messages by running it through the parser.
+  class Splitter: public aibo::UrbiMessageHandler
+  {
+  public:
+    virtual void onMessage(const aibo::UrbiMessageView& msg)
+    {
+      aibo::AudioFormat format;
+      bool wav;
+      if (!msg.binaryCount
+	  || !aibo::parseSoundHeader(msg.binaries[0].header, format, wav))
+	return;
+      Capture c;
+      c.message = msg.raw.str() + "\n";
+      c.duration = msg.binaries[0].data.size() / format.bytesPerSecond();
+      captures.push_back(c);
+    }
+    std::vector<Capture> captures;
+  };
+
+  int captureBench(const char* path, double speed, double duration,
+		   const aibo::MicrophoneConfig& config, unsigned blockMs)
+  {
+    std::vector<Capture> captures;
+    if (path)
+    {
+      std::string s;
+      if (!aibo::bench::loadStream(path, s))
+      {
+	perror(path);
+	return 1;
+      }
+      aibo::UrbiStreamParser parser;
+      Splitter split;
+      parser.feed(s.data(), s.size());
+      parser.parse(split);
+      captures.swap(split.captures);
+    }
+    else
+      captures = synthesize();
+    if (captures.empty())
+    {
+      fprintf(stderr, "no sound binaries in input\n");
+      return 1;
+    }
+
+    std::mutex lock;
+    std::vector<double> latency;
+    latency.reserve(1 << 20);
+    aibo::UrbiConnection none("localhost");
+    aibo::MicrophoneStream stream(none, config);
+    stream.setCallback([&] (const aibo::AudioChunk& chunk)
+		       {
+			 double l = aibo::steadyTime() - chunk.received;
+			 std::lock_guard<std::mutex> g(lock);
+			 latency.push_back(l);
+		       });
+
+    aibo::UrbiStreamParser parser;
+    size_t allocs = aibo::bench::allocationCount();
+    size_t fed = 0;
+    double audio = 0;
+    double start = aibo::bench::now();
+    while (aibo::bench::now() - start < duration)
+    {
+      const Capture& c = captures[fed % captures.size()];
+      parser.feed(c.message.data(), c.message.size());
+      parser.parse(stream);
+      ++fed;
+      audio += c.duration;
+      if (speed > 0)
+      {
+	double wait = start + audio / speed - aibo::bench::now();
+	if (wait > 0)
+	  usleep(static_cast<useconds_t>(wait * 1e6));
+      }
+    }
+    double elapsed = aibo::bench::now() - start;
+    // Let the publisher drain.
+    usleep(100 * 1000);
+    allocs = aibo::bench::allocationCount() - allocs;
+
+    const aibo::MicrophoneStats& s = stream.stats();
+    std::lock_guard<std::mutex> g(lock);
+    const double bps = aibo::AudioFormat().bytesPerSecond();
+    printf("capture input:      %zu binaries, %s\n", captures.size(),
+	   path ? path : "440 Hz tone");
+    printf("fed:                %.1f s of audio in %.1f s\n", audio, elapsed);
+    printf("published:          %zu chunks of %zu bytes, %.0f/s\n",
+	   s.published.load(), stream.config().chunkBytes,
+	   s.published / elapsed);
+    printf("dropped:            %zu overruns, %zu errors\n",
+	   s.overruns.load(), s.errors.load());
+    printf("latency p50:        %.3f ms\n",
+	   aibo::bench::percentile(latency, 50) * 1e3);
+    printf("latency p99:        %.3f ms\n",
+	   aibo::bench::percentile(latency, 99) * 1e3);
+    printf("latency max:        %.3f ms\n",
+	   aibo::bench::percentile(latency, 100) * 1e3);
+    printf("allocs/chunk:       %.2f\n",
+	   s.published ? double(allocs) / s.published : 0.0);
+    printf("ring:               %zu bytes, %.0f ms of audio\n",
+	   config.ringBytes, config.ringBytes / bps * 1e3);
+    printf("syncGetSound %4u ms: >= %u ms latency, %.0f bytes\n",
+	   blockMs, blockMs, blockMs * bps / 1e3);
+    return 0;
+  }
+
+  int playBench(const char* path, double length, unsigned leadMs,
+		unsigned delayUs)
+  {
+    aibo::WavReader wav;
+    aibo::SpeakerConfig config;
+    config.leadMs = leadMs;
+    double clip = length;
+    if (path)
+    {
+      if (wav.open(path))
+      {
+	fprintf(stderr, "%s\n", wav.errorMessage().c_str());
+	return 1;
+      }
+      config.format = wav.format();
+      clip = wav.duration();
+    }
+
+    aibo::FakeUrbiServer server(0);
+    server.setLinkDelay(delayUs);
+    if (server.start())
+    {
+      perror("fake server");
+      return 1;
+    }
+    aibo::UrbiConnection connection("localhost", server.port());
+    if (connection.connect())
+    {
+      fprintf(stderr, "%s\n", connection.errorMessage().c_str());
+      return 1;
+    }
+    aibo::SpeakerStream speaker(connection, config);
+    connection.setHandler(&speaker);
+    connection.start();
+
+    const unsigned long long frames =
+      static_cast<unsigned long long>(length * 16000);
+    unsigned long long next = 0;
+    aibo::SpeakerStream::Source source;
+    if (path)
+      source = [&wav] (char* buf, size_t len) -> long
+	{
+	  long n = wav.read(buf, len);
+	  return n ? n : -1;
+	};
+    else
+      source = [&] (char* buf, size_t len) -> long
+	{
+	  size_t n = std::min<unsigned long long>(len / 4, frames - next);
+	  if (!n)
+	    return -1;
+	  tone(buf, next, n);
+	  next += n;
+	  return n * 4;
+	};
+
+    double start = aibo::bench::now();
+    speaker.play(source);
+    speaker.wait();
+    double elapsed = aibo::bench::now() - start;
+    // The link delay holds the last chunks back.
+    usleep(delayUs + 50 * 1000);
+    connection.close();
+    server.stop();
+
+    const aibo::SpeakerStats& s = speaker.stats();
+    const unsigned long long bytes = s.bytes;
+    printf("playback input:     %.2f s, %llu bytes, %s\n", clip, bytes,
+	   path ? path : "440 Hz tone");
+    printf("played in:          %.2f s\n", elapsed);
+    printf("sent:               %zu chunks of %zu bytes, %zu remain replies\n",
+	   s.chunks.load(), speaker.config().chunkBytes,
+	   s.remainReplies.load());
+    printf("received:           %llu bytes\n", server.speakerBytes());
+    printf("underruns:          %zu sent late, %zu on the robot\n",
+	   s.underruns.load(), server.speakerUnderruns());
+    printf("robot queue peak:   %.1f ms\n", server.speakerPeakUs() / 1e3);
+    printf("client buffer:      %zu bytes; sendSound(): %llu bytes\n",
+	   speaker.config().chunkBytes, bytes);
+    return 0;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const char* capture = 0;
+  const char* wav = 0;
+  double speed = 1, duration = 3, length = 3;
+  unsigned block = 1000, lead = 100, delay = 0;
+  aibo::MicrophoneConfig config;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:x:t:c:r:b:w:l:L:d:")) != -1)
+    switch (opt)
+    {
+    case 'f': capture = optarg; break;
+    case 'x': speed = atof(optarg); break;
+    case 't': duration = atof(optarg); break;
+    case 'c': config.chunkBytes = atoi(optarg); break;
+    case 'r': config.ringBytes = atoi(optarg); break;
+    case 'b': block = atoi(optarg); break;
+    case 'w': wav = optarg; break;
+    case 'l': length = atof(optarg); break;
+    case 'L': lead = atoi(optarg); break;
+    case 'd': delay = atoi(optarg); break;
+    default:
+      fprintf(stderr, "usage: %s [-f capture] [-x speed] [-t seconds] "
+	      "[-c chunk] [-r ring] [-b block_ms] [-w wav] [-l seconds] "
+	      "[-L lead_ms] [-d delay_us]\n", argv[0]);
+      return 1;
+    }
+
+  if (int rc = captureBench(capture, speed, duration, config, block))
+    return rc;
+  printf("\n");
+  return playBench(wav, length, lead, delay);
+}
@@ -0,0 +1,41 @@
+/// \file bench/bench_util.hh
+/// \brief Timing and allocation counting helpers shared by the benchmarks.
+
+#ifndef AIBO_SERVER_BENCH_UTIL_HH
+# define AIBO_SERVER_BENCH_UTIL_HH
+
+# include <algorithm>
+# include <chrono>
+# include <cstddef>
+# include <vector>
+
+namespace aibo
+{
+  namespace bench
+  {
+    /// Number of calls to operator new since program start.
+    /// Defined in alloc_counter.cc, which replaces the global operators.
+    size_t allocationCount();
+    /// Number of bytes requested from operator new since program start.
+    size_t allocatedBytes();
+
+    /// Seconds elapsed on a monotonic clock.
+    inline double now()
+    {
+      using namespace std::chrono;
+      return duration<double>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    /// Value below which \a p percent of \a samples fall.  Sorts samples.
+    inline double percentile(std::vector<double>& samples, double p)
+    {
+      if (samples.empty())
+	return 0;
+      std::sort(samples.begin(), samples.end());
+      size_t i = static_cast<size_t>(p / 100.0 * (samples.size() - 1) + 0.5);
+      return samples[i];
+    }
+  } // namespace bench
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_BENCH_UTIL_HH
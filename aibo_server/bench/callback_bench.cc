@@ -0,0 +1,216 @@
+/// \file bench/callback_bench.cc
+/// \brief Dispatch latency of CallbackTable against the number of callbacks.
+///
+/// Usage: callback_bench [-n counts] [-m messages] [-w]
+///   -n  comma-separated numbers of registered tags (default: 1,10,100,1000)
+///   -m  messages dispatched per count (default: 2000000)
+///   -w  keep a thread registering and removing callbacks meanwhile
+///
+/// Each count is also run through a linear list under a mutex, as
+/// UAbstractClient::notifyCallbacks() does, for comparison.
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+#include "aibo_server/callback_table.hh"
+
+#include "bench_util.hh"
+
+namespace
+{
+  /// The liburbi scheme: fixed-size tags in a list, scanned under a lock.
+  class ListTable: public aibo::UrbiMessageHandler
+  {
+  public:
+    typedef aibo::CallbackTable::Callback Callback;
+
+    void add(const std::string& tag, const Callback& cb)
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      Info info;
+      strncpy(info.tag, tag.c_str(), sizeof info.tag - 1);
+      info.tag[sizeof info.tag - 1] = 0;
+      info.callback = new Callback(cb);
+      list_.push_back(info);
+    }
+
+    void removeTag(const std::string& tag)
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      for (std::list<Info>::iterator i = list_.begin(); i != list_.end();)
+	if (tag == i->tag)
+	{
+	  delete i->callback;
+	  i = list_.erase(i);
+	}
+	else
+	  ++i;
+    }
+
+    ~ListTable()
+    {
+      for (std::list<Info>::iterator i = list_.begin(); i != list_.end(); ++i)
+	delete i->callback;
+    }
+
+    virtual void onMessage(const aibo::UrbiMessageView& msg)
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      for (std::list<Info>::iterator i = list_.begin(); i != list_.end(); ++i)
+	if (!strncmp(i->tag, msg.tag.data(), msg.tag.size())
+	    && !i->tag[msg.tag.size()])
+	  (*i->callback)(msg);
+    }
+
+  private:
+    struct Info
+    {
+      char tag[64];
+      Callback* callback;
+    };
+    std::list<Info> list_;
+    std::mutex lock_;
+  };
+
+  /// Dispatch \a count messages in batches; return the mean of each
+  /// batch in seconds per message.
+  std::vector<double>
+  run(aibo::UrbiMessageHandler& table,
+      const std::vector<aibo::UrbiMessageView>& msgs, size_t count)
+  {
+    const size_t batch = 1000;
+    std::vector<double> samples;
+    samples.reserve(count / batch + 1);
+    size_t i = 0;
+    while (i < count)
+    {
+      double t = aibo::bench::now();
+      for (size_t j = 0; j < batch; ++j, ++i)
+	table.onMessage(msgs[i % msgs.size()]);
+      samples.push_back((aibo::bench::now() - t) / batch);
+    }
+    return samples;
+  }
+
+  void
+  report(const char* name, size_t tags, std::vector<double>& s,
+	 size_t allocs, size_t count)
+  {
+    double mean = 0;
+    for (size_t i = 0; i < s.size(); ++i)
+      mean += s[i];
+    mean /= s.size();
+    printf("%-6s %6zu tags  mean %7.1f ns  p50 %7.1f ns  p99 %7.1f ns"
+	   "  allocs/msg %.3f\n", name, tags, mean * 1e9,
+	   aibo::bench::percentile(s, 50) * 1e9,
+	   aibo::bench::percentile(s, 99) * 1e9, double(allocs) / count);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  std::vector<size_t> counts;
+  size_t messages = 2000000;
+  bool churn = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:m:w")) != -1)
+    switch (opt)
+    {
+    case 'n':
+      for (char* p = optarg; *p; )
+      {
+	counts.push_back(strtoul(p, &p, 10));
+	if (*p == ',')
+	  ++p;
+	else if (*p)
+	  break;
+      }
+      break;
+    case 'm': messages = strtoul(optarg, 0, 10); break;
+    case 'w': churn = true; break;
+    default:
+      fprintf(stderr, "usage: %s [-n counts] [-m messages] [-w]\n", argv[0]);
+      return 1;
+    }
+  if (counts.empty())
+  {
+    counts.push_back(1);
+    counts.push_back(10);
+    counts.push_back(100);
+    counts.push_back(1000);
+  }
+
+  size_t hits = 0;
+  aibo::CallbackTable::Callback cb = [&hits] (const aibo::UrbiMessageView&)
+    {
+      ++hits;
+      return aibo::URBI_CONTINUE;
+    };
+
+  for (size_t c = 0; c < counts.size(); ++c)
+  {
+    size_t n = counts[c];
+    // Tags shaped like the ones the bridges use.
+    std::vector<std::string> tags;
+    for (size_t i = 0; i < n; ++i)
+    {
+      char buf[32];
+      snprintf(buf, sizeof buf, "aibo_sensor_%u", unsigned(i));
+      tags.push_back(buf);
+    }
+    // Messages for tags spread over the table, in a fixed pseudo-random
+    // order so that the list is not always hit at the same place.
+    std::vector<aibo::UrbiMessageView> msgs(4096);
+    unsigned seed = 1;
+    for (size_t i = 0; i < msgs.size(); ++i)
+    {
+      seed = seed * 1103515245 + 12345;
+      msgs[i].tag = tags[(seed >> 8) % n];
+      msgs[i].type = aibo::MESSAGE_DATA;
+    }
+
+    aibo::CallbackTable table;
+    ListTable list;
+    for (size_t i = 0; i < n; ++i)
+    {
+      table.add(tags[i], cb);
+      list.add(tags[i], cb);
+    }
+
+    std::atomic<bool> done(false);
+    std::thread writer;
+    if (churn)
+      writer = std::thread([&]
+			   {
+			     while (!done)
+			     {
+			       table.add("aibo_churn", cb);
+			       table.removeTag("aibo_churn");
+			       list.add("aibo_churn", cb);
+			       list.removeTag("aibo_churn");
+			       usleep(100);
+			     }
+			   });
+
+    size_t allocs = aibo::bench::allocationCount();
+    std::vector<double> s = run(table, msgs, messages);
+    allocs = aibo::bench::allocationCount() - allocs;
+    report("table", n, s, churn ? 0 : allocs, messages);
+
+    allocs = aibo::bench::allocationCount();
+    s = run(list, msgs, messages);
+    allocs = aibo::bench::allocationCount() - allocs;
+    report("list", n, s, churn ? 0 : allocs, messages);
+
+    done = true;
+    if (writer.joinable())
+      writer.join();
+  }
+  return hits ? 0 : 1;
+}
@@ -0,0 +1,233 @@
+/// \file bench/camera_bench.cc
+/// \brief Frames/sec and per-frame latency of CameraStream.
+///
+/// Usage: camera_bench [-f capture] [-y] [-r fps] [-t seconds] [-w workers]
+///                     [-p pool] [-d hold_ms]
+///   -f  URBI stream or urbi_record log with "aibo_cam" BIN frames
+///       (default: synthetic JPEG)
+///   -y  synthesize raw YCrCb frames instead of JPEG
+///   -r  frame rate fed to the stream, 0 for as fast as possible (default: 0)
+///   -t  duration (default: 3)
+///   -w  decoding threads (default: 2)
+///   -p  decoded image pool size (default: 4)
+///   -d  time each consumer holds an image, to simulate a slow subscriber
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <unistd.h>
+
+#include <jpeglib.h>
+
+#include "aibo_server/camera_stream.hh"
+
+#include "bench_util.hh"
+#include "ers7_stream.hh"
+
+namespace
+{
+  struct Image
+  {
+    std::vector<uint8_t> data;
+    size_t width, height, step;
+    std::string encoding;
+  };
+
+  /// A 208x160 test pattern, moving with \a phase.
+  std::vector<uint8_t> pattern(int phase)
+  {
+    std::vector<uint8_t> rgb(208 * 160 * 3);
+    for (size_t y = 0; y < 160; ++y)
+      for (size_t x = 0; x < 208; ++x)
+      {
+	uint8_t* p = &rgb[(y * 208 + x) * 3];
+	p[0] = x + phase;
+	p[1] = y * 2;
+	p[2] = 128 + 100 * sin((x + y + phase) * 0.1);
+      }
+    return rgb;
+  }
+
+  std::string jpeg(const std::vector<uint8_t>& rgb, int quality)
+  {
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    unsigned char* out = 0;
+    unsigned long size = 0;
+    jpeg_mem_dest(&cinfo, &out, &size);
+    cinfo.image_width = 208;
+    cinfo.image_height = 160;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+      JSAMPROW row = const_cast<JSAMPROW>(&rgb[cinfo.next_scanline * 208 * 3]);
+      jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    std::string res(reinterpret_cast<char*>(out), size);
+    free(out);
+    jpeg_destroy_compress(&cinfo);
+    return res;
+  }
+
+  /// One URBI message per frame, as the camera loop sends them.
+  std::vector<std::string> synthesize(bool ycrcb)
+  {
+    std::vector<std::string> frames;
+    for (int i = 0; i < 30; ++i)
+    {
+      std::vector<uint8_t> rgb = pattern(i * 4);
+      std::string data = ycrcb
+	? std::string(rgb.begin(), rgb.end()) : jpeg(rgb, 80);
+      char header[96];
+      snprintf(header, sizeof header, "[%08d:aibo_cam] BIN %zu %s 208 160\n",
+	       i * 33, data.size(), ycrcb ? "YCrCb" : "jpeg");
+      frames.push_back(header + data + "\n");
+    }
+    return frames;
+  }
+
+  /// Split a capture into whole messages by running it through the parser.
+  class Splitter: public aibo::UrbiMessageHandler
+  {
+  public:
+    virtual void onMessage(const aibo::UrbiMessageView& msg)
+    {
+      if (msg.binaryCount)
+	frames.push_back(msg.raw.str() + "\n");
+    }
+    std::vector<std::string> frames;
+  };
+
+  void convertBench()
+  {
+    std::vector<uint8_t> src = pattern(0), dst(src.size());
+    const size_t pixels = 208 * 160;
+    const int rounds = 2000;
+    double t = aibo::bench::now();
+    for (int i = 0; i < rounds; ++i)
+      aibo::ycrcbToRgbScalar(src.data(), dst.data(), pixels);
+    double scalar = aibo::bench::now() - t;
+    t = aibo::bench::now();
+    for (int i = 0; i < rounds; ++i)
+      aibo::ycrcbToRgb(src.data(), dst.data(), pixels);
+    double simd = aibo::bench::now() - t;
+    printf("YCrCb->RGB scalar:  %.1f Mpixel/s\n", pixels * rounds / scalar / 1e6);
+    printf("YCrCb->RGB:         %.1f Mpixel/s\n", pixels * rounds / simd / 1e6);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const char* capture = 0;
+  bool ycrcb = false;
+  double fps = 0, duration = 3;
+  unsigned hold = 0;
+  aibo::CameraConfig config;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:yr:t:w:p:d:")) != -1)
+    switch (opt)
+    {
+    case 'f': capture = optarg; break;
+    case 'y': ycrcb = true; break;
+    case 'r': fps = atof(optarg); break;
+    case 't': duration = atof(optarg); break;
+    case 'w': config.workers = atoi(optarg); break;
+    case 'p': config.poolSize = atoi(optarg); break;
+    case 'd': hold = atoi(optarg); break;
+    default:
+      fprintf(stderr, "usage: %s [-f capture] [-y] [-r fps] [-t seconds] "
+	      "[-w workers] [-p pool] [-d hold_ms]\n", argv[0]);
+      return 1;
+    }
+
+  convertBench();
+
+  std::vector<std::string> frames;
+  if (capture)
+  {
+    std::string s;
+    if (!aibo::bench::loadStream(capture, s))
+    {
+      perror(capture);
+      return 1;
+    }
+    aibo::UrbiStreamParser parser;
+    Splitter split;
+    parser.feed(s.data(), s.size());
+    parser.parse(split);
+    frames.swap(split.frames);
+  }
+  else
+    frames = synthesize(ycrcb);
+  if (frames.empty())
+  {
+    fprintf(stderr, "no camera frames in input\n");
+    return 1;
+  }
+
+  std::mutex lock;
+  std::vector<double> latency;
+  latency.reserve(1 << 20);
+  aibo::UrbiConnection none("localhost");
+  aibo::CameraStream<Image> stream(none, config);
+  stream.setCallback([&] (const std::shared_ptr<Image>&,
+			  const aibo::CameraJob& job)
+		     {
+		       double l = aibo::steadyTime() - job.received;
+		       {
+			 std::lock_guard<std::mutex> g(lock);
+			 latency.push_back(l);
+		       }
+		       if (hold)
+			 usleep(hold * 1000);
+		     });
+
+  aibo::UrbiStreamParser parser;
+  size_t allocs = aibo::bench::allocationCount();
+  size_t fed = 0;
+  double start = aibo::bench::now();
+  while (aibo::bench::now() - start < duration)
+  {
+    const std::string& f = frames[fed % frames.size()];
+    parser.feed(f.data(), f.size());
+    parser.parse(stream);
+    ++fed;
+    if (fps > 0)
+    {
+      double next = start + fed / fps;
+      double wait = next - aibo::bench::now();
+      if (wait > 0)
+	usleep(static_cast<useconds_t>(wait * 1e6));
+    }
+  }
+  double elapsed = aibo::bench::now() - start;
+  // Let the workers drain.
+  usleep(100 * 1000);
+  allocs = aibo::bench::allocationCount() - allocs;
+
+  const aibo::CameraStats& s = stream.stats();
+  std::lock_guard<std::mutex> g(lock);
+  size_t bytes = 0;
+  for (size_t i = 0; i < frames.size(); ++i)
+    bytes += frames[i].size();
+  printf("input:              %zu frames of %zu bytes avg, %s\n", frames.size(),
+	 bytes / frames.size(), capture ? capture : ycrcb ? "YCrCb" : "JPEG");
+  printf("fed:                %.0f frames/s\n", fed / elapsed);
+  printf("published:          %.0f frames/s\n", s.published / elapsed);
+  printf("dropped:            %zu replaced, %zu no image, %zu stale, %zu errors\n",
+	 s.replaced.load(), s.noImage.load(), s.stale.load(), s.errors.load());
+  printf("latency p50:        %.2f ms\n", aibo::bench::percentile(latency, 50) * 1e3);
+  printf("latency p99:        %.2f ms\n", aibo::bench::percentile(latency, 99) * 1e3);
+  printf("allocs/frame:       %.2f\n", double(allocs) / fed);
+  printf("image pool:         %zu x %zu bytes\n", config.poolSize,
+	 size_t(208 * 160 * 3));
+  return 0;
+}
@@ -0,0 +1,119 @@
+/// \file bench/ers7_stream.cc
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+
+#include "aibo_server/stream_log.hh"
+
+#include "ers7_stream.hh"
+
+namespace aibo
+{
+  namespace bench
+  {
+    namespace
+    {
+      const char* const joints[] =
+      {
+	"legLF1", "legLF2", "legLF3", "legLH1", "legLH2", "legLH3",
+	"legRH1", "legRH2", "legRH3", "legRF1", "legRF2", "legRF3",
+	"neck", "headPan", "headTilt", "tailPan", "tailTilt", "mouth",
+      };
+      const size_t jointCount = sizeof joints / sizeof *joints;
+
+      void header(std::string& s, int ts, const char* tag)
+      {
+	char buf[96];
+	snprintf(buf, sizeof buf, "[%08d:%s] ", ts, tag);
+	s += buf;
+      }
+    }
+
+    std::string makeErs7Stream(double seconds)
+    {
+      std::string s;
+      srand(7);
+      // 1 ms resolution; motors every 32 ms, camera every 33 ms.
+      int duration = static_cast<int>(seconds * 1000);
+      for (int ts = 0; ts < duration; ++ts)
+      {
+	if (ts % 32 == 0)
+	  for (size_t j = 0; j < jointCount; ++j)
+	  {
+	    char buf[32];
+	    header(s, ts, joints[j]);
+	    snprintf(buf, sizeof buf, "%.6f\n", (rand() % 20000) / 100.0 - 100);
+	    s += buf;
+	  }
+	if (ts % 33 == 0)
+	{
+	  // JPEG sizes at medium quality hover around 5-7 kB.
+	  size_t size = 5000 + rand() % 2000;
+	  char buf[64];
+	  header(s, ts, "camera");
+	  snprintf(buf, sizeof buf, "BIN %u jpeg 208 160\n",
+		   static_cast<unsigned>(size));
+	  s += buf;
+	  s += "\xff\xd8";
+	  for (size_t i = 2; i < size - 2; ++i)
+	    // Binary payloads do contain newlines, brackets and quotes.
+	    s += static_cast<char>(rand());
+	  s += "\xff\xd9\n";
+	}
+	if (ts % 1000 == 500)
+	{
+	  header(s, ts, "notag");
+	  s += "*** Urbi kernel heartbeat, 12 active tags\n";
+	}
+	if (ts % 5000 == 2500)
+	{
+	  header(s, ts, "error");
+	  s += "!!! Unknown identifier: legRB1.val\n";
+	}
+      }
+      return s;
+    }
+
+    bool loadStream(const char* path, std::string& out)
+    {
+      struct stat st;
+      if (!stat(path, &st) && S_ISDIR(st.st_mode))
+      {
+	StreamLog log;
+	if (log.open(path))
+	{
+	  std::cerr << log.errorMessage() << std::endl;
+	  return false;
+	}
+	out.clear();
+	out.reserve(log.size());
+	log.copy(0, log.size(), out);
+	return true;
+      }
+      std::ifstream f(path, std::ios::binary);
+      if (!f)
+	return false;
+      std::ostringstream ss;
+      ss << f.rdbuf();
+      out = ss.str();
+      return true;
+    }
+
+    std::string benchmarkStream(const char* path, double seconds)
+    {
+      std::string s;
+      if (path && *path)
+      {
+	if (loadStream(path, s))
+	  return s;
+	std::cerr << "cannot read " << path << ", using synthetic stream"
+		  << std::endl;
+      }
+      return makeErs7Stream(seconds);
+    }
+  } // namespace bench
+} // namespace aibo
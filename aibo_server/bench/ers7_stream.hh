@@ -0,0 +1,28 @@
+/// \file bench/ers7_stream.hh
+/// \brief Sample URBI streams used as benchmark input.
+
+#ifndef AIBO_SERVER_BENCH_ERS7_STREAM_HH
+# define AIBO_SERVER_BENCH_ERS7_STREAM_HH
+
+# include <string>
+
+namespace aibo
+{
+  namespace bench
+  {
+    /// Build \a seconds worth of traffic shaped like an ERS-7 bridge
+    /// session: every joint polled at the 32 ms motor frame rate,
+    /// 208x160 JPEG camera frames at 30 Hz, and a sprinkle of ***
+    /// system and !!! error messages.
+    std::string makeErs7Stream(double seconds);
+
+    /// Read a captured stream, either a raw file or a StreamRecorder
+    /// log directory. Return false if it cannot be read.
+    bool loadStream(const char* path, std::string& out);
+
+    /// Either load \a path, or synthesize if it is null or empty.
+    std::string benchmarkStream(const char* path, double seconds);
+  } // namespace bench
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_BENCH_ERS7_STREAM_HH
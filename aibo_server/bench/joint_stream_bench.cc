@@ -0,0 +1,220 @@
+/// \file bench/joint_stream_bench.cc
+/// \brief JointStream throughput and latency against FakeUrbiServer,
+/// compared with one request per joint, sequential and pipelined.
+///
+/// Usage: joint_stream_bench [-c cycle_us] [-t seconds] [-d delay_us]
+///   -c  fake server kernel cycle, 0 for back to back (default: 0)
+///   -t  duration of each phase (default: 3)
+///   -d  emulated link round trip, e.g. 3000 for a WLAN (default: 0)
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <unistd.h>
+
+#include "aibo_server/fake_urbi_server.hh"
+#include "aibo_server/joint_stream.hh"
+#include "aibo_server/request_pipeline.hh"
+
+#include "bench_util.hh"
+
+namespace
+{
+  /// Pairs the n-th message sent by the server with the n-th received.
+  class LatencyProbe
+  {
+  public:
+    void sent()
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      sent_.push_back(aibo::bench::now());
+    }
+
+    void received()
+    {
+      double t = aibo::bench::now();
+      std::lock_guard<std::mutex> lock(lock_);
+      if (received_ < sent_.size())
+	latency_.push_back(t - sent_[received_]);
+      ++received_;
+    }
+
+    size_t count() const { return received_; }
+    std::vector<double>& latency() { return latency_; }
+
+  private:
+    std::mutex lock_;
+    std::vector<double> sent_;
+    std::vector<double> latency_;
+    size_t received_ = 0;
+  };
+
+  /// One syncGetDevice()-style request at a time.
+  class RoundTrip: public aibo::UrbiMessageHandler
+  {
+  public:
+    RoundTrip(aibo::UrbiConnection& c)
+      : connection_(c), done_(false)
+    {}
+
+    bool get(const std::string& device)
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      done_ = false;
+      if (connection_.sendf("rt: %s.val;\n", device.c_str()))
+	return false;
+      cond_.wait(lock, [this] { return done_; });
+      return true;
+    }
+
+    virtual void onMessage(const aibo::UrbiMessageView& msg)
+    {
+      if (msg.tag != aibo::StringRef("rt"))
+	return;
+      std::lock_guard<std::mutex> lock(lock_);
+      done_ = true;
+      cond_.notify_one();
+    }
+
+  private:
+    aibo::UrbiConnection& connection_;
+    std::mutex lock_;
+    std::condition_variable cond_;
+    bool done_;
+  };
+}
+
+int main(int argc, char** argv)
+{
+  unsigned cycle = 0;
+  double duration = 3;
+  unsigned delay = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:t:d:")) != -1)
+    switch (opt)
+    {
+    case 'c': cycle = strtoul(optarg, 0, 10); break;
+    case 't': duration = atof(optarg); break;
+    case 'd': delay = strtoul(optarg, 0, 10); break;
+    default:
+      fprintf(stderr, "usage: %s [-c cycle_us] [-t seconds] [-d delay_us]\n",
+	      argv[0]);
+      return 1;
+    }
+
+  const std::vector<std::string>& joints = aibo::defaultJointNames();
+  LatencyProbe probe;
+  aibo::FakeUrbiServer server(0, cycle);
+  server.setLinkDelay(delay);
+  server.setStreamObserver([&probe] (const std::string&) { probe.sent(); });
+  if (server.start())
+  {
+    perror("fake server");
+    return 1;
+  }
+
+  // Streaming.
+  {
+    aibo::UrbiConnection connection("localhost", server.port());
+    if (connection.connect())
+    {
+      fprintf(stderr, "%s\n", connection.errorMessage().c_str());
+      return 1;
+    }
+    aibo::JointStream stream(connection, joints);
+    stream.setCallback([&probe] (int, const double*, size_t)
+		       { probe.received(); });
+    connection.setHandler(&stream);
+    connection.start();
+    double start = aibo::bench::now();
+    stream.start();
+    usleep(static_cast<useconds_t>(duration * 1e6));
+    double elapsed = aibo::bench::now() - start;
+    size_t count = probe.count();
+    stream.stop();
+    connection.close();
+
+    std::vector<double>& lat = probe.latency();
+    printf("streaming, %zu joints, %u us cycle\n", joints.size(), cycle);
+    printf("  samples/sec:    %.0f\n", count / elapsed);
+    printf("  values/sec:     %.0f\n", count * joints.size() / elapsed);
+    printf("  latency p50:    %.1f us\n", aibo::bench::percentile(lat, 50) * 1e6);
+    printf("  latency p99:    %.1f us\n", aibo::bench::percentile(lat, 99) * 1e6);
+    printf("  latency max:    %.1f us\n", aibo::bench::percentile(lat, 100) * 1e6);
+  }
+
+  // One round trip per joint, as with USyncClient::syncGetDevice.
+  {
+    aibo::UrbiConnection connection("localhost", server.port());
+    if (connection.connect())
+    {
+      fprintf(stderr, "%s\n", connection.errorMessage().c_str());
+      return 1;
+    }
+    RoundTrip rt(connection);
+    connection.setHandler(&rt);
+    connection.start();
+    size_t samples = 0;
+    std::vector<double> lat;
+    double start = aibo::bench::now();
+    while (aibo::bench::now() - start < duration)
+    {
+      double t = aibo::bench::now();
+      for (size_t j = 0; j < joints.size(); ++j)
+	if (!rt.get(aibo::urbiDeviceName(joints[j])))
+	  return 1;
+      lat.push_back(aibo::bench::now() - t);
+      ++samples;
+    }
+    double elapsed = aibo::bench::now() - start;
+    connection.close();
+
+    printf("per-joint requests, %zu joints\n", joints.size());
+    printf("  samples/sec:    %.0f\n", samples / elapsed);
+    printf("  sample p50:     %.1f us\n", aibo::bench::percentile(lat, 50) * 1e6);
+    printf("  sample p99:     %.1f us\n", aibo::bench::percentile(lat, 99) * 1e6);
+  }
+
+  // Per-joint requests, all in flight at once.
+  {
+    aibo::UrbiConnection connection("localhost", server.port());
+    if (connection.connect())
+    {
+      fprintf(stderr, "%s\n", connection.errorMessage().c_str());
+      return 1;
+    }
+    aibo::RequestPipeline pipeline(connection);
+    connection.setHandler(&pipeline);
+    connection.start();
+    std::vector<std::string> devices;
+    for (size_t j = 0; j < joints.size(); ++j)
+      devices.push_back(aibo::urbiDeviceName(joints[j]));
+    std::vector<double> values;
+    size_t samples = 0;
+    std::vector<double> lat;
+    std::string error;
+    double start = aibo::bench::now();
+    while (aibo::bench::now() - start < duration)
+    {
+      double t = aibo::bench::now();
+      if (pipeline.getDevices(devices, values, 1.0, &error))
+      {
+	fprintf(stderr, "%s\n", error.c_str());
+	return 1;
+      }
+      lat.push_back(aibo::bench::now() - t);
+      ++samples;
+    }
+    double elapsed = aibo::bench::now() - start;
+    connection.close();
+
+    printf("pipelined requests, %zu joints\n", joints.size());
+    printf("  samples/sec:    %.0f\n", samples / elapsed);
+    printf("  sample p50:     %.1f us\n", aibo::bench::percentile(lat, 50) * 1e6);
+    printf("  sample p99:     %.1f us\n", aibo::bench::percentile(lat, 99) * 1e6);
+  }
+
+  server.stop();
+  return 0;
+}
@@ -0,0 +1,391 @@
+/// \file bench/kinematics_bench.cc
+/// \brief Leg forward kinematics and Jacobians: generated code against a
+/// generic chain walk, and against KDL when it is available.
+///
+/// Usage: kinematics_bench [-n iterations] [-c configurations]
+///   -n  evaluations of the four legs per case (default: 1000000)
+///   -c  random joint configurations cycled through (default: 1024)
+///
+/// Every case is also checked against the generic chain; the largest
+/// difference over all configurations is printed.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <unistd.h>
+#include <vector>
+
+#ifdef AIBO_HAVE_KDL
+# include <kdl/chain.hpp>
+# include <kdl/chainfksolverpos_recursive.hpp>
+# include <kdl/chainjnttojacsolver.hpp>
+#endif
+
+#include "aibo_server/kinematics.hh"
+
+#include "bench_util.hh"
+
+namespace
+{
+  using aibo::JointModel;
+  using aibo::KinematicChain;
+  using aibo::LEG_COUNT;
+  using aibo::LEG_DOF;
+  using aibo::Transform;
+
+  Transform origin(const JointModel& j)
+  {
+    double cr = cos(j.rpy[0]), sr = sin(j.rpy[0]);
+    double cp = cos(j.rpy[1]), sp = sin(j.rpy[1]);
+    double cy = cos(j.rpy[2]), sy = sin(j.rpy[2]);
+    Transform t =
+      {
+	{
+	  cy * cp, cy * sp * sr - sy * cr, cy * sp * cr + sy * sr,
+	  sy * cp, sy * sp * sr + cy * cr, sy * sp * cr - cy * sr,
+	  -sp, cp * sr, cp * cr
+	},
+	{j.xyz[0], j.xyz[1], j.xyz[2]}
+      };
+    return t;
+  }
+
+  /// What a URDF tree walk does: compose each joint origin and rotation
+  /// at run time.
+  class GenericChain
+  {
+  public:
+    explicit GenericChain(KinematicChain c)
+      : tip_(origin(aibo::chainTipJoint(c)))
+    {
+      for (unsigned i = 0; i < aibo::chainDof(c); ++i)
+      {
+	JointModel j = aibo::chainJoint(c, i);
+	origins_.push_back(origin(j));
+	axes_.push_back(Axis());
+	std::copy(j.axis, j.axis + 3, axes_.back().v);
+      }
+    }
+
+    void forward(const double* q, Transform& tip) const
+    {
+      Transform t = origins_[0];
+      for (size_t i = 0; i < origins_.size(); ++i)
+      {
+	if (i)
+	  t = aibo::compose(t, origins_[i]);
+	t = aibo::compose(t, rotation(axes_[i].v, q[i]));
+      }
+      tip = aibo::compose(t, tip_);
+    }
+
+    void jacobian(const double* q, Transform& tip, double* jac) const
+    {
+      size_t dof = origins_.size();
+      Transform frames[MAX_DOF];
+      Transform t = origins_[0];
+      for (size_t i = 0; i < dof; ++i)
+      {
+	if (i)
+	  t = aibo::compose(t, origins_[i]);
+	frames[i] = t;
+	t = aibo::compose(t, rotation(axes_[i].v, q[i]));
+      }
+      tip = aibo::compose(t, tip_);
+      for (size_t i = 0; i < dof; ++i)
+      {
+	const double* a = axes_[i].v;
+	const double* r = frames[i].r;
+	double z[3], d[3];
+	for (int k = 0; k < 3; ++k)
+	{
+	  z[k] = r[3 * k] * a[0] + r[3 * k + 1] * a[1] + r[3 * k + 2] * a[2];
+	  d[k] = tip.p[k] - frames[i].p[k];
+	}
+	for (int k = 0; k < 3; ++k)
+	{
+	  jac[k * dof + i] = z[(k + 1) % 3] * d[(k + 2) % 3]
+	    - z[(k + 2) % 3] * d[(k + 1) % 3];
+	  jac[(k + 3) * dof + i] = z[k];
+	}
+      }
+    }
+
+  private:
+    enum { MAX_DOF = 8 };
+
+    struct Axis
+    {
+      double v[3];
+    };
+
+    static Transform rotation(const double* a, double q)
+    {
+      double c = cos(q), s = sin(q), v = 1 - c;
+      Transform t =
+	{
+	  {
+	    a[0] * a[0] * v + c, a[0] * a[1] * v - a[2] * s,
+	    a[0] * a[2] * v + a[1] * s,
+	    a[0] * a[1] * v + a[2] * s, a[1] * a[1] * v + c,
+	    a[1] * a[2] * v - a[0] * s,
+	    a[0] * a[2] * v - a[1] * s, a[1] * a[2] * v + a[0] * s,
+	    a[2] * a[2] * v + c
+	  },
+	  {0, 0, 0}
+	};
+      return t;
+    }
+
+    std::vector<Transform> origins_;
+    std::vector<Axis> axes_;
+    Transform tip_;
+  };
+
+#ifdef AIBO_HAVE_KDL
+  /// The chain kdl_parser would build from the URDF.
+  KDL::Chain kdlChain(KinematicChain c)
+  {
+    KDL::Chain res;
+    for (unsigned i = 0; i < aibo::chainDof(c); ++i)
+    {
+      JointModel j = aibo::chainJoint(c, i);
+      KDL::Frame f(KDL::Rotation::RPY(j.rpy[0], j.rpy[1], j.rpy[2]),
+		   KDL::Vector(j.xyz[0], j.xyz[1], j.xyz[2]));
+      KDL::Vector axis = f.M * KDL::Vector(j.axis[0], j.axis[1], j.axis[2]);
+      res.addSegment(KDL::Segment(KDL::Joint(j.name, f.p, axis,
+					     KDL::Joint::RotAxis), f));
+    }
+    JointModel t = aibo::chainTipJoint(c);
+    res.addSegment(KDL::Segment(KDL::Joint(KDL::Joint::None),
+				KDL::Frame(KDL::Rotation::RPY(t.rpy[0], t.rpy[1],
+							      t.rpy[2]),
+					   KDL::Vector(t.xyz[0], t.xyz[1],
+						       t.xyz[2]))));
+    return res;
+  }
+#endif
+
+  double diff(const Transform& a, const Transform& b)
+  {
+    double res = 0;
+    for (int i = 0; i < 9; ++i)
+      res = std::max(res, std::fabs(a.r[i] - b.r[i]));
+    for (int i = 0; i < 3; ++i)
+      res = std::max(res, std::fabs(a.p[i] - b.p[i]));
+    return res;
+  }
+
+  double diff(const double* a, const double* b, size_t n)
+  {
+    double res = 0;
+    for (size_t i = 0; i < n; ++i)
+      res = std::max(res, std::fabs(a[i] - b[i]));
+    return res;
+  }
+
+  /// Make the compiler assume \a p is read, so that no output is
+  /// optimized away.
+  inline void escape(const void* p)
+  {
+    asm volatile("" : : "g"(p) : "memory");
+  }
+
+  struct Legs
+  {
+    double q[LEG_COUNT][LEG_DOF];
+  };
+
+  template <class Body>
+  void measure(const char* name, size_t n, const std::vector<Legs>& configs,
+	       Body body, double error)
+  {
+    double t = aibo::bench::now();
+    for (size_t i = 0; i < n; ++i)
+      body(configs[i % configs.size()]);
+    double elapsed = aibo::bench::now() - t;
+    printf("  %-28s %8.1f ns  %8.0f kHz  max diff %.1e\n", name,
+	   elapsed / n * 1e9, n / elapsed * 1e-3, error);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  size_t n = 1000000;
+  size_t count = 1024;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:c:")) != -1)
+    switch (opt)
+    {
+    case 'n': n = strtoul(optarg, 0, 10); break;
+    case 'c': count = std::max(1ul, strtoul(optarg, 0, 10)); break;
+    default:
+      fprintf(stderr, "usage: %s [-n iterations] [-c configurations]\n",
+	      argv[0]);
+      return 1;
+    }
+
+  std::vector<Legs> configs(count);
+  std::mt19937 rng(42);
+  for (size_t k = 0; k < count; ++k)
+    for (int l = 0; l < LEG_COUNT; ++l)
+      for (int i = 0; i < LEG_DOF; ++i)
+      {
+	JointModel j = aibo::chainJoint(KinematicChain(l), i);
+	std::uniform_real_distribution<double> d(std::min(j.lower, j.upper),
+						 std::max(j.lower, j.upper));
+	configs[k].q[l][i] = d(rng);
+      }
+
+  std::vector<GenericChain> generic;
+  for (int l = 0; l < LEG_COUNT; ++l)
+    generic.push_back(GenericChain(KinematicChain(l)));
+
+  // Reference results.
+  std::vector<Transform> tips(count * LEG_COUNT);
+  std::vector<double> jacs(count * LEG_COUNT * 6 * LEG_DOF);
+  for (size_t k = 0; k < count; ++k)
+    for (int l = 0; l < LEG_COUNT; ++l)
+      generic[l].jacobian(configs[k].q[l], tips[k * LEG_COUNT + l],
+			  &jacs[(k * LEG_COUNT + l) * 6 * LEG_DOF]);
+
+  Transform out[LEG_COUNT];
+  double jac[LEG_COUNT][6 * LEG_DOF];
+
+  double errScalar = 0, errBatch = 0, errScalarJac = 0, errBatchJac = 0;
+  for (size_t k = 0; k < count; ++k)
+  {
+    const Legs& c = configs[k];
+    for (int l = 0; l < LEG_COUNT; ++l)
+    {
+      aibo::jacobian(KinematicChain(l), c.q[l], out[l], jac[l]);
+      errScalar = std::max(errScalar, diff(out[l], tips[k * LEG_COUNT + l]));
+      errScalarJac = std::max(errScalarJac,
+			      diff(jac[l], &jacs[(k * LEG_COUNT + l) * 6
+						 * LEG_DOF], 6 * LEG_DOF));
+    }
+    aibo::jacobianLegs(c.q, out, jac);
+    for (int l = 0; l < LEG_COUNT; ++l)
+    {
+      errBatch = std::max(errBatch, diff(out[l], tips[k * LEG_COUNT + l]));
+      errBatchJac = std::max(errBatchJac,
+			     diff(jac[l], &jacs[(k * LEG_COUNT + l) * 6
+						* LEG_DOF], 6 * LEG_DOF));
+    }
+  }
+
+#ifdef AIBO_HAVE_KDL
+  std::vector<KDL::Chain> kdl;
+  for (int l = 0; l < LEG_COUNT; ++l)
+    kdl.push_back(kdlChain(KinematicChain(l)));
+  std::vector<KDL::ChainFkSolverPos_recursive> kdlFk;
+  std::vector<KDL::ChainJntToJacSolver> kdlJac;
+  for (int l = 0; l < LEG_COUNT; ++l)
+  {
+    kdlFk.push_back(KDL::ChainFkSolverPos_recursive(kdl[l]));
+    kdlJac.push_back(KDL::ChainJntToJacSolver(kdl[l]));
+  }
+  KDL::JntArray kq(LEG_DOF);
+  KDL::Frame kf;
+  KDL::Jacobian kj(LEG_DOF);
+  double errKdl = 0, errKdlJac = 0;
+  for (size_t k = 0; k < count; ++k)
+    for (int l = 0; l < LEG_COUNT; ++l)
+    {
+      for (int i = 0; i < LEG_DOF; ++i)
+	kq(i) = configs[k].q[l][i];
+      kdlFk[l].JntToCart(kq, kf);
+      kdlJac[l].JntToJac(kq, kj);
+      const Transform& t = tips[k * LEG_COUNT + l];
+      const double* j = &jacs[(k * LEG_COUNT + l) * 6 * LEG_DOF];
+      for (int r = 0; r < 3; ++r)
+      {
+	errKdl = std::max(errKdl, std::fabs(kf.p(r) - t.p[r]));
+	for (int c = 0; c < 3; ++c)
+	  errKdl = std::max(errKdl, std::fabs(kf.M(r, c) - t.r[3 * r + c]));
+      }
+      for (int r = 0; r < 6; ++r)
+	for (int i = 0; i < LEG_DOF; ++i)
+	  errKdlJac = std::max(errKdlJac,
+			       std::fabs(kj(r, i) - j[r * LEG_DOF + i]));
+    }
+#endif
+
+  printf("four legs, forward kinematics\n");
+  measure("generic chain", n, configs, [&] (const Legs& c)
+	  {
+	    for (int l = 0; l < LEG_COUNT; ++l)
+	      generic[l].forward(c.q[l], out[l]);
+	    escape(out);
+	  }, 0);
+#ifdef AIBO_HAVE_KDL
+  measure("KDL", n, configs, [&] (const Legs& c)
+	  {
+	    for (int l = 0; l < LEG_COUNT; ++l)
+	    {
+	      for (int i = 0; i < LEG_DOF; ++i)
+		kq(i) = c.q[l][i];
+	      kdlFk[l].JntToCart(kq, kf);
+	    }
+	    escape(&kf);
+	  }, errKdl);
+#endif
+  measure("generated, per leg", n, configs, [&] (const Legs& c)
+	  {
+	    aibo::ChainKinematics<aibo::CHAIN_LEG_RF>::forward(c.q[0], out[0]);
+	    aibo::ChainKinematics<aibo::CHAIN_LEG_LF>::forward(c.q[1], out[1]);
+	    aibo::ChainKinematics<aibo::CHAIN_LEG_RB>::forward(c.q[2], out[2]);
+	    aibo::ChainKinematics<aibo::CHAIN_LEG_LB>::forward(c.q[3], out[3]);
+	    escape(out);
+	  }, errScalar);
+  measure("generated, batched", n, configs, [&] (const Legs& c)
+	  {
+	    aibo::forwardLegs(c.q, out);
+	    escape(out);
+	  }, errBatch);
+
+  printf("four legs, forward kinematics and Jacobian\n");
+  measure("generic chain", n, configs, [&] (const Legs& c)
+	  {
+	    for (int l = 0; l < LEG_COUNT; ++l)
+	      generic[l].jacobian(c.q[l], out[l], jac[l]);
+	    escape(out);
+	    escape(jac);
+	  }, 0);
+#ifdef AIBO_HAVE_KDL
+  measure("KDL", n, configs, [&] (const Legs& c)
+	  {
+	    for (int l = 0; l < LEG_COUNT; ++l)
+	    {
+	      for (int i = 0; i < LEG_DOF; ++i)
+		kq(i) = c.q[l][i];
+	      kdlFk[l].JntToCart(kq, kf);
+	      kdlJac[l].JntToJac(kq, kj);
+	    }
+	    escape(&kj);
+	  }, errKdlJac);
+#endif
+  measure("generated, per leg", n, configs, [&] (const Legs& c)
+	  {
+	    aibo::ChainKinematics<aibo::CHAIN_LEG_RF>::jacobian(c.q[0], out[0],
+								 jac[0]);
+	    aibo::ChainKinematics<aibo::CHAIN_LEG_LF>::jacobian(c.q[1], out[1],
+								 jac[1]);
+	    aibo::ChainKinematics<aibo::CHAIN_LEG_RB>::jacobian(c.q[2], out[2],
+								 jac[2]);
+	    aibo::ChainKinematics<aibo::CHAIN_LEG_LB>::jacobian(c.q[3], out[3],
+								 jac[3]);
+	    escape(out);
+	    escape(jac);
+	  }, errScalarJac);
+  measure("generated, batched", n, configs, [&] (const Legs& c)
+	  {
+	    aibo::jacobianLegs(c.q, out, jac);
+	    escape(out);
+	    escape(jac);
+	  }, errBatchJac);
+
+  return 0;
+}
@@ -0,0 +1,111 @@
+/// \file bench/parser_bench.cc
+/// \brief Throughput and allocation rate of UrbiStreamParser.
+///
+/// Usage: parser_bench [-f capture] [-c chunk] [-n passes] [-k]
+///   -f  raw URBI stream or urbi_record log to replay
+///       (default: synthetic ERS-7 session)
+///   -c  bytes handed to the parser per read (default: 1460, one TCP segment)
+///   -n  number of passes over the stream (default: 20)
+///   -k  keep every message, as UAbstractClient does with UMessage
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "aibo_server/urbi_stream_parser.hh"
+
+#include "bench_util.hh"
+#include "ers7_stream.hh"
+
+namespace
+{
+  class CountingHandler: public aibo::UrbiMessageHandler
+  {
+  public:
+    CountingHandler(bool keep)
+      : keep(keep), messages(0), binaries(0), checksum(0)
+    {}
+
+    virtual void onMessage(const aibo::UrbiMessageView& msg)
+    {
+      ++messages;
+      binaries += msg.binaryCount;
+      checksum += msg.timestamp + msg.tag.size() + msg.text.size();
+      if (keep)
+      {
+	aibo::UrbiMessage copy(msg);
+	checksum += copy.text().size();
+      }
+    }
+
+    bool keep;
+    size_t messages;
+    size_t binaries;
+    size_t checksum;
+  };
+}
+
+int main(int argc, char** argv)
+{
+  const char* capture = 0;
+  size_t chunk = 1460;
+  int passes = 20;
+  bool keep = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:c:n:k")) != -1)
+    switch (opt)
+    {
+    case 'f': capture = optarg; break;
+    case 'c': chunk = strtoul(optarg, 0, 10); break;
+    case 'n': passes = atoi(optarg); break;
+    case 'k': keep = true; break;
+    default:
+      fprintf(stderr, "usage: %s [-f capture] [-c chunk] [-n passes] [-k]\n",
+	      argv[0]);
+      return 1;
+    }
+  if (!chunk)
+    chunk = 1;
+
+  std::string stream = aibo::bench::benchmarkStream(capture, 10);
+  aibo::UrbiStreamParser parser;
+  CountingHandler handler(keep);
+
+  // Warm up so that buffer growth is not counted.
+  parser.feed(stream.data(), std::min(stream.size(), size_t(1 << 20)));
+  parser.parse(handler);
+  parser.reset();
+  handler.messages = handler.binaries = 0;
+
+  size_t allocs = aibo::bench::allocationCount();
+  double start = aibo::bench::now();
+  for (int p = 0; p < passes; ++p)
+    for (size_t off = 0; off < stream.size(); off += chunk)
+    {
+      size_t n = std::min(chunk, stream.size() - off);
+      size_t avail;
+      char* dst = parser.prepare(n, avail);
+      if (!dst)
+      {
+	fprintf(stderr, "message exceeds maximum buffer size\n");
+	return 1;
+      }
+      memcpy(dst, stream.data() + off, n);
+      parser.commit(n);
+      parser.parse(handler);
+    }
+  double elapsed = aibo::bench::now() - start;
+  allocs = aibo::bench::allocationCount() - allocs;
+
+  double mb = double(stream.size()) * passes / (1024 * 1024);
+  printf("stream:        %zu bytes, %s\n", stream.size(),
+	 capture ? capture : "synthetic ERS-7");
+  printf("messages:      %zu (%zu binaries)\n", handler.messages,
+	 handler.binaries);
+  printf("messages/sec:  %.0f\n", handler.messages / elapsed);
+  printf("throughput:    %.1f MB/s\n", mb / elapsed);
+  printf("allocs/msg:    %.4f\n", double(allocs) / handler.messages);
+  printf("checksum:      %zu\n", handler.checksum);
+  return 0;
+}
@@ -0,0 +1,230 @@
+/// \file bench/send_bench.cc
+/// \brief Command throughput and latency of UrbiConnection with 1 to 16
+/// producer threads, with and without the send queue.
+///
+/// Usage: send_bench [-n producers] [-t seconds] [-r rate] [-d depth] [-P]
+///   -n  comma-separated producer counts (default: 1,2,4,8,16)
+///   -t  duration of each run (default: 2)
+///   -r  total commands/s offered by the producers, 0 for as fast as
+///       possible (default: 0).  Latencies are only meaningful below
+///       saturation; above it they measure the socket buffers.
+///   -d  send queue depth (default: 256)
+///   -P  first producer sends at PRIORITY_HIGH, the others at
+///       PRIORITY_LOW, and latencies are reported per lane
+///
+/// Commands go to a loopback TCP sink that timestamps their arrival.
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+#include "aibo_server/urbi_connection.hh"
+
+#include "bench_util.hh"
+
+namespace
+{
+  long long nowNs()
+  {
+    return static_cast<long long>(aibo::bench::now() * 1e9);
+  }
+
+  /// Accepts one connection and reads "bench: <lane> <ns>;" commands.
+  class Sink
+  {
+  public:
+    Sink()
+      : listen_(-1), fd_(-1), port_(0), commands_(0)
+    {
+      for (int i = 0; i < aibo::PRIORITY_COUNT; ++i)
+	latency_[i].reserve(1 << 22);
+    }
+
+    ~Sink()
+    {
+      if (thread_.joinable())
+	thread_.join();
+      if (listen_ >= 0)
+	::close(listen_);
+    }
+
+    int listen()
+    {
+      listen_ = socket(AF_INET, SOCK_STREAM, 0);
+      sockaddr_in addr;
+      memset(&addr, 0, sizeof addr);
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      socklen_t len = sizeof addr;
+      if (listen_ < 0
+	  || bind(listen_, reinterpret_cast<sockaddr*>(&addr), sizeof addr)
+	  || ::listen(listen_, 1)
+	  || getsockname(listen_, reinterpret_cast<sockaddr*>(&addr), &len))
+	return -1;
+      port_ = ntohs(addr.sin_port);
+      thread_ = std::thread(&Sink::run, this);
+      return 0;
+    }
+
+    int port() const { return port_; }
+    size_t commands() const { return commands_; }
+    std::vector<double>& latency(int lane) { return latency_[lane]; }
+
+    /// Wait for the connection to close.
+    void join()
+    {
+      thread_.join();
+    }
+
+  private:
+    void run()
+    {
+      fd_ = accept(listen_, 0, 0);
+      std::string line;
+      char buf[64 * 1024];
+      ssize_t n;
+      while ((n = recv(fd_, buf, sizeof buf, 0)) > 0 || (n < 0 && errno == EINTR))
+      {
+	long long t = nowNs();
+	for (ssize_t i = 0; i < n; ++i)
+	  if (buf[i] != '\n')
+	    line += buf[i];
+	  else
+	  {
+	    int lane;
+	    long long sent;
+	    if (sscanf(line.c_str(), "bench: %d %lld;", &lane, &sent) == 2
+		&& 0 <= lane && lane < aibo::PRIORITY_COUNT
+		&& latency_[lane].size() < latency_[lane].capacity())
+	      latency_[lane].push_back((t - sent) * 1e-9);
+	    ++commands_;
+	    line.clear();
+	  }
+      }
+      ::close(fd_);
+    }
+
+    int listen_;
+    int fd_;
+    int port_;
+    size_t commands_;
+    std::vector<double> latency_[aibo::PRIORITY_COUNT];
+    std::thread thread_;
+  };
+
+  void
+  run(size_t producers, double duration, double rate, size_t depth,
+      bool queued, bool lanes)
+  {
+    Sink sink;
+    if (sink.listen())
+    {
+      perror("sink");
+      exit(1);
+    }
+    aibo::UrbiConnection connection("127.0.0.1", sink.port());
+    if (connection.connect())
+    {
+      fprintf(stderr, "%s\n", connection.errorMessage().c_str());
+      exit(1);
+    }
+    if (queued)
+      connection.enableSendQueue(depth);
+
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> threads;
+    double start = aibo::bench::now();
+    for (size_t p = 0; p < producers; ++p)
+      threads.push_back(std::thread([&, p]
+	{
+	  aibo::SendPriority prio = !lanes ? aibo::PRIORITY_NORMAL
+	    : p ? aibo::PRIORITY_LOW : aibo::PRIORITY_HIGH;
+	  double period = rate > 0 ? producers / rate : 0;
+	  double next = aibo::bench::now();
+	  while (!stop)
+	  {
+	    if (connection.sendf(prio, "bench: %d %lld;\n", prio, nowNs()))
+	      break;
+	    if (period > 0)
+	    {
+	      next += period;
+	      double wait = next - aibo::bench::now();
+	      if (wait > 0)
+		usleep(static_cast<useconds_t>(wait * 1e6));
+	    }
+	  }
+	}));
+    usleep(static_cast<useconds_t>(duration * 1e6));
+    stop = true;
+    for (size_t p = 0; p < threads.size(); ++p)
+      threads[p].join();
+    double elapsed = aibo::bench::now() - start;
+    connection.close();
+    sink.join();
+
+    printf("%-6s %2zu producers  %9.0f cmd/s", queued ? "queue" : "mutex",
+	   producers, sink.commands() / elapsed);
+    for (int l = 0; l < aibo::PRIORITY_COUNT; ++l)
+    {
+      std::vector<double>& lat = sink.latency(l);
+      if (lat.empty())
+	continue;
+      static const char* names[] = { "high", "normal", "low" };
+      printf("  %s p50 %7.1f us p99 %8.1f us", names[l],
+	     aibo::bench::percentile(lat, 50) * 1e6,
+	     aibo::bench::percentile(lat, 99) * 1e6);
+    }
+    printf("\n");
+  }
+}
+
+int main(int argc, char** argv)
+{
+  std::vector<size_t> counts;
+  double duration = 2;
+  double rate = 0;
+  size_t depth = 256;
+  bool lanes = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:t:r:d:P")) != -1)
+    switch (opt)
+    {
+    case 'n':
+      for (char* p = optarg; *p; )
+      {
+	counts.push_back(strtoul(p, &p, 10));
+	if (*p == ',')
+	  ++p;
+	else if (*p)
+	  break;
+      }
+      break;
+    case 't': duration = atof(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 'd': depth = strtoul(optarg, 0, 10); break;
+    case 'P': lanes = true; break;
+    default:
+      fprintf(stderr, "usage: %s [-n producers] [-t seconds] [-r rate] "
+	      "[-d depth] [-P]\n", argv[0]);
+      return 1;
+    }
+  if (counts.empty())
+  {
+    size_t def[] = { 1, 2, 4, 8, 16 };
+    counts.assign(def, def + 5);
+  }
+
+  for (size_t i = 0; i < counts.size(); ++i)
+  {
+    run(counts[i], duration, rate, depth, false, lanes);
+    run(counts[i], duration, rate, depth, true, lanes);
+  }
+  return 0;
+}
@@ -0,0 +1,242 @@
+/// \file bench/value_bench.cc
+/// \brief Parse-and-convert throughput and allocations of UrbiValue,
+/// against a value laid out like urbi::UValue.
+///
+/// Usage: value_bench [-n iterations] [-e elements]
+///   -n  parses per case (default: 1000000)
+///   -e  elements of the numeric list, 20 for a joint reading (default: 20)
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "aibo_server/urbi_value.hh"
+
+#include "bench_util.hh"
+
+namespace
+{
+  /// urbi::UValue as declared in uvalue.hh: numbers in place, anything
+  /// else behind a pointer, and lists of separately allocated values.
+  /// Conversions go through deep copies, as its operator UList() does.
+  struct LegacyValue
+  {
+    enum Type { DOUBLE, STRING, LIST, VOID };
+
+    LegacyValue()
+      : type(VOID), val(0), storage(0)
+    {}
+
+    LegacyValue(const LegacyValue& v)
+      : type(VOID), val(0), storage(0)
+    {
+      *this = v;
+    }
+
+    LegacyValue& operator=(const LegacyValue& v)
+    {
+      if (this == &v)
+	return *this;
+      clear();
+      type = v.type;
+      val = v.val;
+      if (type == STRING)
+	string = new std::string(*v.string);
+      else if (type == LIST)
+      {
+	list = new std::vector<LegacyValue*>;
+	for (size_t i = 0; i < v.list->size(); ++i)
+	  list->push_back(new LegacyValue(*(*v.list)[i]));
+      }
+      return *this;
+    }
+
+    ~LegacyValue()
+    {
+      clear();
+    }
+
+    void clear()
+    {
+      if (type == STRING)
+	delete string;
+      else if (type == LIST)
+      {
+	for (size_t i = 0; i < list->size(); ++i)
+	  delete (*list)[i];
+	delete list;
+      }
+      type = VOID;
+    }
+
+    const char* parse(const char* p, const char* end)
+    {
+      while (p < end && *p == ' ')
+	++p;
+      if (p == end)
+	return 0;
+      if (*p == '"')
+      {
+	const char* q = static_cast<const char*>(memchr(p + 1, '"', end - p - 1));
+	if (!q)
+	  return 0;
+	type = STRING;
+	string = new std::string(p + 1, q);
+	return q + 1;
+      }
+      if (*p == '[')
+      {
+	type = LIST;
+	list = new std::vector<LegacyValue*>;
+	++p;
+	for (;;)
+	{
+	  while (p < end && (*p == ' ' || *p == ','))
+	    ++p;
+	  if (p == end)
+	    return 0;
+	  if (*p == ']')
+	    return p + 1;
+	  LegacyValue* v = new LegacyValue;
+	  list->push_back(v);
+	  if (!(p = v->parse(p, end)))
+	    return 0;
+	}
+      }
+      char* next;
+      val = strtod(p, &next);
+      if (next == p)
+	return 0;
+      type = DOUBLE;
+      return next;
+    }
+
+    /// uvalue_cast<UList> and then reading each element.
+    bool toNumbers(std::vector<double>& out) const
+    {
+      out.clear();
+      if (type != LIST)
+	return false;
+      LegacyValue copy(*this);
+      for (size_t i = 0; i < copy.list->size(); ++i)
+	out.push_back((*copy.list)[i]->val);
+      return true;
+    }
+
+    Type type;
+    double val;
+    union
+    {
+      std::string* string;
+      std::vector<LegacyValue*>* list;
+      void* storage;
+    };
+  };
+
+  template <class Body>
+  void measure(const char* name, size_t n, Body body)
+  {
+    size_t allocs = aibo::bench::allocationCount();
+    double t = aibo::bench::now();
+    for (size_t i = 0; i < n; ++i)
+      body();
+    double elapsed = aibo::bench::now() - t;
+    allocs = aibo::bench::allocationCount() - allocs;
+    printf("  %-28s %10.0f /s  %6.2f allocs each\n", name, n / elapsed,
+	   double(allocs) / n);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  size_t n = 1000000;
+  size_t elements = 20;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:e:")) != -1)
+    switch (opt)
+    {
+    case 'n': n = strtoul(optarg, 0, 10); break;
+    case 'e': elements = strtoul(optarg, 0, 10); break;
+    default:
+      fprintf(stderr, "usage: %s [-n iterations] [-e elements]\n", argv[0]);
+      return 1;
+    }
+
+  // A joint reading as JointStream receives it, NUL terminated for the
+  // strtod of the legacy parser.
+  std::string numbers = "[";
+  for (size_t i = 0; i < elements; ++i)
+  {
+    char buf[32];
+    snprintf(buf, sizeof buf, i ? ", %.6f" : "%.6f", i * 3.25 - 17);
+    numbers += buf;
+  }
+  numbers += "]";
+  const std::string mixed = "[12.5, \"legLF1\", [0, 1, 0.5], \"on\"]";
+
+  size_t checksum = 0;
+  std::vector<double> out;
+  out.reserve(elements);
+
+  printf("numeric list, %zu elements\n", elements);
+  {
+    aibo::UrbiValue v;
+    measure("UrbiValue parse, reused", n, [&]
+	    {
+	      v.parse(numbers);
+	      checksum += v.size();
+	    });
+    measure("UrbiValue parse + vector", n, [&]
+	    {
+	      v.parse(numbers);
+	      v.toNumbers(out);
+	      checksum += out.size();
+	    });
+    measure("UrbiValue parse, fresh", n, [&]
+	    {
+	      aibo::UrbiValue w;
+	      w.parse(numbers);
+	      checksum += w.size();
+	    });
+    measure("UrbiValue move", n, [&]
+	    {
+	      aibo::UrbiValue w(std::move(v));
+	      v = std::move(w);
+	      checksum += v.size();
+	    });
+  }
+  measure("UValue-style parse", n, [&]
+	  {
+	    LegacyValue v;
+	    v.parse(numbers.data(), numbers.data() + numbers.size());
+	    checksum += v.list->size();
+	  });
+  measure("UValue-style parse + vector", n, [&]
+	  {
+	    LegacyValue v;
+	    v.parse(numbers.data(), numbers.data() + numbers.size());
+	    v.toNumbers(out);
+	    checksum += out.size();
+	  });
+
+  printf("mixed list: %s\n", mixed.c_str());
+  {
+    aibo::UrbiValue v;
+    measure("UrbiValue parse, reused", n, [&]
+	    {
+	      v.parse(mixed);
+	      checksum += v.size();
+	    });
+  }
+  measure("UValue-style parse", n, [&]
+	  {
+	    LegacyValue v;
+	    v.parse(mixed.data(), mixed.data() + mixed.size());
+	    checksum += v.list->size();
+	  });
+
+  return checksum ? 0 : 1;
+}
@@ -0,0 +1,320 @@
+/// \file aibo_server/audio_stream.hh
+/// \brief Streaming microphone capture and paced speaker playback.
+
+#ifndef AIBO_SERVER_AUDIO_STREAM_HH
+# define AIBO_SERVER_AUDIO_STREAM_HH
+
+# include <atomic>
+# include <condition_variable>
+# include <cstdio>
+# include <functional>
+# include <mutex>
+# include <stdint.h>
+# include <string>
+# include <thread>
+# include <vector>
+
+# include "aibo_server/spsc_ring.hh"
+# include "aibo_server/urbi_connection.hh"
+
+namespace aibo
+{
+  /// PCM layout of a sound binary.
+  struct AudioFormat
+  {
+    /// The ERS-7 microphones and speaker: 16 kHz, 16-bit, stereo.
+    AudioFormat()
+      : channels(2), rate(16000), sampleBits(16), sampleSigned(true)
+    {}
+
+    unsigned channels;
+    /// Frames per second.
+    unsigned rate;
+    unsigned sampleBits;
+    bool sampleSigned;
+
+    /// Bytes of one sample of every channel.
+    size_t frameBytes() const { return channels * sampleBits / 8; }
+    double bytesPerSecond() const { return double(frameBytes()) * rate; }
+  };
+
+  /// Parse the header of a sound binary, e.g. "raw 2 16000 16 1" (format,
+  /// channels, rate, sample size, 1 for signed or 2 for unsigned
+  /// samples), as in UBinary.  \a wav tells whether the data starts
+  /// with a WAV header.  Return false if the header is not a sound.
+  bool parseSoundHeader(const StringRef& header, AudioFormat& format,
+			bool& wav);
+
+  /// Reads the samples of a WAV file a block at a time, so that clips
+  /// of any length play in bounded memory.
+  class WavReader
+  {
+  public:
+    WavReader();
+    ~WavReader();
+
+    /// Open \a path and read its header.  Return 0 on success, -1 on
+    /// failure; errorMessage() then describes the problem.
+    int open(const std::string& path);
+    void close();
+
+    const AudioFormat& format() const { return format_; }
+    /// Bytes of samples in the file.
+    size_t size() const { return size_; }
+    double duration() const { return size_ / format_.bytesPerSecond(); }
+
+    /// Read at most \a len bytes of samples.  Return the number read, 0
+    /// at the end of the samples, -1 on error.
+    long read(char* buffer, size_t len);
+
+    const std::string& errorMessage() const { return errorMessage_; }
+
+  private:
+    WavReader(const WavReader&);
+    WavReader& operator=(const WavReader&);
+
+    int fail(const std::string& msg);
+
+    FILE* file_;
+    AudioFormat format_;
+    size_t size_;
+    size_t left_;
+    std::string errorMessage_;
+  };
+
+  /*--------------.
+  | Microphone.   |
+  `--------------*/
+
+  /// Settings of a MicrophoneStream.
+  struct MicrophoneConfig
+  {
+    MicrophoneConfig()
+      : chunkBytes(1024),
+	ringBytes(32 * 1024),
+	tag("aibo_micro")
+    {}
+
+    /// Bytes per published chunk, rounded down to a multiple of 4 so
+    /// that chunks hold whole 16-bit stereo frames; 1024 bytes are
+    /// 16 ms of ERS-7 audio.
+    size_t chunkBytes;
+    /// Captured audio that may wait for the publisher.  Binaries that
+    /// do not fit are dropped.
+    size_t ringBytes;
+    /// Tag of the micro.val messages.
+    std::string tag;
+  };
+
+  /// Counters describing what happened to received sound binaries.
+  struct MicrophoneStats
+  {
+    MicrophoneStats()
+      : received(0), published(0), overruns(0), errors(0)
+    {}
+
+    /// Binaries received.
+    std::atomic<size_t> received;
+    /// Chunks published.
+    std::atomic<size_t> published;
+    /// Binaries dropped because the publisher was behind.
+    std::atomic<size_t> overruns;
+    /// Binaries that are not sound.
+    std::atomic<size_t> errors;
+  };
+
+  /// A fixed-size piece of the captured stream.
+  struct AudioChunk
+  {
+    /// Valid during the callback only.
+    const uint8_t* data;
+    size_t size;
+    AudioFormat format;
+    /// Chunks published before this one.
+    unsigned long long seq;
+    /// Server timestamp of the binary that completed the chunk.
+    int timestamp;
+    /// Arrival time of that binary, from steadyTime().
+    double received;
+  };
+
+  /// Subscribes once to micro.val and republishes the samples as a
+  /// continuous stream of small chunks.
+  /*! Replaces USyncClient::syncGetSound(), which records a block of a
+    given duration and returns only when it is over, so that its
+    latency is the length of the block.  Here the robot pushes a binary
+    at every cycle; the receive thread copies it into a lock-free ring
+    and returns, and a publisher thread cuts the ring into chunks of
+    chunkBytes, calling the callback as soon as each one is complete.
+    Memory is fixed at construction: when the publisher falls behind
+    by more than ringBytes, incoming binaries are dropped and counted
+    as overruns.  The callback is called from the publisher thread.  */
+  class MicrophoneStream: public UrbiMessageHandler
+  {
+  public:
+    typedef std::function<void (const AudioChunk&)> Callback;
+
+    MicrophoneStream(UrbiConnection& connection,
+		     const MicrophoneConfig& config = MicrophoneConfig());
+    virtual ~MicrophoneStream();
+
+    void setCallback(const Callback& cb) { callback_ = cb; }
+
+    /// Start the server-side loop.  Return 0 on success.
+    int start();
+    /// Stop the server-side loop.
+    int stop();
+
+    const MicrophoneStats& stats() const { return stats_; }
+    const MicrophoneConfig& config() const { return config_; }
+
+    virtual void onMessage(const UrbiMessageView& msg);
+
+  private:
+    MicrophoneStream(const MicrophoneStream&);
+    MicrophoneStream& operator=(const MicrophoneStream&);
+
+    /// Where a binary ends in the ring, and when it arrived.
+    struct Mark
+    {
+      uint64_t end;
+      double received;
+      int timestamp;
+      AudioFormat format;
+    };
+
+    void run();
+
+    UrbiConnection& connection_;
+    MicrophoneConfig config_;
+    Callback callback_;
+    MicrophoneStats stats_;
+    SpscRing<uint8_t> ring_;
+    SpscRing<Mark> marks_;
+    /// Bytes pushed so far; receive thread only.
+    uint64_t pushed_;
+
+    std::atomic<bool> stopping_;
+    std::atomic<bool> sleeping_;
+    std::mutex lock_;
+    std::condition_variable work_;
+    std::thread thread_;
+  };
+
+  /*-----------.
+  | Speaker.   |
+  `-----------*/
+
+  /// Settings of a SpeakerStream.
+  struct SpeakerConfig
+  {
+    SpeakerConfig()
+      : chunkBytes(2048),
+	leadMs(100),
+	tag("aibo_speaker")
+    {}
+
+    /// Format of the samples the source provides.
+    AudioFormat format;
+    /// Bytes per speaker.val binary, rounded down to whole frames.
+    size_t chunkBytes;
+    /// Audio kept queued on the robot, to ride over network jitter.
+    unsigned leadMs;
+    /// Tag of the speaker.remain queries.
+    std::string tag;
+  };
+
+  /// Counters describing playback.
+  struct SpeakerStats
+  {
+    SpeakerStats()
+      : chunks(0), bytes(0), underruns(0), remainReplies(0)
+    {}
+
+    std::atomic<size_t> chunks;
+    std::atomic<unsigned long long> bytes;
+    /// Chunks sent after the robot had run out of audio.
+    std::atomic<size_t> underruns;
+    /// speaker.remain replies used to correct the pacing.
+    std::atomic<size_t> remainReplies;
+  };
+
+  /// Plays a source of samples on the speaker as it is read.
+  /*! Replaces UAbstractClient::sendSound(), which needs the whole clip
+    in a USound.  A thread reads chunkBytes at a time from the source
+    and sends each as one speaker.val binary, keeping about leadMs of
+    audio ahead of what the robot plays and no more.  The amount queued
+    on the robot is tracked from the bytes sent and the clock, and
+    corrected by a speaker.remain query sent after a chunk whenever the
+    previous one was answered.  Memory on either side is bounded by the
+    lead and one chunk, whatever the length of the clip.  The stream
+    must receive the connection's messages for the corrections to
+    apply.  */
+  class SpeakerStream: public UrbiMessageHandler
+  {
+  public:
+    /// Fill \a buffer with at most \a len bytes.  Return the number of
+    /// bytes, 0 if none is available yet, or -1 once the source is
+    /// exhausted.  Called from the playback thread.
+    typedef std::function<long (char* buffer, size_t len)> Source;
+
+    SpeakerStream(UrbiConnection& connection,
+		  const SpeakerConfig& config = SpeakerConfig());
+    /// Calls stop().
+    virtual ~SpeakerStream();
+
+    /// Start playing \a source.  Return 0 on success, -1 if already
+    /// playing.
+    int play(const Source& source);
+    /// Stop reading the source.  What the robot has queued still plays.
+    void stop();
+    /// Wait until the source is exhausted and the robot has played
+    /// what it was sent.
+    void wait();
+    /// Return true until the source is exhausted or stop() is called.
+    bool playing() const { return playing_; }
+
+    /// Estimated seconds of audio queued on the robot.
+    double queued() const;
+
+    const SpeakerStats& stats() const { return stats_; }
+    const SpeakerConfig& config() const { return config_; }
+
+    /// Handles the replies to the speaker.remain queries.
+    virtual void onMessage(const UrbiMessageView& msg);
+
+  private:
+    SpeakerStream(const SpeakerStream&);
+    SpeakerStream& operator=(const SpeakerStream&);
+
+    void run(Source source);
+    /// Read up to a chunk from \a source into \a buffer, stopping
+    /// early when it has nothing more yet.  Set \a end once it is
+    /// exhausted.  Return the size read.
+    size_t fill(const Source& source, char* buffer, bool& end);
+    /// Send the \a size bytes at \a data, which has room for the
+    /// header before it and the query after it.  Return 0 on success.
+    int send(char* data, size_t size);
+
+    UrbiConnection& connection_;
+    SpeakerConfig config_;
+    SpeakerStats stats_;
+    /// Header, chunk, and the speaker.remain query.
+    std::vector<char> packet_;
+
+    std::atomic<bool> playing_;
+    std::atomic<bool> stopping_;
+    mutable std::mutex lock_;
+    std::condition_variable wake_;
+    /// steadyTime() at which the robot runs out of audio.
+    double emptyAt_;
+    /// Bytes sent, and bytes sent when the pending query was.
+    unsigned long long sent_;
+    unsigned long long sentAtQuery_;
+    bool queryPending_;
+    std::thread thread_;
+  };
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_AUDIO_STREAM_HH
@@ -0,0 +1,105 @@
+/// \file aibo_server/callback_table.hh
+/// \brief Tag-indexed callback dispatch with a lock-free read path.
+
+#ifndef AIBO_SERVER_CALLBACK_TABLE_HH
+# define AIBO_SERVER_CALLBACK_TABLE_HH
+
+# include <atomic>
+# include <functional>
+# include <memory>
+# include <mutex>
+# include <string>
+# include <vector>
+
+# include "aibo_server/urbi_stream_parser.hh"
+
+namespace aibo
+{
+  /// Return value of a callback, as urbi::UCallbackAction.
+  enum CallbackAction
+    {
+      URBI_CONTINUE = 0,	///< Keep the callback registered.
+      URBI_REMOVE		///< Unregister the callback.
+    };
+
+  /// Identifies a registration, as returned by UAbstractClient::setCallback().
+  typedef unsigned CallbackId;
+
+  /// Routes messages to the callbacks registered for their tag.
+  /*! Replaces the callback list of UAbstractClient::notifyCallbacks(),
+    which was scanned linearly under a lock for every message.  Here
+    dispatch looks the tag up in an immutable hash index, interned once
+    per distinct tag, and takes no lock: registrations build a new
+    index and publish it with an atomic swap, and the old index is
+    freed once no dispatch can still be using it.  Dispatch does not
+    allocate.
+
+    The table owns the callbacks.  They are destroyed when removed,
+    either explicitly or by returning URBI_REMOVE.  Callbacks may add or
+    remove registrations, their own included, while being dispatched.
+    A callback removed by another thread may still be running, or about
+    to run for a message already being dispatched, when remove()
+    returns.
+
+    Callbacks registered for the tag of a message run first, in
+    registration order, then ERROR_TAG callbacks for error messages,
+    then WILDCARD_TAG callbacks.  */
+  class CallbackTable: public UrbiMessageHandler
+  {
+  public:
+    typedef std::function<CallbackAction (const UrbiMessageView&)> Callback;
+
+    /// Registrations under this tag receive every message.
+    static const char* const WILDCARD_TAG;
+    /// Registrations under this tag receive every MESSAGE_ERROR message.
+    static const char* const ERROR_TAG;
+
+    CallbackTable();
+    /// No dispatch may be running.
+    virtual ~CallbackTable();
+
+    /// Call \a cb for each message tagged \a tag.  Return its id.
+    CallbackId add(const std::string& tag, const Callback& cb);
+    /// Forward messages tagged \a tag to \a handler, which is not owned.
+    CallbackId add(const std::string& tag, UrbiMessageHandler& handler);
+    /// Unregister \a id. Return false if it was not registered.
+    bool remove(CallbackId id);
+    /// Unregister every callback of \a tag. Return their number.
+    size_t removeTag(const std::string& tag);
+    void clear();
+
+    /// Number of registered callbacks.
+    size_t size() const;
+
+    virtual void onMessage(const UrbiMessageView& msg);
+
+  private:
+    CallbackTable(const CallbackTable&);
+    CallbackTable& operator=(const CallbackTable&);
+
+    struct Entry;
+    typedef std::shared_ptr<Entry> EntryPtr;
+    typedef std::vector<EntryPtr> Entries;
+    struct Index;
+    class ReadGuard;
+
+    void call(const Entries& entries, const UrbiMessageView& msg);
+    /// Rebuild the index from entries_ and publish it.  lock_ held.
+    void publish();
+    /// Free retired indexes if no dispatch is running.  lock_ held.
+    void reclaim();
+
+    std::atomic<const Index*> current_;
+    std::atomic<unsigned> readers_;
+    std::atomic<size_t> retiredCount_;
+
+    /// Serializes writers and guards the members below.
+    mutable std::mutex lock_;
+    Entries entries_;
+    std::vector<const Index*> retired_;
+    CallbackId nextId_;
+  };
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_CALLBACK_TABLE_HH
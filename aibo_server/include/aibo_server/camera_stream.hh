@@ -0,0 +1,318 @@
+/// \file aibo_server/camera_stream.hh
+/// \brief Streaming camera capture with decoding on a worker pool.
+
+#ifndef AIBO_SERVER_CAMERA_STREAM_HH
+# define AIBO_SERVER_CAMERA_STREAM_HH
+
+# include <atomic>
+# include <condition_variable>
+# include <functional>
+# include <mutex>
+# include <string>
+# include <thread>
+# include <vector>
+
+# include "aibo_server/image_conversion.hh"
+# include "aibo_server/object_pool.hh"
+# include "aibo_server/urbi_connection.hh"
+
+namespace aibo
+{
+  /// Settings of a CameraStream.
+  struct CameraConfig
+  {
+    CameraConfig()
+      : format(CAMERA_JPEG),
+	resolution(0),
+	jpegFactor(80),
+	workers(2),
+	poolSize(4),
+	tag("aibo_cam")
+    {}
+
+    /// camera.format: CAMERA_JPEG or CAMERA_YCRCB.
+    CameraFormat format;
+    /// camera.resolution: 0 for 208x160, 1 for 104x80, 2 for 52x40.
+    int resolution;
+    /// camera.jpegfactor, 0 to 100.
+    int jpegFactor;
+    /// Decoding threads.
+    unsigned workers;
+    /// Decoded images that may be alive at once, including those
+    /// still held by consumers.
+    size_t poolSize;
+    /// Tag of the camera messages.
+    std::string tag;
+  };
+
+  /// Counters describing what happened to received frames.
+  struct CameraStats
+  {
+    CameraStats()
+      : received(0), published(0), replaced(0), noImage(0), stale(0),
+	errors(0)
+    {}
+
+    std::atomic<size_t> received;
+    std::atomic<size_t> published;
+    /// Dropped undecoded because a newer frame arrived.
+    std::atomic<size_t> replaced;
+    /// Dropped because consumers held every decoded image.
+    std::atomic<size_t> noImage;
+    /// Decoded after a newer frame had already been published.
+    std::atomic<size_t> stale;
+    /// Unknown format or corrupt data.
+    std::atomic<size_t> errors;
+  };
+
+  /// A received, not yet decoded, camera binary.
+  struct CameraJob
+  {
+    std::shared_ptr<std::vector<uint8_t> > data;
+    CameraFormat format;
+    size_t width, height;
+    /// Server timestamp.
+    int timestamp;
+    /// Arrival order.
+    unsigned long long seq;
+    /// Arrival time in seconds on the steady clock.
+    double received;
+  };
+
+  /// Bounded queue between the receive thread and the decoders.
+  /*! push() never blocks: when the queue is full the oldest job is
+    discarded, so decoders always work on the most recent frames.  Jobs
+    live in a ring allocated up front.  */
+  class LatestJobQueue
+  {
+  public:
+    explicit LatestJobQueue(size_t capacity);
+
+    /// Queue \a job. Return true if an older job was discarded.
+    bool push(const CameraJob& job);
+    /// Wait for a job. Return false once closed.
+    bool pop(CameraJob& job);
+    void close();
+
+  private:
+    bool closed_;
+    std::vector<CameraJob> jobs_;
+    /// Index of the oldest job, and number of jobs queued.
+    size_t head_, count_;
+    std::mutex lock_;
+    std::condition_variable cond_;
+  };
+
+  /// Subscribes once to camera.val and decodes frames off the receive
+  /// thread.
+  /*! Replaces one blocking USyncClient::syncGetImage() per frame.  The
+    receive thread only copies the binary into a pooled buffer and
+    queues it.  Workers decode into images taken from a fixed pool and
+    hand them to the callback, which may keep them as long as it likes;
+    an image returns to the pool when its last reference goes away.
+    If consumers fall behind, frames are dropped rather than queued:
+    the newest frame always wins.
+
+    \a Image is the decoded frame type; it needs the data, width,
+    height, step and encoding members of sensor_msgs::Image, so that
+    the ROS message itself can be pooled and published without a
+    copy.  The callback is called from the worker threads.  */
+  template <class Image>
+  class CameraStream: public UrbiMessageHandler
+  {
+  public:
+    typedef std::shared_ptr<Image> ImagePtr;
+    /// Receives the decoded image and its job, whose data is released.
+    typedef std::function<void (const ImagePtr&, const CameraJob&)> Callback;
+
+    CameraStream(UrbiConnection& connection,
+		 const CameraConfig& config = CameraConfig());
+    virtual ~CameraStream();
+
+    void setCallback(const Callback& cb) { callback_ = cb; }
+
+    /// Configure the camera and start the server-side loop.
+    /// Return 0 on success.
+    int start();
+    /// Stop the server-side loop.
+    int stop();
+
+    const CameraStats& stats() const { return stats_; }
+    const CameraConfig& config() const { return config_; }
+
+    virtual void onMessage(const UrbiMessageView& msg);
+
+  private:
+    void work();
+    bool decode(JpegDecoder& jpeg, const CameraJob& job, Image& img);
+
+    UrbiConnection& connection_;
+    CameraConfig config_;
+    Callback callback_;
+    CameraStats stats_;
+    unsigned long long seq_;
+    std::atomic<unsigned long long> lastPublished_;
+    ObjectPool<std::vector<uint8_t> > binaries_;
+    ObjectPool<Image> images_;
+    LatestJobQueue queue_;
+    std::vector<std::thread> workers_;
+  };
+
+  /*------------------------------.
+  | CameraStream implementation.  |
+  `------------------------------*/
+
+  template <class Image>
+  CameraStream<Image>::CameraStream(UrbiConnection& connection,
+				    const CameraConfig& config)
+    : connection_(connection),
+      config_(config),
+      seq_(0),
+      lastPublished_(0),
+      // One binary being filled, one queued and one being decoded per
+      // worker.
+      binaries_(2 * (config.workers ? config.workers : 1) + 1),
+      images_(config.poolSize),
+      queue_(config.workers ? config.workers : 1)
+  {
+    const size_t maxRgb = CAMERA_MAX_WIDTH * CAMERA_MAX_HEIGHT * 3;
+    binaries_.forEachAvailable([maxRgb] (std::vector<uint8_t>& b)
+			       { b.reserve(maxRgb); });
+    images_.forEachAvailable([maxRgb] (Image& img)
+			     { img.data.reserve(maxRgb); });
+    for (unsigned i = 0; i < (config.workers ? config.workers : 1); ++i)
+      workers_.push_back(std::thread(&CameraStream::work, this));
+  }
+
+  template <class Image>
+  CameraStream<Image>::~CameraStream()
+  {
+    queue_.close();
+    for (size_t i = 0; i < workers_.size(); ++i)
+      workers_[i].join();
+  }
+
+  template <class Image>
+  int
+  CameraStream<Image>::start()
+  {
+    return connection_.sendf("camera.format = %d; camera.jpegfactor = %d; "
+			     "camera.resolution = %d;\n"
+			     "%s_loop: loop { %s: camera.val },\n",
+			     config_.format == CAMERA_JPEG ? 1 : 0,
+			     config_.jpegFactor, config_.resolution,
+			     config_.tag.c_str(), config_.tag.c_str());
+  }
+
+  template <class Image>
+  int
+  CameraStream<Image>::stop()
+  {
+    return connection_.sendf("stop %s_loop;\n", config_.tag.c_str());
+  }
+
+  template <class Image>
+  void
+  CameraStream<Image>::onMessage(const UrbiMessageView& msg)
+  {
+    if (msg.tag != StringRef(config_.tag) || !msg.binaryCount)
+      return;
+    ++stats_.received;
+    CameraJob job;
+    const BinaryRef& bin = msg.binaries[0];
+    if (!parseImageHeader(bin.header, job.format, job.width, job.height))
+    {
+      ++stats_.errors;
+      return;
+    }
+    job.data = binaries_.acquire();
+    if (!job.data)
+    {
+      ++stats_.replaced;
+      return;
+    }
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(bin.data.data());
+    job.data->assign(p, p + bin.data.size());
+    job.timestamp = msg.timestamp;
+    job.seq = ++seq_;
+    job.received = steadyTime();
+    if (queue_.push(job))
+      ++stats_.replaced;
+  }
+
+  template <class Image>
+  bool
+  CameraStream<Image>::decode(JpegDecoder& jpeg, const CameraJob& job,
+			      Image& img)
+  {
+    const std::vector<uint8_t>& in = *job.data;
+    size_t width = job.width;
+    size_t height = job.height;
+    switch (job.format)
+    {
+    case CAMERA_JPEG:
+      if (!jpeg.decode(in.data(), in.size(), img.data, width, height))
+	return false;
+      break;
+    case CAMERA_YCRCB:
+      if (in.size() < width * height * 3)
+	return false;
+      img.data.resize(width * height * 3);
+      ycrcbToRgb(in.data(), img.data.data(), width * height);
+      break;
+    case CAMERA_RGB:
+      if (in.size() < width * height * 3)
+	return false;
+      img.data.assign(in.begin(), in.begin() + width * height * 3);
+      break;
+    default:
+      return false;
+    }
+    img.width = width;
+    img.height = height;
+    img.step = width * 3;
+    img.encoding = "rgb8";
+    return true;
+  }
+
+  template <class Image>
+  void
+  CameraStream<Image>::work()
+  {
+    JpegDecoder jpeg;
+    CameraJob job;
+    while (queue_.pop(job))
+    {
+      ImagePtr img = images_.acquire();
+      if (!img)
+      {
+	++stats_.noImage;
+	job.data.reset();
+	continue;
+      }
+      bool ok = decode(jpeg, job, *img);
+      job.data.reset();
+      if (!ok)
+      {
+	++stats_.errors;
+	continue;
+      }
+      // Workers finish out of order; never publish older than published.
+      unsigned long long last = lastPublished_.load();
+      bool newest = job.seq > last;
+      while (newest && !lastPublished_.compare_exchange_weak(last, job.seq))
+	newest = job.seq > last;
+      if (!newest)
+      {
+	++stats_.stale;
+	continue;
+      }
+      ++stats_.published;
+      if (callback_)
+	callback_(img, job);
+    }
+  }
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_CAMERA_STREAM_HH
@@ -0,0 +1,148 @@
+/// \file aibo_server/fake_urbi_server.hh
+/// \brief Minimal stand-in for the ERS-7 URBI server.
+
+#ifndef AIBO_SERVER_FAKE_URBI_SERVER_HH
+# define AIBO_SERVER_FAKE_URBI_SERVER_HH
+
+# include <atomic>
+# include <deque>
+# include <functional>
+# include <map>
+# include <mutex>
+# include <string>
+# include <thread>
+# include <vector>
+
+# include "aibo_server/urbi_connection.hh"
+
+namespace aibo
+{
+  /// Speaks enough of the port-54000 protocol to exercise the bridge
+  /// without a robot.
+  /*! Understood statements, separated by ';' or ',':
+      - "tag: device.val" and "tag: [a.val, b.val]" reply once;
+      - "device.val = x" sets a device;
+      - "label: loop { tag: [a.val, ...] }" and
+	"label: every(<n>ms) { tag: [a.val, ...] }" stream the list at
+	every kernel cycle, or every n ms;
+      - "stop label" ends such a stream;
+      - "micro.val", alone or in a loop, is one 32 ms cycle of a 440 Hz
+	tone as a "BIN 2048 raw 2 16000 16 1" binary;
+      - "speaker.val = bin <n> raw <format>;" followed by n bytes queues
+	them on a speaker that plays in real time;
+      - "tag: speaker.remain" replies the milliseconds it has left.
+    Devices that were never set follow a slow sine so that successive
+    samples differ.  Anything else is answered with a !!! error.  */
+  class FakeUrbiServer
+  {
+  public:
+    /// \a port 0 picks a free port. \a cycleUs is the kernel cycle
+    /// (32 ms on the ERS-7); 0 runs cycles back to back.
+    explicit FakeUrbiServer(int port = URBI_PORT, unsigned cycleUs = 32000);
+    ~FakeUrbiServer();
+
+    /// Bind and start serving. Return 0 on success.
+    int start();
+    void stop();
+
+    /// Port actually bound.
+    int port() const { return port_; }
+
+    void setDevice(const std::string& name, double value);
+
+    /// Hold incoming data for \a us microseconds before executing it,
+    /// to emulate the round trip of a wireless link.  Call before start().
+    void setLinkDelay(unsigned us) { delayUs_ = us; }
+
+    /// Called on the server thread right before each streamed
+    /// message is written, with the stream tag.
+    void setStreamObserver(const std::function<void (const std::string&)>& f)
+    {
+      observer_ = f;
+    }
+
+    /// Sound bytes received on speaker.val.
+    unsigned long long speakerBytes() const { return speakerBytes_; }
+    /// Binaries that arrived after the speaker had run dry.
+    size_t speakerUnderruns() const { return speakerUnderruns_; }
+    /// Most audio the speaker had queued at once, in microseconds.
+    long long speakerPeakUs() const { return speakerPeakUs_; }
+
+  private:
+    struct Stream
+    {
+      std::string label;
+      std::string tag;
+      std::vector<std::string> devices;
+      /// Streams micro.val instead of devices.
+      bool micro;
+      unsigned periodUs;
+      long long next;
+    };
+
+    /// Data received but held back by the link delay.
+    struct Delayed
+    {
+      long long due;
+      std::string data;
+    };
+
+    struct Client
+    {
+      Client()
+	: fd(-1), binaryLeft(0), binaryRate(0), microFrames(0)
+      {}
+
+      int fd;
+      std::string input;
+      std::deque<Delayed> delayed;
+      std::vector<Stream> streams;
+      /// Bytes of the binary being received still to come.
+      size_t binaryLeft;
+      /// Its bytes per second if it is for the speaker, else 0.
+      double binaryRate;
+      /// Microphone frames sent, the phase of the tone.
+      unsigned long long microFrames;
+    };
+
+    void run();
+    void accept();
+    bool read(Client& c);
+    void deliver(Client& c, long long now);
+    void process(Client& c, const char* data, size_t len);
+    void execute(Client& c, const std::string& statement);
+    /// Handle "device.val = bin <spec>"; the bytes follow.
+    void receiveBinary(Client& c, const std::string& device,
+		       const std::string& spec);
+    /// Queue \a bytes of the binary being received on the speaker.
+    void speak(Client& c, size_t bytes);
+    /// A micro.val message tagged \a tag.
+    std::string micro(Client& c, const std::string& tag);
+    void tick(Client& c, long long now);
+    bool write(Client& c, const std::string& data);
+    std::string header(const std::string& tag) const;
+    std::string valueList(const std::vector<std::string>& devices);
+    double value(const std::string& device);
+    long long nowUs() const;
+
+    int port_;
+    unsigned cycleUs_;
+    unsigned delayUs_;
+    int listen_;
+    long long start_;
+    std::atomic<bool> running_;
+    std::thread thread_;
+    std::vector<Client> clients_;
+    std::mutex deviceLock_;
+    std::map<std::string, double> devices_;
+    std::function<void (const std::string&)> observer_;
+    /// When the speaker runs dry, in nowUs() time; 0 before any sound.
+    long long speakerEnd_;
+    std::atomic<unsigned long long> speakerBytes_;
+    std::atomic<size_t> speakerUnderruns_;
+    std::atomic<long long> speakerPeakUs_;
+  };
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_FAKE_URBI_SERVER_HH
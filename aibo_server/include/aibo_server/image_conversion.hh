@@ -0,0 +1,69 @@
+/// \file aibo_server/image_conversion.hh
+/// \brief Camera image decoding to packed RGB.
+
+#ifndef AIBO_SERVER_IMAGE_CONVERSION_HH
+# define AIBO_SERVER_IMAGE_CONVERSION_HH
+
+# include <cstddef>
+# include <stdint.h>
+# include <vector>
+
+# include "aibo_server/urbi_message.hh"
+
+namespace aibo
+{
+  /// Formats sent by the camera device, see camera.format.
+  enum CameraFormat
+    {
+      CAMERA_YCRCB = 0, ///< Raw, 3 bytes per pixel in Y, Cr, Cb order.
+      CAMERA_JPEG = 1,  ///< JPEG, the server default.
+      CAMERA_RGB,       ///< Packed RGB, as produced by some simulators.
+      CAMERA_UNKNOWN
+    };
+
+  /// Largest image the camera sends, at camera.resolution 0.
+  enum { CAMERA_MAX_WIDTH = 208, CAMERA_MAX_HEIGHT = 160 };
+
+  /// Format, width and height announced in a camera binary header such
+  /// as "jpeg 208 160".  Return false if the header is not understood
+  /// or announces an image larger than CAMERA_MAX_WIDTH by
+  /// CAMERA_MAX_HEIGHT.
+  bool parseImageHeader(const StringRef& header, CameraFormat& format,
+			size_t& width, size_t& height);
+
+  /// Convert \a pixels Y, Cr, Cb triplets to R, G, B triplets.
+  /*! Uses SSE2 for the arithmetic when available.  \a src and \a dst
+    may not overlap.  */
+  void ycrcbToRgb(const uint8_t* src, uint8_t* dst, size_t pixels);
+
+  /// Reference implementation of ycrcbToRgb().
+  void ycrcbToRgbScalar(const uint8_t* src, uint8_t* dst, size_t pixels);
+
+  /// Reusable JPEG decompressor.
+  /*! Keeps the libjpeg state between frames so that steady-state
+    decoding does not allocate beyond what libjpeg itself needs.  One
+    instance per thread.  */
+  class JpegDecoder
+  {
+  public:
+    JpegDecoder();
+    ~JpegDecoder();
+
+    /// Decode \a len bytes into packed RGB in \a rgb, resized as needed.
+    /// Return false on corrupt data, or if the image is not \a width by
+    /// \a height, the size announced in its binary header, in which
+    /// case \a rgb is left alone.
+    bool decode(const uint8_t* data, size_t len, std::vector<uint8_t>& rgb,
+		size_t width, size_t height);
+
+  private:
+    JpegDecoder(const JpegDecoder&);
+    JpegDecoder& operator=(const JpegDecoder&);
+
+    struct Impl;
+    Impl* impl_;
+  };
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_IMAGE_CONVERSION_HH
@@ -0,0 +1,72 @@
+/// \file aibo_server/joint_stream.hh
+/// \brief Server-pushed stream of all joint positions in one message.
+
+#ifndef AIBO_SERVER_JOINT_STREAM_HH
+# define AIBO_SERVER_JOINT_STREAM_HH
+
+# include <functional>
+# include <string>
+# include <vector>
+
+# include "aibo_server/urbi_connection.hh"
+# include "aibo_server/urbi_value.hh"
+
+namespace aibo
+{
+  /// URBI device controlling the URDF joint \a joint.
+  /*! Aibo.urdf names the hind legs legRB/legLB while the ERS-7 server
+    calls them legRH/legLH; every other joint has the same name.  */
+  std::string urbiDeviceName(const std::string& joint);
+
+  /// Revolute joints of Aibo.urdf, used when no robot model is available.
+  const std::vector<std::string>& defaultJointNames();
+
+  /// Polls every joint with one server-side loop instead of one
+  /// syncGetDevice() round trip per joint.
+  /*! start() installs
+        <tag>_loop: loop { <tag>: [legLF1.val, ..., tailTilt.val] },
+    (or every(<period>ms) instead of loop), so the robot pushes all
+    positions as a single tagged list at each motor cycle.  Values are
+    reported in the server's unit, degrees.  */
+  class JointStream: public UrbiMessageHandler
+  {
+  public:
+    /// Receives the server timestamp and one value per joint.
+    typedef std::function<void (int timestamp,
+				const double* values, size_t count)> Callback;
+
+    JointStream(UrbiConnection& connection,
+		const std::vector<std::string>& joints,
+		const std::string& tag = "aibo_joints");
+    virtual ~JointStream();
+
+    void setCallback(const Callback& cb) { callback_ = cb; }
+
+    /// Install the server-side loop. A \a periodMs of 0 samples at
+    /// every server cycle.  Return 0 on success.
+    int start(unsigned periodMs = 0);
+    /// Remove the server-side loop.
+    int stop();
+
+    /// The command sent by start().
+    std::string command(unsigned periodMs) const;
+
+    const std::vector<std::string>& joints() const { return joints_; }
+    const std::string& tag() const { return tag_; }
+
+    /// Messages whose tag is not ours are ignored.
+    virtual void onMessage(const UrbiMessageView& msg);
+
+  private:
+    UrbiConnection& connection_;
+    std::vector<std::string> joints_;
+    std::string tag_;
+    bool running_;
+    Callback callback_;
+    /// Reused so that parsing the readings does not allocate.
+    UrbiValue values_;
+  };
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_JOINT_STREAM_HH
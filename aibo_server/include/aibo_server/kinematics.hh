@@ -0,0 +1,182 @@
+/// \file aibo_server/kinematics.hh
+/// \brief Forward kinematics and Jacobians of the legs, head and tail,
+/// specialized at build time from Aibo.urdf.
+
+#ifndef AIBO_SERVER_KINEMATICS_HH
+# define AIBO_SERVER_KINEMATICS_HH
+
+# include <string>
+
+namespace aibo
+{
+  /// Pose of a frame in base_link: x_base = r x + p.
+  struct Transform
+  {
+    /// Rotation, row-major.
+    double r[9];
+    double p[3];
+  };
+
+  /// A joint as described in the URDF.
+  struct JointModel
+  {
+    const char* name;
+    /// Origin in the parent link.
+    double xyz[3];
+    double rpy[3];
+    /// Unit axis, in the joint frame.
+    double axis[3];
+    double lower;
+    double upper;
+  };
+
+  enum { LEG_COUNT = 4 };
+
+  /// One value per leg, in KinematicChain order.  GCC vector
+  /// extensions map it to SSE, AVX or NEON as the target allows.
+  typedef double LegVector
+    __attribute__((vector_size(LEG_COUNT * sizeof(double))));
+  typedef long long LegMask
+    __attribute__((vector_size(LEG_COUNT * sizeof(long long))));
+
+  /// Transform of each leg, lane by lane.
+  struct LegTransform
+  {
+    LegVector r[9];
+    LegVector p[3];
+  };
+
+  /// Sine and cosine of the four lanes of \a x, to within 2 ulp for
+  /// |x| < 1e5.  The quadrant is found by rounding x * 2/pi, the
+  /// remainder reduced in three steps (Cody-Waite) and the polynomials
+  /// are those of Cephes.
+  inline void sinCos(const LegVector& x, LegVector& s, LegVector& c)
+  {
+    // Adding 1.5 * 2^52 rounds to an integer, left in the low bits.
+    const double round = 6755399441055744.0;
+    LegVector t = x * 0.63661977236758134308 + round;
+    LegMask n = (LegMask) t;
+    LegVector k = t - round;
+    LegVector r = x - k * 1.57079625129699707031;
+    r -= k * 7.54978941586159635336e-8;
+    r -= k * 5.39030285815811905290e-15;
+    LegVector z = r * r;
+
+    LegVector ps = ((((1.58962301576546568060e-10 * z
+		       - 2.50507477628578072866e-8) * z
+		      + 2.75573136213857245213e-6) * z
+		     - 1.98412698295895385996e-4) * z
+		    + 8.33333333332211858878e-3) * z
+      - 1.66666666666666307295e-1;
+    LegVector pc = ((((-1.13585365213876817300e-11 * z
+		       + 2.08757008419747316778e-9) * z
+		      - 2.75573141792967388112e-7) * z
+		     + 2.48015872888517045348e-5) * z
+		    - 1.38888888888730564116e-3) * z
+      + 4.16666666666665929218e-2;
+    LegMask sr = (LegMask) (r + r * z * ps);
+    LegMask cr = (LegMask) (1.0 - 0.5 * z + z * z * pc);
+
+    // Odd quadrants swap sine and cosine; bit 1 of n, and of n + 1 for
+    // the cosine, gives the sign.
+    LegMask odd = -(n & 1);
+    s = (LegVector) (((cr & odd) | (sr & ~odd)) ^ ((n & 2) << 62));
+    c = (LegVector) (((sr & odd) | (cr & ~odd)) ^ (((n + 1) & 2) << 62));
+  }
+
+} // namespace aibo
+
+/*! The generated header specializes, for every KinematicChain C,
+
+      template <> struct ChainKinematics<C>
+      {
+	enum { DOF = ... };
+	static constexpr const char* base();
+	static constexpr const char* tip();
+	static constexpr JointModel joint(unsigned i);
+	static constexpr JointModel tipJoint();
+	static void forward(const double* q, Transform& tip);
+	static void jacobian(const double* q, Transform& tip, double* jac);
+      };
+
+    with q the DOF joint angles in radians, from the base (URBI
+    devices are in degrees), and jac the 6 x DOF geometric Jacobian at
+    the tip, row-major: linear velocity rows first, then angular, both
+    in base_link.
+
+    forwardLegs() and jacobianLegs() evaluate the four legs at once in
+    LegVector lanes, in KinematicChain order.  The overloads below take
+    and return the usual per-leg layout.  */
+# include "aibo_server/kinematics_generated.hh"
+
+namespace aibo
+{
+  /// Forward kinematics of the four legs, \a q[leg][joint] in radians.
+  inline void forwardLegs(const double q[LEG_COUNT][LEG_DOF],
+			  Transform tips[LEG_COUNT])
+  {
+    LegVector v[LEG_DOF];
+    for (int i = 0; i < LEG_DOF; ++i)
+      for (int l = 0; l < LEG_COUNT; ++l)
+	v[i][l] = q[l][i];
+    LegTransform t;
+    forwardLegs(v, t);
+    for (int l = 0; l < LEG_COUNT; ++l)
+    {
+      for (int i = 0; i < 9; ++i)
+	tips[l].r[i] = t.r[i][l];
+      for (int i = 0; i < 3; ++i)
+	tips[l].p[i] = t.p[i][l];
+    }
+  }
+
+  /// Same, with the Jacobian of each leg.
+  inline void jacobianLegs(const double q[LEG_COUNT][LEG_DOF],
+			   Transform tips[LEG_COUNT],
+			   double jac[LEG_COUNT][6 * LEG_DOF])
+  {
+    LegVector v[LEG_DOF];
+    for (int i = 0; i < LEG_DOF; ++i)
+      for (int l = 0; l < LEG_COUNT; ++l)
+	v[i][l] = q[l][i];
+    LegTransform t;
+    LegVector j[6 * LEG_DOF];
+    jacobianLegs(v, t, j);
+    for (int l = 0; l < LEG_COUNT; ++l)
+    {
+      for (int i = 0; i < 9; ++i)
+	tips[l].r[i] = t.r[i][l];
+      for (int i = 0; i < 3; ++i)
+	tips[l].p[i] = t.p[i][l];
+      for (int i = 0; i < 6 * LEG_DOF; ++i)
+	jac[l][i] = j[i][l];
+    }
+  }
+
+  /// Degrees of freedom of \a chain.
+  unsigned chainDof(KinematicChain chain);
+  /// Moving joint \a i of \a chain, from the base.
+  JointModel chainJoint(KinematicChain chain, unsigned i);
+  /// Name of the tip link of \a chain.
+  const char* chainTip(KinematicChain chain);
+  /// Fixed transform from the last joint of \a chain to its tip.
+  JointModel chainTipJoint(KinematicChain chain);
+
+  /// ChainKinematics<chain>::forward().
+  void forward(KinematicChain chain, const double* q, Transform& tip);
+  /// ChainKinematics<chain>::jacobian().
+  void jacobian(KinematicChain chain, const double* q, Transform& tip,
+		double* jac);
+
+  /// Chain moved by the URDF joint \a name and the joint's index in it,
+  /// e.g. to fill q from sensor_msgs/JointState.  Return false if no
+  /// chain has such a joint.
+  bool findJoint(const std::string& name, KinematicChain& chain,
+		 unsigned& index);
+
+  /// Compose \a a and \a b: the pose in a's parent frame of b's frame.
+  Transform compose(const Transform& a, const Transform& b);
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_KINEMATICS_HH
@@ -0,0 +1,192 @@
+/// \file aibo_server/object_pool.hh
+/// \brief Fixed-size pool of reusable objects handed out as shared_ptr.
+
+#ifndef AIBO_SERVER_OBJECT_POOL_HH
+# define AIBO_SERVER_OBJECT_POOL_HH
+
+# include <memory>
+# include <mutex>
+# include <vector>
+
+namespace aibo
+{
+  /// Owns \a size objects created up front and lends them out.
+  /*! acquire() returns a shared_ptr whose deleter puts the object back
+    instead of destroying it, so buffers inside the objects keep their
+    capacity from one use to the next and memory use is bounded by the
+    pool size.  When every object is lent out acquire() returns null and
+    the caller is expected to drop its work.  The pool may be destroyed
+    while objects are still lent out; they are freed on return.
+
+    The shared_ptr control blocks come from a free list of blocks
+    allocated with the pool, one per object plus slack, so lending an
+    object out does not touch the heap.  */
+  template <class T>
+  class ObjectPool
+  {
+  public:
+    typedef std::shared_ptr<T> Ptr;
+
+    explicit ObjectPool(size_t size)
+      : state_(new State)
+    {
+      state_->closed = false;
+      state_->free.reserve(size);
+      for (size_t i = 0; i < size; ++i)
+	state_->free.push_back(new T());
+      state_->size = size;
+      // A block goes back to the list a moment after its object does,
+      // so another thread may briefly need one more than there are
+      // objects; reserve room for the blocks it then allocates.
+      state_->blocks.reserve(2 * size);
+      for (size_t i = 0; i < size; ++i)
+	state_->blocks.push_back(::operator new(BLOCK_SIZE));
+    }
+
+    ~ObjectPool()
+    {
+      std::lock_guard<std::mutex> lock(state_->lock);
+      state_->closed = true;
+      for (size_t i = 0; i < state_->free.size(); ++i)
+	delete state_->free[i];
+      state_->free.clear();
+    }
+
+    /// Borrow an object, or null if none is available.
+    Ptr acquire()
+    {
+      T* obj;
+      {
+	std::lock_guard<std::mutex> lock(state_->lock);
+	if (state_->free.empty())
+	  return Ptr();
+	obj = state_->free.back();
+	state_->free.pop_back();
+      }
+      return Ptr(obj, Release(state_), BlockAllocator<T>(state_));
+    }
+
+    /// Apply \a f to every object that is not lent out, e.g. to
+    /// preallocate buffers.
+    template <class F>
+    void forEachAvailable(F f)
+    {
+      std::lock_guard<std::mutex> lock(state_->lock);
+      for (size_t i = 0; i < state_->free.size(); ++i)
+	f(*state_->free[i]);
+    }
+
+    size_t size() const { return state_->size; }
+
+    size_t available() const
+    {
+      std::lock_guard<std::mutex> lock(state_->lock);
+      return state_->free.size();
+    }
+
+  private:
+    ObjectPool(const ObjectPool&);
+    ObjectPool& operator=(const ObjectPool&);
+
+    /// Room for a control block holding a Release and a
+    /// BlockAllocator; larger requests go to the heap.
+    enum { BLOCK_SIZE = 128 };
+
+    struct State
+    {
+      ~State()
+      {
+	for (size_t i = 0; i < blocks.size(); ++i)
+	  ::operator delete(blocks[i]);
+      }
+
+      mutable std::mutex lock;
+      std::vector<T*> free;
+      std::vector<void*> blocks;
+      size_t size;
+      bool closed;
+    };
+
+    struct Release
+    {
+      explicit Release(const std::shared_ptr<State>& s)
+	: state(s)
+      {}
+
+      void operator()(T* obj) const
+      {
+	std::lock_guard<std::mutex> lock(state->lock);
+	if (state->closed)
+	  delete obj;
+	else
+	  state->free.push_back(obj);
+      }
+
+      std::shared_ptr<State> state;
+    };
+
+    /// Hands out the preallocated blocks of a State.  It holds the state
+    /// too: the control block is freed after its deleter is destroyed.
+    template <class U>
+    struct BlockAllocator
+    {
+      typedef U value_type;
+
+      explicit BlockAllocator(const std::shared_ptr<State>& s)
+	: state(s)
+      {}
+
+      template <class V>
+      BlockAllocator(const BlockAllocator<V>& other)
+	: state(other.state)
+      {}
+
+      U* allocate(size_t n)
+      {
+	size_t bytes = n * sizeof (U);
+	if (bytes > BLOCK_SIZE)
+	  return static_cast<U*>(::operator new(bytes));
+	{
+	  std::lock_guard<std::mutex> lock(state->lock);
+	  if (!state->blocks.empty())
+	  {
+	    void* p = state->blocks.back();
+	    state->blocks.pop_back();
+	    return static_cast<U*>(p);
+	  }
+	}
+	return static_cast<U*>(::operator new(BLOCK_SIZE));
+      }
+
+      void deallocate(U* p, size_t n)
+      {
+	if (n * sizeof (U) > BLOCK_SIZE)
+	{
+	  ::operator delete(p);
+	  return;
+	}
+	std::lock_guard<std::mutex> lock(state->lock);
+	state->blocks.push_back(p);
+      }
+
+      template <class V>
+      bool operator==(const BlockAllocator<V>& other) const
+      {
+	return state == other.state;
+      }
+
+      template <class V>
+      bool operator!=(const BlockAllocator<V>& other) const
+      {
+	return state != other.state;
+      }
+
+      std::shared_ptr<State> state;
+    };
+
+    std::shared_ptr<State> state_;
+  };
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_OBJECT_POOL_HH
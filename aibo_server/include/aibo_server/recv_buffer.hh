@@ -0,0 +1,140 @@
+/// \file aibo_server/recv_buffer.hh
+/// \brief Growable reception buffer used by the URBI stream parser.
+
+#ifndef AIBO_SERVER_RECV_BUFFER_HH
+# define AIBO_SERVER_RECV_BUFFER_HH
+
+# include <cstddef>
+# include <cstring>
+
+namespace aibo
+{
+  /// Byte buffer with a read and a write cursor.
+  /*! Socket reads are done directly into prepare(), the parser reads
+    data() and releases what it no longer needs with consume().  Space
+    freed at the front is reclaimed lazily: the unread tail is moved
+    back to the start only when the writer runs out of room, which for
+    the URBI stream means moving at most one partial message.  When even
+    that is not enough the storage doubles, up to maxSize.
+
+    Pointers returned by data() stay valid until the next prepare().
+  */
+  class RecvBuffer
+  {
+  public:
+    enum { DEFAULT_SIZE = 64 * 1024 };
+    enum { DEFAULT_MAX_SIZE = 64 * 1024 * 1024 };
+
+    explicit RecvBuffer(size_t initialSize = DEFAULT_SIZE,
+			size_t maxSize = DEFAULT_MAX_SIZE)
+      : buffer_(new char[initialSize ? initialSize : 1]),
+	capacity_(initialSize ? initialSize : 1),
+	maxSize_(maxSize < initialSize ? initialSize : maxSize),
+	read_(0),
+	write_(0)
+    {}
+
+    ~RecvBuffer()
+    {
+      delete [] buffer_;
+    }
+
+    /// Readable bytes.
+    const char* data() const { return buffer_ + read_; }
+    /// Number of readable bytes.
+    size_t size() const { return write_ - read_; }
+    /// Current storage size.
+    size_t capacity() const { return capacity_; }
+    /// Largest storage size.
+    size_t maxSize() const { return maxSize_; }
+
+    /// Return a writable area of at least \a min bytes, 0 if that would
+    /// exceed the maximum size.  \a avail is set to the usable length.
+    char* prepare(size_t min, size_t& avail)
+    {
+      if (capacity_ - write_ < min)
+      {
+	size_t used = write_ - read_;
+	if (capacity_ - used >= min)
+	  compact();
+	else if (!grow(used + min))
+	{
+	  avail = 0;
+	  return 0;
+	}
+      }
+      avail = capacity_ - write_;
+      return buffer_ + write_;
+    }
+
+    /// Mark \a n bytes of the area returned by prepare() as written.
+    void commit(size_t n)
+    {
+      write_ += n;
+    }
+
+    /// Append a copy of \a len bytes. Return false on overflow.
+    bool append(const void* data, size_t len)
+    {
+      size_t avail;
+      char* p = prepare(len, avail);
+      if (!p)
+	return false;
+      memcpy(p, data, len);
+      commit(len);
+      return true;
+    }
+
+    /// Release \a n bytes from the front.
+    void consume(size_t n)
+    {
+      read_ += n;
+      if (read_ == write_)
+	read_ = write_ = 0;
+    }
+
+    void clear()
+    {
+      read_ = write_ = 0;
+    }
+
+  private:
+    RecvBuffer(const RecvBuffer&);
+    RecvBuffer& operator=(const RecvBuffer&);
+
+    void compact()
+    {
+      memmove(buffer_, buffer_ + read_, write_ - read_);
+      write_ -= read_;
+      read_ = 0;
+    }
+
+    bool grow(size_t needed)
+    {
+      if (needed > maxSize_)
+	return false;
+      size_t ncap = capacity_;
+      while (ncap < needed)
+	ncap *= 2;
+      if (ncap > maxSize_)
+	ncap = maxSize_;
+      char* nbuf = new char[ncap];
+      memcpy(nbuf, buffer_ + read_, write_ - read_);
+      delete [] buffer_;
+      buffer_ = nbuf;
+      capacity_ = ncap;
+      write_ -= read_;
+      read_ = 0;
+      return true;
+    }
+
+    char* buffer_;
+    size_t capacity_;
+    size_t maxSize_;
+    size_t read_;
+    size_t write_;
+  };
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_RECV_BUFFER_HH
@@ -0,0 +1,100 @@
+/// \file aibo_server/request_pipeline.hh
+/// \brief Many outstanding tagged requests per connection, with futures.
+
+#ifndef AIBO_SERVER_REQUEST_PIPELINE_HH
+# define AIBO_SERVER_REQUEST_PIPELINE_HH
+
+# include <future>
+# include <mutex>
+# include <string>
+# include <unordered_map>
+# include <vector>
+
+# include "aibo_server/urbi_connection.hh"
+
+namespace aibo
+{
+  /// An issued request: its id, for cancel(), and the future reply.
+  struct UrbiRequest
+  {
+    unsigned id;
+    std::future<UrbiMessage> reply;
+  };
+
+  /// Asynchronous replacement for USyncClient::syncGet().
+  /*! USyncClient has a single sync tag and message slot, so a client
+    has one request in flight and every caller waits for a full round
+    trip.  Here each request gets a unique tag, <prefix>_<id>, and a
+    promise that the receive thread fulfills when the reply to that tag
+    arrives.  Any number of requests may be outstanding, and getAll()
+    sends a whole batch in one write, so reading N devices costs about
+    one round trip instead of N.
+
+    The reply is the message sent by the server for the tag, which is a
+    MESSAGE_ERROR message if the expression failed.  When the
+    connection reports a client error, every outstanding request is
+    completed with that error message.
+
+    Install the pipeline as the connection handler; messages that are
+    not replies are forwarded to \a next, e.g. a CallbackTable.  */
+  class RequestPipeline: public UrbiMessageHandler
+  {
+  public:
+    RequestPipeline(UrbiConnection& connection,
+		    UrbiMessageHandler* next = 0,
+		    const std::string& prefix = "aibo_req");
+    virtual ~RequestPipeline();
+
+    /// Evaluate \a expression on the server, as "<tag>: <expression>;".
+    /*! On send failure the returned future is already completed with a
+      client error.  */
+    UrbiRequest get(const std::string& expression);
+
+    /// Issue one request per expression, all in a single write.
+    std::vector<UrbiRequest> getAll(const std::vector<std::string>& expressions);
+
+    /// Read the value of each of \a devices (e.g. "legLF1") into
+    /// \a values, pipelined.  Return 0 once every reply arrived, -1 on
+    /// timeout, error reply or non-numeric value; outstanding requests
+    /// are then cancelled, values of the devices that failed or were
+    /// not waited for are left alone, and \a error, if not null, names
+    /// the first device that failed and why.
+    /*! Safe to call from several threads at once: the error is
+      reported per call.  */
+    int getDevices(const std::vector<std::string>& devices,
+		   std::vector<double>& values, double timeout = 1.0,
+		   std::string* error = 0);
+
+    /// Forget request \a id; a late reply is then passed to next.
+    /// Its future reports std::future_errc::broken_promise.
+    bool cancel(unsigned id);
+
+    /// Number of requests waiting for a reply.
+    size_t pending() const;
+
+    /// Unique tag of request \a id.
+    std::string tag(unsigned id) const;
+
+    virtual void onMessage(const UrbiMessageView& msg);
+
+  private:
+    RequestPipeline(const RequestPipeline&);
+    RequestPipeline& operator=(const RequestPipeline&);
+
+    /// Register a request, append its command to \a cmd.
+    UrbiRequest add(const std::string& expression, std::string& cmd);
+    /// Complete \a requests with a client error.
+    void fail(const std::vector<UrbiRequest>& requests, const char* what);
+
+    UrbiConnection& connection_;
+    UrbiMessageHandler* next_;
+    std::string prefix_;
+
+    mutable std::mutex lock_;
+    unsigned nextId_;
+    std::unordered_map<unsigned, std::promise<UrbiMessage> > pending_;
+  };
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_REQUEST_PIPELINE_HH
@@ -0,0 +1,181 @@
+/// \file aibo_server/send_queue.hh
+/// \brief Multi-producer command queue flushed with one writev() per wakeup.
+
+#ifndef AIBO_SERVER_SEND_QUEUE_HH
+# define AIBO_SERVER_SEND_QUEUE_HH
+
+# include <atomic>
+# include <condition_variable>
+# include <cstdarg>
+# include <mutex>
+# include <stdint.h>
+# include <string>
+# include <thread>
+# include <vector>
+
+# include <sys/uio.h>
+
+namespace aibo
+{
+  /// Send lanes, highest priority first.
+  enum SendPriority
+    {
+      PRIORITY_HIGH,	///< Motor commands.
+      PRIORITY_NORMAL,	///< Queries and everything else.
+      PRIORITY_LOW,	///< LEDs, sound.
+      PRIORITY_COUNT
+    };
+
+  /// Replaces UAbstractClient's sendBuffer and sendBufferLock.
+  /*! Producers take a slot from the fixed pool of their lane, format
+    their command into it without any lock, and push it on the lane
+    with a single compare-and-swap.  A flusher thread grabs every lane
+    at once and writes pending commands, highest priority first, with
+    as few writev() calls as possible, so that concurrent producers
+    share system calls instead of contending for the socket.
+
+    Each lane has its own share of the slots, so that a flood of LED
+    or sound commands cannot hold up motor commands.  When a lane's
+    slots are exhausted push() waits for the flusher, or fails if asked
+    not to, which is how backpressure reaches the producers.  The
+    flusher keeps at most maxInFlight() bytes unsent in the socket
+    buffer: the backlog stays in the lanes, where a later urgent
+    command can still overtake it.  Commands longer than INLINE_SIZE
+    are stored on the heap; all others are sent without allocation.  */
+  class SendQueue
+  {
+  public:
+    enum { INLINE_SIZE = 240 };
+
+    /// Bytes the kernel may hold unsent, by default.
+    enum { MAX_IN_FLIGHT = 8192 };
+
+    /// Queue at most \a depth commands for \a fd: a quarter of them for
+    /// each of PRIORITY_HIGH and PRIORITY_LOW, the rest for
+    /// PRIORITY_NORMAL, and at least one per lane.
+    explicit SendQueue(int fd, size_t depth = 256);
+    /// Calls stop() with the default timeout.
+    ~SendQueue();
+
+    /// Limit the bytes written but not yet sent by the kernel, 0 for no
+    /// limit.  Call before start().
+    void setMaxInFlight(size_t bytes) { maxInFlight_ = bytes; }
+    size_t maxInFlight() const { return maxInFlight_; }
+
+    /// Start the flusher thread.
+    void start();
+    /// Make pushes fail from now on, send what was queued, then stop the
+    /// flusher.
+    /*! If the peer does not take the queued commands within \a timeout
+      seconds, the rest is dropped, the socket is shut down for writing
+      to release a write blocked on it, and failed() reports ETIMEDOUT.  */
+    void stop(double timeout = 1.0);
+
+    /// Queue \a len bytes.  If the queue is full, wait for room when
+    /// \a wait is true, else fail.  Return 0 on success, -1 on failure,
+    /// including after a write error.
+    int push(const void* data, size_t len,
+	     SendPriority priority = PRIORITY_NORMAL, bool wait = true);
+    /// Format a command directly into its queue slot.
+    int pushf(SendPriority priority, const char* format, ...)
+      __attribute__((format(printf, 3, 4)));
+    int vpushf(SendPriority priority, const char* format, va_list args);
+
+    /// Return true once a write failed; nothing is sent afterwards.
+    bool failed() const { return failed_; }
+    /// errno of the failed write.
+    int error() const { return error_; }
+
+    size_t depth() const { return nodes_.size(); }
+    /// Slots of lane \a priority.
+    size_t laneDepth(SendPriority priority) const
+    {
+      return laneDepth_[priority];
+    }
+    /// Commands sent and writev() calls made so far.
+    size_t commandsSent() const { return commands_; }
+    size_t writeCalls() const { return writes_; }
+
+  private:
+    SendQueue(const SendQueue&);
+    SendQueue& operator=(const SendQueue&);
+
+    /// A queued command.  Nodes are linked by index, on the free list
+    /// of their lane or on the lane itself.
+    struct Node
+    {
+      std::atomic<uint32_t> next;
+      /// Fixed at construction.
+      SendPriority priority;
+      uint32_t size;
+      std::string big;
+      char data[INLINE_SIZE];
+
+      const char* bytes() const { return big.empty() ? data : big.data(); }
+    };
+
+    /// Take a free node of lane \a priority, waiting if \a wait.
+    /// Return NIL if none.
+    uint32_t acquire(SendPriority priority, bool wait);
+    void release(uint32_t i);
+    /// Link node \a i on its lane and wake the flusher.
+    void enqueue(uint32_t i);
+    /// Register a push in progress.  Return false once stopping.
+    bool enter();
+    void leave();
+    /// Move every queued node to the end of pending_.  Return true if
+    /// anything is pending.
+    bool grab();
+    /// Bytes that may be written now without exceeding maxInFlight_.
+    size_t room() const;
+    /// Write pending commands, most urgent first, as far as room()
+    /// allows.  Return false if nothing could be written.
+    bool flush();
+    /// Release every pending node, after a write error.
+    void discard();
+    void run();
+
+    int fd_;
+    std::vector<Node> nodes_;
+
+    size_t laneDepth_[PRIORITY_COUNT];
+    /// Free list heads, one per lane: node index in the low half, a
+    /// counter bumped at every change in the high half to defeat ABA.
+    std::atomic<uint64_t> free_[PRIORITY_COUNT];
+    /// Lane heads, newest first.
+    std::atomic<uint32_t> lanes_[PRIORITY_COUNT];
+
+    size_t maxInFlight_;
+    std::atomic<bool> stopping_;
+    /// Set by the flusher when it is done.  Guarded by lock_.
+    bool finished_;
+    /// push() calls between enter() and leave().
+    std::atomic<unsigned> pushers_;
+    std::atomic<bool> failed_;
+    std::atomic<int> error_;
+    std::atomic<bool> sleeping_;
+    std::atomic<unsigned> spaceWaiters_;
+    std::mutex lock_;
+    std::condition_variable work_;
+    std::condition_variable space_;
+    std::condition_variable done_;
+
+    std::atomic<size_t> commands_;
+    std::atomic<size_t> writes_;
+
+    /// Flusher state: grabbed nodes of each lane in push order, from
+    /// pendingFirst_ on, and the bytes of the first pending command
+    /// of partialLane_ already written, which must be completed before
+    /// anything else.
+    std::vector<uint32_t> pending_[PRIORITY_COUNT];
+    size_t pendingFirst_[PRIORITY_COUNT];
+    int partialLane_;
+    size_t partial_;
+    std::vector<iovec> iov_;
+    std::vector<uint32_t> sent_;
+    std::thread thread_;
+  };
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_SEND_QUEUE_HH
@@ -0,0 +1,112 @@
+/// \file aibo_server/spsc_ring.hh
+/// \brief Lock-free ring buffer between one producer and one consumer.
+
+#ifndef AIBO_SERVER_SPSC_RING_HH
+# define AIBO_SERVER_SPSC_RING_HH
+
+# include <algorithm>
+# include <atomic>
+# include <stdint.h>
+# include <vector>
+
+namespace aibo
+{
+  /// Fixed-capacity FIFO of \a T for exactly one producer thread and
+  /// one consumer thread.
+  /*! Each side owns one position counter and only reads the other's,
+    so push and pop take no lock and never wait.  Positions count every
+    element ever pushed and never wrap; the buffer index is the
+    position masked by the capacity, a power of two.  push() is all or
+    nothing, so that a producer that cannot keep a whole block drops it
+    rather than a part of it.  \a T must be trivially copyable.  */
+  template <class T>
+  class SpscRing
+  {
+  public:
+    /// Room for at least \a capacity elements.
+    explicit SpscRing(size_t capacity)
+      : head_(0), tail_(0)
+    {
+      size_t size = 1;
+      while (size < capacity)
+	size <<= 1;
+      buffer_.resize(size);
+      mask_ = size - 1;
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+    /// Elements waiting.  Exact from the consumer, a lower bound from
+    /// any other thread.
+    size_t size() const
+    {
+      return head_.load(std::memory_order_acquire)
+	- tail_.load(std::memory_order_acquire);
+    }
+    bool empty() const { return !size(); }
+    /// Position of the next element to pop, i.e. elements popped so far.
+    uint64_t popped() const { return tail_.load(std::memory_order_acquire); }
+
+    /// Producer: append the \a n elements of \a data, or nothing if
+    /// they do not all fit.  Return false in the latter case.
+    bool push(const T* data, size_t n)
+    {
+      uint64_t head = head_.load(std::memory_order_relaxed);
+      if (capacity() - (head - tail_.load(std::memory_order_acquire)) < n)
+	return false;
+      size_t i = head & mask_;
+      size_t first = std::min(n, capacity() - i);
+      std::copy(data, data + first, &buffer_[i]);
+      std::copy(data + first, data + n, &buffer_[0]);
+      head_.store(head + n, std::memory_order_release);
+      return true;
+    }
+
+    /// Consumer: remove the \a n oldest elements into \a out, or
+    /// nothing if fewer are waiting.  Return false in the latter case.
+    bool pop(T* out, size_t n)
+    {
+      uint64_t tail = tail_.load(std::memory_order_relaxed);
+      if (head_.load(std::memory_order_acquire) - tail < n)
+	return false;
+      size_t i = tail & mask_;
+      size_t first = std::min(n, capacity() - i);
+      std::copy(&buffer_[i], &buffer_[i] + first, out);
+      std::copy(&buffer_[0], &buffer_[0] + (n - first), out + first);
+      tail_.store(tail + n, std::memory_order_release);
+      return true;
+    }
+
+    /// Consumer: the oldest element, or null if empty.
+    const T* front() const
+    {
+      uint64_t tail = tail_.load(std::memory_order_relaxed);
+      if (head_.load(std::memory_order_acquire) == tail)
+	return 0;
+      return &buffer_[tail & mask_];
+    }
+
+    /// Consumer: remove the \a n oldest elements, at most size().
+    void drop(size_t n)
+    {
+      uint64_t tail = tail_.load(std::memory_order_relaxed);
+      n = std::min<uint64_t>(n, head_.load(std::memory_order_acquire) - tail);
+      tail_.store(tail + n, std::memory_order_release);
+    }
+
+  private:
+    SpscRing(const SpscRing&);
+    SpscRing& operator=(const SpscRing&);
+
+    std::vector<T> buffer_;
+    size_t mask_;
+    /// Written by the producer only.
+    std::atomic<uint64_t> head_;
+    /// Keep the two counters on separate cache lines.
+    char pad_[64];
+    /// Written by the consumer only.
+    std::atomic<uint64_t> tail_;
+  };
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_SPSC_RING_HH
@@ -0,0 +1,213 @@
+/// \file aibo_server/stream_log.hh
+/// \brief Recording of the raw URBI stream to an indexed, segmented log,
+/// and memory-mapped access to such logs.
+
+#ifndef AIBO_SERVER_STREAM_LOG_HH
+# define AIBO_SERVER_STREAM_LOG_HH
+
+# include <cstdio>
+# include <stdint.h>
+# include <string>
+# include <vector>
+
+# include "aibo_server/urbi_stream_parser.hh"
+
+namespace aibo
+{
+  /*! A log is a directory holding data segments, 000000.seg,
+    000001.seg, ..., and one index file.  All integers are in host
+    byte order.
+
+    A segment starts with a SegmentHeader followed by records, each a
+    RecordHeader and the bytes of one recv(), padded to 8 bytes.  The
+    writer maps a preallocated segment and keeps SegmentHeader::used up
+    to date after every record, so a log cut short by a crash is
+    readable up to its last complete record.
+
+    The index holds an IndexHeader followed by one IndexEntry per
+    message of the stream, giving its tag, server timestamp, arrival
+    time and position.  Positions count bytes from the start of the
+    recorded stream.  */
+
+  struct SegmentHeader
+  {
+    char magic[8];		///< "AIBOSEG1"
+    uint32_t version;
+    uint32_t headerSize;
+    /// Stream position of the first record.
+    uint64_t offset;
+    /// Bytes in use, this header included.
+    uint64_t used;
+    /// Wall clock at creation, in ns since the epoch.
+    int64_t created;
+    char reserved[24];
+  };
+
+  struct RecordHeader
+  {
+    /// Arrival time, steady clock in ns.
+    int64_t time;
+    /// Stream position of the first byte.
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+  };
+
+  struct IndexHeader
+  {
+    char magic[8];		///< "AIBOIDX1"
+    uint32_t version;
+    uint32_t entrySize;
+    char reserved[16];
+  };
+
+  struct IndexEntry
+  {
+    /// Stream position of the message.
+    uint64_t offset;
+    /// Arrival time of the recv() that completed the message,
+    /// steady clock in ns.
+    int64_t time;
+    /// Server timestamp.
+    int32_t timestamp;
+    /// MessageType.
+    uint16_t type;
+    uint16_t tagSize;
+    /// Tag, truncated to TAG_SIZE bytes and not NUL terminated.
+    enum { TAG_SIZE = 40 };
+    char tag[TAG_SIZE];
+
+    StringRef tagRef() const
+    {
+      return StringRef(tag, tagSize < TAG_SIZE ? tagSize : size_t(TAG_SIZE));
+    }
+  };
+
+  /// Appends the received bytes of a connection to a log.
+  /*! Attach with UrbiConnection::setRecorder().  Both calls run on the
+    receive thread: record() copies each chunk into the mapped segment,
+    without any system call except when a segment is full, and index()
+    then adds each message that the connection's parser framed in it,
+    so the stream is parsed only once.  */
+  class StreamRecorder
+  {
+  public:
+    /// Start a new segment once \a segmentSize bytes are written.
+    explicit StreamRecorder(size_t segmentSize = 64 << 20);
+    ~StreamRecorder();
+
+    /// Create the log directory \a dir. Return 0 on success; fail if it
+    /// already holds a log.
+    int open(const std::string& dir);
+    /// Flush the index and trim the last segment.
+    void close();
+
+    /// Append \a len received bytes, the first of which is at
+    /// \a position in the stream as counted by the parser framing it,
+    /// see UrbiStreamParser::offset().  Return 0 on success.
+    int record(const char* data, size_t len, unsigned long long position);
+    /// Add \a msg, dispatched by that parser at \a position, to the
+    /// index.  Its bytes must have been recorded.
+    void index(const UrbiMessageView& msg, unsigned long long position);
+
+    const std::string& errorMessage() const { return errorMessage_; }
+    /// Bytes and messages recorded so far.
+    unsigned long long bytes() const { return offset_; }
+    size_t messages() const { return messages_; }
+
+  private:
+    StreamRecorder(const StreamRecorder&);
+    StreamRecorder& operator=(const StreamRecorder&);
+
+    int newSegment(size_t minSize);
+    void closeSegment();
+    int fail(const std::string& what);
+
+    size_t segmentSize_;
+    std::string dir_;
+    std::string errorMessage_;
+    unsigned segments_;
+    int fd_;
+    char* map_;
+    size_t mapSize_;
+    FILE* index_;
+    unsigned long long offset_;
+    /// Parser position of the first recorded byte.
+    unsigned long long base_;
+    size_t messages_;
+    int64_t now_;
+  };
+
+  /// A chunk of recorded stream.
+  struct LogRecord
+  {
+    int64_t time;
+    uint64_t offset;
+    StringRef data;
+  };
+
+  /// Read access to a log, mapped in memory.
+  class StreamLog
+  {
+  public:
+    StreamLog();
+    ~StreamLog();
+
+    /// Map the log in \a dir. Return 0 on success.
+    int open(const std::string& dir);
+    void close();
+    const std::string& errorMessage() const { return errorMessage_; }
+
+    /// Records, in stream order.
+    size_t recordCount() const { return records_.size(); }
+    LogRecord record(size_t i) const;
+    /// Record containing stream position \a offset, or recordCount().
+    size_t findRecord(uint64_t offset) const;
+    /// Total stream bytes.
+    uint64_t size() const;
+
+    /// Index entries, in stream order.
+    size_t indexSize() const { return indexSize_; }
+    const IndexEntry& entry(size_t i) const { return index_[i]; }
+    /// First entry that arrived at or after \a time, or indexSize().
+    size_t seekTime(int64_t time) const;
+    /// First entry with a server timestamp of at least \a timestamp,
+    /// or indexSize().  This is a binary search: server timestamps
+    /// restart with the robot, so the log must cover a single run.
+    size_t seekTimestamp(int timestamp) const;
+    /// First entry at or after \a from tagged \a tag, or indexSize().
+    size_t findTag(const StringRef& tag, size_t from = 0) const;
+
+    /// Append the stream from position \a begin to \a end to \a out.
+    void copy(uint64_t begin, uint64_t end, std::string& out) const;
+
+  private:
+    StreamLog(const StreamLog&);
+    StreamLog& operator=(const StreamLog&);
+
+    struct Mapping
+    {
+      void* data;
+      size_t size;
+    };
+
+    struct Record
+    {
+      int64_t time;
+      uint64_t offset;
+      const char* data;
+      uint32_t size;
+    };
+
+    int fail(const std::string& what);
+
+    std::string errorMessage_;
+    std::vector<Mapping> mappings_;
+    std::vector<Record> records_;
+    const IndexEntry* index_;
+    size_t indexSize_;
+  };
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_STREAM_LOG_HH
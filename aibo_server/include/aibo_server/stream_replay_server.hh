@@ -0,0 +1,81 @@
+/// \file aibo_server/stream_replay_server.hh
+/// \brief Stand-in robot serving a recorded stream.
+
+#ifndef AIBO_SERVER_STREAM_REPLAY_SERVER_HH
+# define AIBO_SERVER_STREAM_REPLAY_SERVER_HH
+
+# include <atomic>
+# include <stdint.h>
+# include <sys/uio.h>
+# include <thread>
+
+# include "aibo_server/stream_log.hh"
+# include "aibo_server/urbi_connection.hh"
+
+namespace aibo
+{
+  /// Plays a StreamLog back to clients connecting on the URBI port.
+  /*! Each client gets the recorded bytes in the chunks they were
+    received in, paced by their arrival times scaled by the speed
+    factor, or back to back at speed 0.  Chunks that are due together
+    go out in one sendmsg() straight from the mapped log.  What the
+    client sends is read and ignored.  Clients are served one at a
+    time.  */
+  class StreamReplayServer
+  {
+  public:
+    /// \a port 0 picks a free port.  \a log must stay open while the
+    /// server runs.
+    explicit StreamReplayServer(const StreamLog& log, int port = URBI_PORT);
+    ~StreamReplayServer();
+
+    /// 1 plays in real time, 2 twice as fast, 0 as fast as the client
+    /// reads.  Call before start().
+    void setSpeed(double speed) { speed_ = speed; }
+    /// Start playing at stream position \a offset, e.g. the offset of
+    /// an index entry.  Call before start().
+    void setStart(uint64_t offset) { begin_ = offset; }
+    /// Play the log again from the start position once it ends,
+    /// instead of closing the connection.  Call before start().
+    void setLoop(bool loop) { loop_ = loop; }
+
+    /// Bind and start serving. Return 0 on success.
+    int start();
+    void stop();
+
+    /// Port actually bound.
+    int port() const { return port_; }
+
+    /// Playbacks that reached the end of the log.
+    size_t playbacks() const { return playbacks_; }
+    /// Bytes sent to clients.
+    unsigned long long bytesSent() const { return bytes_; }
+
+  private:
+    StreamReplayServer(const StreamReplayServer&);
+    StreamReplayServer& operator=(const StreamReplayServer&);
+
+    void run();
+    /// Play the log once to \a fd. Return false if the client left.
+    bool play(int fd, size_t first);
+    /// Send \a count chunks. Return false if the client left.
+    bool send(int fd, iovec* iov, size_t count);
+    /// Discard client input, waiting at most \a timeoutMs for it.
+    /// Return false if the client left.
+    bool drain(int fd, int timeoutMs);
+
+    const StreamLog& log_;
+    int port_;
+    double speed_;
+    uint64_t begin_;
+    bool loop_;
+    int listen_;
+    std::atomic<bool> running_;
+    std::atomic<size_t> playbacks_;
+    std::atomic<unsigned long long> bytes_;
+    std::thread thread_;
+  };
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_STREAM_REPLAY_SERVER_HH
@@ -0,0 +1,132 @@
+/// \file aibo_server/urbi_connection.hh
+/// \brief TCP connection to an URBI server feeding UrbiStreamParser.
+
+#ifndef AIBO_SERVER_URBI_CONNECTION_HH
+# define AIBO_SERVER_URBI_CONNECTION_HH
+
+# include <atomic>
+# include <cstdarg>
+# include <memory>
+# include <mutex>
+# include <string>
+# include <thread>
+
+# include "aibo_server/send_queue.hh"
+# include "aibo_server/urbi_stream_parser.hh"
+
+namespace aibo
+{
+  class StreamRecorder;
+
+  /// Standard port of URBI server.
+  enum { URBI_PORT = 54000 };
+
+  /// Seconds on the steady clock, the time base of the arrival times
+  /// recorded by the streams.
+  double steadyTime();
+
+  /// Connection to an URBI server.
+  /*! A receive thread reads the socket straight into the parser buffer
+    and hands every message to the handler, on that thread.  Connection
+    errors are reported to the handler as MESSAGE_ERROR messages tagged
+    CLIENTERROR_TAG, as UAbstractClient::clientError() does.  */
+  class UrbiConnection
+  {
+  public:
+    /// Tag of locally generated error messages.
+    static const char* const CLIENTERROR_TAG;
+
+    UrbiConnection(const std::string& host, int port = URBI_PORT);
+    virtual ~UrbiConnection();
+
+    /// Set the handler receiving messages. Must be called before start().
+    void setHandler(UrbiMessageHandler* handler) { handler_ = handler; }
+    /// Append everything received to \a recorder, indexing the
+    /// messages as they are parsed, or stop recording if null.  Must be
+    /// called before start().
+    void setRecorder(StreamRecorder* recorder) { recorder_ = recorder; }
+
+    /// Connect to the server.  Return 0 on success, nonzero on failure;
+    /// errorMessage() then describes the problem.
+    int connect();
+    /// Start the receive thread.
+    void start();
+    /// Send through a SendQueue of \a depth commands from now on,
+    /// instead of writing under a lock from the calling thread.
+    /// Must be called after connect() and before any concurrent send().
+    void enableSendQueue(size_t depth = 256);
+    /// Close the socket and join the receive thread.  Commands already
+    /// queued are sent first, unless the server takes more than a second
+    /// to accept them; later send() calls fail.
+    void close();
+
+    bool connected() const { return sd_ >= 0 && !closed_; }
+
+    /// Return current error status, or zero if no error occurred.
+    int error() const { return rc_; }
+    const std::string& errorMessage() const { return errorMessage_; }
+
+    /// Send raw bytes. Return 0 on success, nonzero on failure.
+    /// \a priority picks the lane when the send queue is enabled.
+    virtual int send(const void* data, size_t len,
+		     SendPriority priority = PRIORITY_NORMAL);
+    /// Send an Urbi command. The syntax is similar to the printf() function.
+    int sendf(const char* format, ...)
+      __attribute__((format(printf, 2, 3)));
+    int sendf(SendPriority priority, const char* format, ...)
+      __attribute__((format(printf, 3, 4)));
+    int vsendf(const char* format, va_list args);
+    /// With the send queue enabled, formats straight into the queue.
+    int vsendf(SendPriority priority, const char* format, va_list args);
+
+    const std::string& host() const { return host_; }
+    int port() const { return port_; }
+
+  protected:
+    /// Called on the receive thread for every chunk read from the socket.
+    virtual void onReceive(const char* data, size_t len);
+
+    /// Report \a msg to the handler as a client error.
+    void clientError(const char* msg, int code = 0);
+
+    int sd_;
+
+  private:
+    UrbiConnection(const UrbiConnection&);
+    UrbiConnection& operator=(const UrbiConnection&);
+
+    void receiveLoop();
+
+    /// Indexes each message for the recorder, then passes it to the
+    /// handler.
+    class Dispatch: public UrbiMessageHandler
+    {
+    public:
+      explicit Dispatch(UrbiConnection& c)
+	: c_(c)
+      {}
+
+      virtual void onMessage(const UrbiMessageView& msg);
+
+    private:
+      UrbiConnection& c_;
+    };
+
+    std::string host_;
+    int port_;
+    int rc_;
+    std::string errorMessage_;
+    std::atomic<bool> closed_;
+
+    UrbiMessageHandler* handler_;
+    StreamRecorder* recorder_;
+    UrbiStreamParser parser_;
+    Dispatch dispatch_;
+    std::thread thread_;
+    std::mutex sendLock_;
+    std::unique_ptr<SendQueue> sendQueue_;
+  };
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_URBI_CONNECTION_HH
@@ -0,0 +1,159 @@
+/// \file aibo_server/urbi_message.hh
+/// \brief Borrowed and owned views of messages received from an URBI server.
+
+#ifndef AIBO_SERVER_URBI_MESSAGE_HH
+# define AIBO_SERVER_URBI_MESSAGE_HH
+
+# include <cstddef>
+# include <cstring>
+# include <iosfwd>
+# include <string>
+# include <vector>
+
+namespace aibo
+{
+  /// Non-owning reference to a range of characters.
+  class StringRef
+  {
+  public:
+    StringRef()
+      : data_(0), size_(0)
+    {}
+    StringRef(const char* data, size_t size)
+      : data_(data), size_(size)
+    {}
+    StringRef(const char* s)
+      : data_(s), size_(s ? strlen(s) : 0)
+    {}
+    StringRef(const std::string& s)
+      : data_(s.data()), size_(s.size())
+    {}
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return !size_; }
+    const char* begin() const { return data_; }
+    const char* end() const { return data_ + size_; }
+    char operator[](size_t i) const { return data_[i]; }
+
+    /// Sub-range starting at \a pos, at most \a len characters long.
+    StringRef substr(size_t pos, size_t len = size_t(-1)) const
+    {
+      if (pos > size_)
+	pos = size_;
+      if (len > size_ - pos)
+	len = size_ - pos;
+      return StringRef(data_ + pos, len);
+    }
+
+    bool startsWith(const StringRef& p) const
+    {
+      return p.size_ <= size_ && !memcmp(data_, p.data_, p.size_);
+    }
+
+    /// Copy into a std::string.
+    std::string str() const { return std::string(data_, size_); }
+
+  private:
+    const char* data_;
+    size_t size_;
+  };
+
+  inline bool operator==(const StringRef& a, const StringRef& b)
+  {
+    return a.size() == b.size() && !memcmp(a.data(), b.data(), a.size());
+  }
+
+  inline bool operator!=(const StringRef& a, const StringRef& b)
+  {
+    return !(a == b);
+  }
+
+  std::ostream& operator<<(std::ostream& s, const StringRef& r);
+
+  /// Same classification as urbi::UMessageType.
+  enum MessageType
+    {
+      MESSAGE_SYSTEM, ///< Messages prefixed by ***.
+      MESSAGE_ERROR,  ///< Messages prefixed by !!!.
+      MESSAGE_DATA    ///< All other messages.
+    };
+
+  /// A binary blob embedded in a message with "BIN <size> <header>".
+  struct BinaryRef
+  {
+    /// Everything after BIN <size> on the binary header line,
+    /// e.g. "jpeg 208 160".
+    StringRef header;
+    /// The raw bytes.
+    StringRef data;
+  };
+
+  /// A message as seen by callbacks while it is being dispatched.
+  /*! All references point into the parser's reception buffer and are
+    only valid for the duration of the callback.  Construct an
+    UrbiMessage from it to keep the message around.  */
+  class UrbiMessageView
+  {
+  public:
+    UrbiMessageView()
+      : timestamp(0), type(MESSAGE_DATA), binaries(0), binaryCount(0)
+    {}
+
+    /// Server-side timestamp.
+    int timestamp;
+    /// Associated tag.
+    StringRef tag;
+    MessageType type;
+    /// Everything after the [timestamp:tag] header, without the line
+    /// terminator.  Binary payloads are included verbatim.
+    StringRef text;
+    /// For MESSAGE_SYSTEM and MESSAGE_ERROR, text without the *** or
+    /// !!! prefix.  Equal to text for MESSAGE_DATA.
+    StringRef message;
+    /// The whole message including the header.
+    StringRef raw;
+    /// Binary payloads, in order of appearance.
+    const BinaryRef* binaries;
+    size_t binaryCount;
+
+    /// Text with binary payloads removed, the equivalent of
+    /// urbi::UMessage::rawMessage.  Allocates.
+    std::string textWithoutBinaries() const;
+  };
+
+  std::ostream& operator<<(std::ostream& s, const UrbiMessageView& m);
+
+  /// Owned copy of an UrbiMessageView.
+  /*! The raw bytes are copied in a single block, all other fields
+    refer into it.  */
+  class UrbiMessage
+  {
+  public:
+    UrbiMessage();
+    explicit UrbiMessage(const UrbiMessageView& v);
+    UrbiMessage(const UrbiMessage& m);
+    UrbiMessage& operator=(const UrbiMessage& m);
+
+    const UrbiMessageView& view() const { return view_; }
+    operator const UrbiMessageView& () const { return view_; }
+
+    int timestamp() const { return view_.timestamp; }
+    StringRef tag() const { return view_.tag; }
+    MessageType type() const { return view_.type; }
+    StringRef text() const { return view_.text; }
+    StringRef message() const { return view_.message; }
+    size_t binaryCount() const { return binaries_.size(); }
+    const BinaryRef& binary(size_t i) const { return binaries_[i]; }
+
+  private:
+    void assign(const UrbiMessageView& v);
+
+    std::string raw_;
+    std::vector<BinaryRef> binaries_;
+    UrbiMessageView view_;
+  };
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_URBI_MESSAGE_HH
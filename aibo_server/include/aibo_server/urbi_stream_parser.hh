@@ -0,0 +1,108 @@
+/// \file aibo_server/urbi_stream_parser.hh
+/// \brief Incremental parser for the stream sent by an URBI server.
+
+#ifndef AIBO_SERVER_URBI_STREAM_PARSER_HH
+# define AIBO_SERVER_URBI_STREAM_PARSER_HH
+
+# include <vector>
+
+# include "aibo_server/recv_buffer.hh"
+# include "aibo_server/urbi_message.hh"
+
+namespace aibo
+{
+  /// Receives the messages decoded by UrbiStreamParser.
+  class UrbiMessageHandler
+  {
+  public:
+    virtual ~UrbiMessageHandler() {}
+    virtual void onMessage(const UrbiMessageView& msg) = 0;
+  };
+
+  /// Resumable replacement for UAbstractClient::processRecvBuffer().
+  /*! Incoming bytes are written into the parser's RecvBuffer, either
+    with prepare()/commit() straight from recv(), or with feed().  Each
+    call to parse() then dispatches every complete message to the
+    handler and stops at the first incomplete one, remembering how far
+    it got so that no byte is scanned twice.
+
+    Messages have the form "[timestamp:tag] text\n", where text may
+    contain strings, nested lists and "BIN <size> <header>\n" binary
+    blocks followed by <size> raw bytes.  A message whose size is not a
+    plain decimal number, or could never fit the maximum buffer size,
+    is dropped up to the end of its binary header, and parsing resumes
+    at the next '['.  The handler gets views into
+    the buffer; nothing is copied or allocated per message once the
+    buffer and the binary list have reached their steady-state size.
+  */
+  class UrbiStreamParser
+  {
+  public:
+    explicit UrbiStreamParser(size_t initialSize = RecvBuffer::DEFAULT_SIZE,
+			      size_t maxSize = RecvBuffer::DEFAULT_MAX_SIZE);
+
+    /// Writable area for at least \a min bytes, see RecvBuffer::prepare().
+    /// Returns 0 when a message does not fit in the maximum buffer size.
+    char* prepare(size_t min, size_t& avail) { return buffer_.prepare(min, avail); }
+    /// Mark \a n bytes obtained from prepare() as received.
+    void commit(size_t n) { buffer_.commit(n); }
+    /// Copy \a len bytes into the buffer. Return false on overflow.
+    bool feed(const void* data, size_t len) { return buffer_.append(data, len); }
+
+    /// Dispatch all complete messages to \a handler, return their number.
+    size_t parse(UrbiMessageHandler& handler);
+
+    /// Drop buffered data and parser state, e.g. after a reconnection.
+    void reset();
+
+    /// Number of bytes received but not yet part of a dispatched message.
+    size_t pending() const { return buffer_.size(); }
+
+    /// Stream position of the first pending byte, counting every byte
+    /// received since construction.  While a message is dispatched,
+    /// the position of that message.
+    unsigned long long offset() const { return offset_; }
+
+  private:
+    enum State
+      {
+	STATE_SYNC,		///< Skipping garbage until '['.
+	STATE_HEADER,		///< Inside [timestamp:tag].
+	STATE_TEXT,		///< Scanning message text.
+	STATE_BINARY_HEADER,	///< Between "BIN " and the end of line.
+	STATE_BINARY_DATA	///< Skipping raw binary bytes.
+      };
+
+    /// Offsets of one binary block, relative to the message start.
+    struct BinaryPos
+    {
+      size_t header, headerEnd;
+      size_t data, size;
+    };
+
+    /// Run the state machine on the current message, which starts at
+    /// \a msg.  Return true once it is complete.
+    bool scan(const char* msg, size_t len);
+    void dispatch(const char* msg, UrbiMessageHandler& handler);
+    void resetMessage();
+
+    RecvBuffer buffer_;
+    unsigned long long offset_;
+
+    // State of the message being scanned.  All positions are relative
+    // to the start of the message so that they survive the buffer
+    // moving its contents around.
+    State state_;
+    size_t pos_;
+    size_t headerEnd_;
+    size_t textEnd_;
+    bool inString_;
+    bool escape_;
+    size_t binaryRemaining_;
+    std::vector<BinaryPos> binaryPos_;
+    std::vector<BinaryRef> binaryRefs_;
+  };
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_URBI_STREAM_PARSER_HH
@@ -0,0 +1,169 @@
+/// \file aibo_server/urbi_value.hh
+/// \brief Value sent by the URBI server, stored without per-element
+/// allocation.
+
+#ifndef AIBO_SERVER_URBI_VALUE_HH
+# define AIBO_SERVER_URBI_VALUE_HH
+
+# include <iosfwd>
+# include <string>
+# include <vector>
+
+# include "aibo_server/urbi_message.hh"
+
+namespace aibo
+{
+  /// Kinds of UrbiValue, as urbi::UDataType.
+  enum ValueType
+    {
+      VALUE_VOID,
+      VALUE_DOUBLE,
+      VALUE_STRING,
+      VALUE_BINARY,
+      /// A list with at least one element that is not a number.
+      VALUE_LIST,
+      /// A list of numbers only, stored as one array of doubles.  The
+      /// empty list is parsed as such.
+      VALUE_NUMBERS
+    };
+
+  /// Replacement for urbi::UValue in the message path.
+  /*! UValue keeps everything but numbers behind heap pointers and
+    allocates every list element separately.  Here numbers are stored
+    in place, strings use std::string's in-place storage when short,
+    lists keep their elements in one array, and lists of numbers, the
+    usual form of sensor and joint readings, keep a single array of
+    doubles.  Values move without copying.
+
+    Parsing into an existing value reuses its storage, lists element
+    by element, so re-parsing readings of the same shape does not
+    allocate.
+
+    Binaries are not copied: header() and data() refer into the parsed
+    text and are only valid as long as it is.  */
+  class UrbiValue
+  {
+  public:
+    UrbiValue();
+    explicit UrbiValue(double d);
+    explicit UrbiValue(const std::string& s);
+    explicit UrbiValue(const std::vector<double>& numbers);
+    UrbiValue(const UrbiValue& v);
+    UrbiValue(UrbiValue&& v) noexcept;
+    ~UrbiValue();
+
+    UrbiValue& operator=(const UrbiValue& v);
+    UrbiValue& operator=(UrbiValue&& v) noexcept;
+    UrbiValue& operator=(double d);
+    UrbiValue& operator=(const std::string& s);
+
+    ValueType type() const { return type_; }
+
+    /// Parse a whole value such as 12.5, "text", [1, 2, "a"] or
+    /// BIN 3 raw\nabc.  Return false on syntax error; the value is
+    /// then VALUE_VOID.  Leading and trailing spaces are ignored.
+    bool parse(const StringRef& text);
+    /// Parse one value at the start of [\a begin, \a end).  Return the
+    /// end of the value, or 0 on error.
+    const char* parse(const char* begin, const char* end);
+
+    /// Number, or 0 if not VALUE_DOUBLE.
+    double number() const { return type_ == VALUE_DOUBLE ? number_ : 0; }
+    /// String, empty if not VALUE_STRING.
+    const std::string& string() const;
+    /// Binary header and bytes, empty if not VALUE_BINARY.
+    StringRef header() const;
+    StringRef data() const;
+
+    /// Number of elements of a list, 0 for other types.
+    size_t size() const;
+    /// Elements of VALUE_NUMBERS, or 0.
+    const double* numbers() const;
+    /// Elements of VALUE_LIST, empty for other types.
+    const std::vector<UrbiValue>& list() const;
+
+    /// Copy a number or a list of numbers to \a out.  Return false,
+    /// leaving \a out empty, for anything else.
+    bool toNumbers(std::vector<double>& out) const;
+
+    /// Drop the content; storage is kept for reuse.
+    void clear();
+
+    std::ostream& print(std::ostream& s) const;
+
+  private:
+    const char* parseList(const char* p, const char* end, int depth);
+    const char* parseValue(const char* p, const char* end, int depth);
+    /// Switch to \a t, keeping the storage of the current type if it
+    /// is the same.
+    void reset(ValueType t) noexcept;
+    void destroy() noexcept;
+    /// Copy or move \a v, which may be an element of this value.
+    void copy(const UrbiValue& v);
+    void move(UrbiValue& v) noexcept;
+
+    ValueType type_;
+    union
+    {
+      double number_;
+      std::string string_;
+      std::vector<UrbiValue> list_;
+      std::vector<double> numbers_;
+      struct
+      {
+	const char* header;
+	size_t headerSize;
+	const char* data;
+	size_t dataSize;
+      } binary_;
+    };
+  };
+
+  std::ostream& operator<<(std::ostream& s, const UrbiValue& v);
+
+  /// Conversion of an UrbiValue to \a T, as urbi::uvalue_caster.
+  template <class T>
+  struct value_caster;
+
+  template <>
+  struct value_caster<double>
+  {
+    double operator()(const UrbiValue& v) const { return v.number(); }
+  };
+
+  template <>
+  struct value_caster<int>
+  {
+    int operator()(const UrbiValue& v) const
+    {
+      return static_cast<int>(v.number());
+    }
+  };
+
+  template <>
+  struct value_caster<std::string>
+  {
+    std::string operator()(const UrbiValue& v) const { return v.string(); }
+  };
+
+  template <>
+  struct value_caster<std::vector<double> >
+  {
+    std::vector<double> operator()(const UrbiValue& v) const
+    {
+      std::vector<double> res;
+      v.toNumbers(res);
+      return res;
+    }
+  };
+
+  /// Convert \a v to \a T.
+  template <class T>
+  T value_cast(const UrbiValue& v)
+  {
+    return value_caster<T>()(v);
+  }
+
+} // namespace aibo
+
+#endif // ! AIBO_SERVER_URBI_VALUE_HH
@@ -0,0 +1,497 @@
+#!/usr/bin/env python
+"""Generate the kinematics of the Aibo chains from Aibo.urdf.
+
+Usage: generate_kinematics.py Aibo.urdf kinematics_generated.hh
+
+Every chain from base_link to a paw, to the head and to the tail is
+unrolled into straight-line code.  The fixed transforms of the URDF are
+multiplied out here, and terms that are exactly zero are dropped, so
+that only the arithmetic that depends on joint angles is left.  The C++
+compiler cannot do this folding on its own: 0 * x is not 0 for every
+double without -ffast-math.
+
+The four legs have the same structure, so they are also emitted as one
+function over LegVector, with the constants that differ between legs
+held in per-lane vectors.
+"""
+
+from __future__ import print_function
+
+import math
+import sys
+import xml.etree.ElementTree as ET
+
+BASE = 'base_link'
+
+# Chains to generate, as (enum, tip link), legs first.
+CHAINS = [
+    ('CHAIN_LEG_RF', 'RF_paw'),
+    ('CHAIN_LEG_LF', 'LF_paw'),
+    ('CHAIN_LEG_RB', 'RB_paw'),
+    ('CHAIN_LEG_LB', 'LB_paw'),
+    ('CHAIN_HEAD', 'head'),
+    ('CHAIN_TAIL', 'tail2'),
+]
+# LEG_COUNT of aibo_server/kinematics.hh.
+LEGS = 4
+
+# Products of the URDF constants that should cancel come out around
+# 1e-17; anything below this is taken as zero.
+EPSILON = 1e-14
+
+
+## ------------ ##
+## URDF model.  ##
+## ------------ ##
+
+class Joint(object):
+    pass
+
+
+def floats(elt, attr, default):
+    if elt is None or elt.get(attr) is None:
+        return list(default)
+    return [float(x) for x in elt.get(attr).split()]
+
+
+def parse(path):
+    """Joints of the URDF, by child link."""
+    res = {}
+    for elt in ET.parse(path).getroot().findall('joint'):
+        j = Joint()
+        j.name = elt.get('name')
+        j.type = elt.get('type')
+        j.parent = elt.find('parent').get('link')
+        j.child = elt.find('child').get('link')
+        j.xyz = floats(elt.find('origin'), 'xyz', [0, 0, 0])
+        j.rpy = floats(elt.find('origin'), 'rpy', [0, 0, 0])
+        j.axis = floats(elt.find('axis'), 'xyz', [1, 0, 0])
+        n = math.sqrt(sum(a * a for a in j.axis))
+        j.axis = [a / n for a in j.axis]
+        limit = elt.find('limit')
+        j.lower = float(limit.get('lower', 0)) if limit is not None else 0
+        j.upper = float(limit.get('upper', 0)) if limit is not None else 0
+        if j.type not in ('revolute', 'continuous', 'fixed'):
+            sys.exit('%s: unsupported joint type %s' % (j.name, j.type))
+        res[j.child] = j
+    return res
+
+
+def chain(joints, tip):
+    """Revolute joints from BASE to TIP, and the fixed joints after the
+    last one."""
+    path = []
+    link = tip
+    while link != BASE:
+        if link not in joints:
+            sys.exit('no path from %s to %s' % (BASE, tip))
+        path.append(joints[link])
+        link = joints[link].parent
+    path.reverse()
+    moving = [j for j in path if j.type != 'fixed']
+    last = path.index(moving[-1])
+    if len(moving) != last + 1:
+        sys.exit('%s: fixed joints are only supported after the last '
+                 'moving one' % tip)
+    return moving, path[last + 1:]
+
+
+def rpy_matrix(xyz, rpy):
+    """3x4 transform of an URDF origin."""
+    r, p, y = rpy
+    cr, sr = math.cos(r), math.sin(r)
+    cp, sp = math.cos(p), math.sin(p)
+    cy, sy = math.cos(y), math.sin(y)
+    return [[cy * cp, cy * sp * sr - sy * cr, cy * sp * cr + sy * sr, xyz[0]],
+            [sy * cp, sy * sp * sr + cy * cr, sy * sp * cr - cy * sr, xyz[1]],
+            [-sp, cp * sr, cp * cr, xyz[2]]]
+
+
+def numeric_product(a, b):
+    return [[sum(a[i][k] * b[k][j] for k in range(3))
+             + (a[i][3] if j == 3 else 0) for j in range(4)]
+            for i in range(3)]
+
+
+def matrix_rpy(m):
+    """Origin of a 3x4 transform, as (xyz, rpy)."""
+    p = math.atan2(-m[2][0], math.hypot(m[0][0], m[1][0]))
+    if abs(math.cos(p)) < 1e-9:
+        r = 0.0
+        y = math.atan2(-m[0][1], m[1][1])
+    else:
+        r = math.atan2(m[2][1], m[2][2])
+        y = math.atan2(m[1][0], m[0][0])
+    return [m[0][3], m[1][3], m[2][3]], [r, p, y]
+
+
+def tip_origin(fixed):
+    """The fixed joints after the last moving one, as one origin."""
+    m = rpy_matrix([0, 0, 0], [0, 0, 0])
+    for j in fixed:
+        m = numeric_product(m, rpy_matrix(j.xyz, j.rpy))
+    return matrix_rpy(m)
+
+
+## -------------------- ##
+## Symbolic arithmetic. ##
+## -------------------- ##
+
+# A value is a polynomial in the cosines and sines of the joints and the
+# temporaries already emitted: a dict from monomials, sorted tuples of
+# variable names, to coefficients, tuples with one float per lane.
+
+def is_zero(c):
+    return all(abs(x) < EPSILON for x in c)
+
+
+def const(c):
+    return {} if is_zero(c) else {(): tuple(c)}
+
+
+def var(name, lanes):
+    return {(name,): (1.0,) * lanes}
+
+
+def vadd(a, b):
+    res = dict(a)
+    for m, c in b.items():
+        if m in res:
+            c = tuple(x + y for x, y in zip(res[m], c))
+        res[m] = c
+    return dict((m, c) for m, c in res.items() if not is_zero(c))
+
+
+def vneg(a):
+    return dict((m, tuple(-x for x in c)) for m, c in a.items())
+
+
+def vmul(a, b):
+    res = {}
+    for ma, ca in a.items():
+        for mb, cb in b.items():
+            res = vadd(res, {tuple(sorted(ma + mb)):
+                             tuple(x * y for x, y in zip(ca, cb))})
+    return res
+
+
+def uniform(c):
+    return all(x == c[0] for x in c)
+
+
+class Function(object):
+    """Body of one generated function."""
+
+    def __init__(self, lanes):
+        self.lanes = lanes
+        self.type = 'LegVector' if lanes > 1 else 'double'
+        self.consts = {}
+        self.const_lines = []
+        self.lines = []
+        self.temps = 0
+        self.cache = {}
+
+    def literal(self, c, vector=False):
+        if uniform(c) and not (vector and self.lanes > 1):
+            return repr(float(c[0]))
+        if c not in self.consts:
+            name = 'k%d' % len(self.consts)
+            self.consts[c] = name
+            self.const_lines.append(
+                'const LegVector %s = {%s};'
+                % (name, ', '.join(repr(float(x)) for x in c)))
+        return self.consts[c]
+
+    def expr(self, value):
+        if not value:
+            return self.literal((0.0,) * self.lanes, True)
+        if list(value) == [()]:
+            return self.literal(value[()], True)
+        terms = sorted(value.items(), key=lambda t: (-len(t[0]), t[0]))
+        res = ''
+        for m, c in terms:
+            neg = uniform(c) and c[0] < 0
+            if neg:
+                c = tuple(-x for x in c)
+            if not m:
+                term = self.literal(c)
+            elif uniform(c) and c[0] == 1:
+                term = '*'.join(m)
+            else:
+                term = self.literal(c) + '*' + '*'.join(m)
+            if not res:
+                res = '-' + term if neg else term
+            else:
+                res += (' - ' if neg else ' + ') + term
+        return res
+
+    def simple(self, value):
+        if len(value) > 1:
+            return False
+        for m, c in value.items():
+            return not m or (len(m) == 1 and uniform(c) and abs(c[0]) == 1)
+        return True
+
+    def temp(self, value):
+        """VALUE, through a temporary unless it is a constant or a
+        variable."""
+        if self.simple(value):
+            return value
+        e = self.expr(value)
+        if e not in self.cache:
+            name = 't%d' % self.temps
+            self.temps += 1
+            self.lines.append('const %s %s = %s;' % (self.type, name, e))
+            self.cache[e] = var(name, self.lanes)
+        return self.cache[e]
+
+    def product(self, a, b):
+        res = []
+        for i in range(3):
+            row = []
+            for j in range(4):
+                v = a[i][3] if j == 3 else {}
+                for k in range(3):
+                    v = vadd(v, vmul(a[i][k], b[k][j]))
+                row.append(self.temp(v))
+            res.append(row)
+        return res
+
+    def code(self, indent):
+        return ''.join(indent + l + '\n'
+                       for l in self.const_lines + self.lines)
+
+
+def const_matrix(ms):
+    """Per-lane numeric 3x4 matrices as a symbolic one."""
+    return [[const(tuple(m[i][j] for m in ms)) for j in range(4)]
+            for i in range(3)]
+
+
+def rotation(axes, c, s):
+    """Rotation about the per-lane AXES by the angle of cosine C and sine
+    S: a a^T + c (I - a a^T) + s [a]x."""
+    lanes = len(axes)
+    res = []
+    for i in range(3):
+        row = []
+        for j in range(3):
+            aa = tuple(a[i] * a[j] for a in axes)
+            ident = 1.0 if i == j else 0.0
+            skew = []
+            for a in axes:
+                x = [[0, -a[2], a[1]], [a[2], 0, -a[0]], [-a[1], a[0], 0]]
+                skew.append(x[i][j])
+            v = const(aa)
+            v = vadd(v, vmul(const(tuple(ident - x for x in aa)),
+                             var(c, lanes)))
+            v = vadd(v, vmul(const(tuple(skew)), var(s, lanes)))
+            row.append(v)
+        row.append({})
+        res.append(row)
+    return res
+
+
+def unroll(f, chains):
+    """Emit the chain product for CHAINS, one per lane.  Return the tip
+    transform and, for each joint, its frame and per-lane axis."""
+    lanes = len(chains)
+    t = const_matrix([rpy_matrix([0, 0, 0], [0, 0, 0])] * lanes)
+    frames = []
+    for k in range(len(chains[0][0])):
+        joints = [c[0][k] for c in chains]
+        t = f.product(t, const_matrix([rpy_matrix(j.xyz, j.rpy)
+                                       for j in joints]))
+        axes = [j.axis for j in joints]
+        frames.append((t, axes))
+        t = f.product(t, rotation(axes, 'c%d' % k, 's%d' % k))
+    tips = [tip_origin(c[1]) for c in chains]
+    t = f.product(t, const_matrix([rpy_matrix(x, r) for x, r in tips]))
+    return t, frames
+
+
+def jacobian(f, tip, frames):
+    """Columns of the geometric Jacobian at the tip, in the base frame:
+    z x (p_tip - p) over z for each joint."""
+    cols = []
+    for t, axes in frames:
+        z = []
+        for i in range(3):
+            v = {}
+            for k in range(3):
+                v = vadd(v, vmul(t[i][k], const(tuple(a[k] for a in axes))))
+            z.append(f.temp(v))
+        d = [f.temp(vadd(tip[i][3], vneg(t[i][3]))) for i in range(3)]
+        v = [f.temp(vadd(vmul(z[(i + 1) % 3], d[(i + 2) % 3]),
+                         vneg(vmul(z[(i + 2) % 3], d[(i + 1) % 3]))))
+             for i in range(3)]
+        cols.append(v + z)
+    return cols
+
+
+## ----------- ##
+## C++ output. ##
+## ----------- ##
+
+def trig(dof, indent):
+    return ''.join('%sconst double c%d = std::cos(q[%d]), s%d = std::sin(q[%d]);\n'
+                   % (indent, i, i, i, i) for i in range(dof))
+
+
+def outputs(f, tip, cols, store):
+    """Assignments of the results, through STORE(kind, index, expr)."""
+    res = []
+    for i in range(3):
+        for j in range(3):
+            res.append(store('r', 3 * i + j, f.expr(tip[i][j])))
+    for i in range(3):
+        res.append(store('p', i, f.expr(tip[i][3])))
+    dof = len(cols)
+    for i, col in enumerate(cols):
+        for r in range(6):
+            res.append(store('j', r * dof + i, f.expr(col[r])))
+    return res
+
+
+def joint_model(j):
+    def arr(v):
+        return '{%s}' % ', '.join(repr(float(x) + 0.0) for x in v)
+    return '{"%s", %s, %s, %s, %r, %r}' % (
+        j.name, arr(j.xyz), arr(j.rpy), arr(j.axis),
+        float(j.lower), float(j.upper))
+
+
+def specialization(enum, tip_link, moving, fixed):
+    dof = len(moving)
+    out = []
+    w = out.append
+    w('  template <>\n')
+    w('  struct ChainKinematics<%s>\n' % enum)
+    w('  {\n')
+    w('    enum { DOF = %d };\n\n' % dof)
+    w('    static constexpr const char* base() { return "%s"; }\n' % BASE)
+    w('    static constexpr const char* tip() { return "%s"; }\n\n' % tip_link)
+    w('    /// Moving joint \\a i, from the base.\n')
+    w('    static constexpr JointModel joint(unsigned i)\n')
+    w('    {\n')
+    w('      return\n')
+    for i, j in enumerate(moving):
+        if i < dof - 1:
+            w('\ti == %d ? JointModel %s :\n' % (i, joint_model(j)))
+        else:
+            w('\tJointModel %s;\n' % joint_model(j))
+    w('    }\n\n')
+    xyz, rpy = tip_origin(fixed)
+    t = Joint()
+    t.name = fixed[-1].name if fixed else ''
+    t.xyz, t.rpy, t.axis, t.lower, t.upper = xyz, rpy, [0, 0, 0], 0, 0
+    w('    /// Fixed transform from the last joint to the tip.\n')
+    w('    static constexpr JointModel tipJoint()\n')
+    w('    {\n')
+    w('      return JointModel %s;\n' % joint_model(t))
+    w('    }\n\n')
+
+    for with_jacobian in (False, True):
+        f = Function(1)
+        tip, frames = unroll(f, [(moving, fixed)])
+        cols = jacobian(f, tip, frames) if with_jacobian else []
+        if with_jacobian:
+            w('    static void jacobian(const double* q, Transform& tip,'
+              ' double* jac)\n')
+        else:
+            w('    static void forward(const double* q, Transform& tip)\n')
+        w('    {\n')
+        names = {'r': 'tip.r', 'p': 'tip.p', 'j': 'jac'}
+        stores = outputs(f, tip, cols,
+                         lambda k, i, e: '%s[%d] = %s;' % (names[k], i, e))
+        w(trig(dof, '      '))
+        w(f.code('      '))
+        for l in stores:
+            w('      %s\n' % l)
+        w('    }\n')
+        if not with_jacobian:
+            w('\n')
+    w('  };\n\n')
+    return ''.join(out)
+
+
+def legs_function(chains, with_jacobian):
+    dof = len(chains[0][0])
+    f = Function(LEGS)
+    tip, frames = unroll(f, chains)
+    cols = jacobian(f, tip, frames) if with_jacobian else []
+    names = {'r': 'tips.r', 'p': 'tips.p', 'j': 'jac'}
+    stores = outputs(f, tip, cols,
+                     lambda k, i, e: '%s[%d] = %s;' % (names[k], i, e))
+    out = []
+    w = out.append
+    w('  inline void\n')
+    if with_jacobian:
+        w('  jacobianLegs(const LegVector q[LEG_DOF], LegTransform& tips,'
+          ' LegVector* jac)\n')
+    else:
+        w('  forwardLegs(const LegVector q[LEG_DOF], LegTransform& tips)\n')
+    w('  {\n')
+    w('    LegVector %s;\n' % ', '.join('c%d, s%d' % (i, i)
+                                       for i in range(dof)))
+    for i in range(dof):
+        w('    sinCos(q[%d], s%d, c%d);\n' % (i, i, i))
+    w(f.code('    '))
+    for l in stores:
+        w('    %s\n' % l)
+    w('  }\n')
+    return ''.join(out)
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('usage: %s Aibo.urdf output.hh' % sys.argv[0])
+    joints = parse(sys.argv[1])
+    chains = [(enum, tip, chain(joints, tip)) for enum, tip in CHAINS]
+
+    legs = [c[2] for c in chains[:LEGS]]
+    dof = len(legs[0][0])
+    for moving, fixed in legs:
+        if len(moving) != dof:
+            sys.exit('the legs do not have the same number of joints')
+
+    out = []
+    w = out.append
+    w('/// \\file aibo_server/kinematics_generated.hh\n')
+    w('/// \\brief Kinematics of the Aibo chains, generated from Aibo.urdf'
+      ' by\n')
+    w('/// scripts/generate_kinematics.py.  Do not edit.\n')
+    w('///\n')
+    w('/// Included by aibo_server/kinematics.hh.\n\n')
+    w('#ifndef AIBO_SERVER_KINEMATICS_GENERATED_HH\n')
+    w('# define AIBO_SERVER_KINEMATICS_GENERATED_HH\n\n')
+    w('# include <cmath>\n\n')
+    w('namespace aibo\n')
+    w('{\n')
+    w('  /// Chains of Aibo.urdf, from %s to their tip link.\n' % BASE)
+    w('  enum KinematicChain\n')
+    w('    {\n')
+    for enum, tip, _ in chains:
+        w('      %s,\n' % enum)
+    w('      CHAIN_COUNT\n')
+    w('    };\n\n')
+    w('  enum { LEG_DOF = %d };\n\n' % dof)
+    w('  template <KinematicChain C>\n')
+    w('  struct ChainKinematics;\n\n')
+    for enum, tip, (moving, fixed) in chains:
+        w(specialization(enum, tip, moving, fixed))
+    w('  /// The four legs, one per lane of LegVector, angles in radians.\n')
+    w(legs_function(legs, False))
+    w('\n')
+    w('  /// Same, with the 6 x LEG_DOF Jacobians, row-major.\n')
+    w(legs_function(legs, True))
+    w('\n')
+    w('} // namespace aibo\n\n')
+    w('#endif // ! AIBO_SERVER_KINEMATICS_GENERATED_HH\n')
+
+    with open(sys.argv[2], 'w') as f:
+        f.write(''.join(out))
+
+
+if __name__ == '__main__':
+    main()
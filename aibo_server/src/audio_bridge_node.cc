@@ -0,0 +1,141 @@
+/// \file audio_bridge_node.cc
+/// \brief Stream the Aibo microphones to audio_common_msgs/AudioData,
+/// and play AudioData on its speaker.
+///
+/// Both directions carry raw 16 kHz, 16-bit, stereo little-endian PCM.
+///
+/// Parameters:
+///   ~host         URBI server (default "aibo")
+///   ~port         URBI port (default 54000)
+///   ~chunk_bytes  bytes per published chunk (default 1024, 16 ms)
+///   ~ring_bytes   captured audio waiting to be published (default 32768)
+///   ~lead_ms      audio kept queued on the robot (default 100)
+///   ~play_bytes   received audio waiting to be played (default 65536)
+///   ~record       log directory to record the raw stream to (default none)
+
+#include <audio_common_msgs/AudioData.h>
+#include <ros/ros.h>
+
+#include "aibo_server/audio_stream.hh"
+#include "aibo_server/callback_table.hh"
+#include "aibo_server/stream_log.hh"
+
+namespace
+{
+  class Bridge
+  {
+  public:
+    Bridge(ros::NodeHandle& nh, size_t playBytes)
+      : pub_(nh.advertise<audio_common_msgs::AudioData>("audio/capture", 16)),
+	play_(playBytes)
+    {}
+
+    /// Called from the microphone publisher thread.
+    void publish(const aibo::AudioChunk& chunk)
+    {
+      audio_common_msgs::AudioDataPtr msg(new audio_common_msgs::AudioData);
+      msg->data.assign(chunk.data, chunk.data + chunk.size);
+      pub_.publish(msg);
+    }
+
+    /// Called from the ROS spinner, the only producer of play_.
+    void receive(const audio_common_msgs::AudioData::ConstPtr& msg)
+    {
+      if (!play_.push(reinterpret_cast<const char*>(msg->data.data()),
+		      msg->data.size()))
+	ROS_WARN_THROTTLE(1, "speaker buffer full, dropping %zu bytes",
+			  msg->data.size());
+    }
+
+    /// Source of the speaker: whatever has been received, whole frames.
+    long read(char* buffer, size_t len)
+    {
+      size_t n = std::min(len, play_.size());
+      n -= n % aibo::AudioFormat().frameBytes();
+      return play_.pop(buffer, n) ? n : 0;
+    }
+
+  private:
+    ros::Publisher pub_;
+    aibo::SpscRing<char> play_;
+  };
+}
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "audio_bridge");
+  ros::NodeHandle nh;
+  ros::NodeHandle pnh("~");
+
+  std::string host, record;
+  int port, chunkBytes, ringBytes, leadMs, playBytes, sendQueue;
+  aibo::MicrophoneConfig micro;
+  aibo::SpeakerConfig speaker;
+  pnh.param<std::string>("host", host, "aibo");
+  pnh.param("port", port, static_cast<int>(aibo::URBI_PORT));
+  pnh.param("chunk_bytes", chunkBytes, static_cast<int>(micro.chunkBytes));
+  pnh.param("ring_bytes", ringBytes, static_cast<int>(micro.ringBytes));
+  pnh.param("lead_ms", leadMs, static_cast<int>(speaker.leadMs));
+  pnh.param("play_bytes", playBytes, 65536);
+  pnh.param<std::string>("record", record, "");
+  pnh.param("send_queue", sendQueue, 0);
+  micro.chunkBytes = chunkBytes > 0 ? chunkBytes : 1024;
+  micro.ringBytes = ringBytes > 0 ? ringBytes : 0;
+  speaker.leadMs = leadMs > 0 ? leadMs : 0;
+
+  // Declared first so that it outlives the receive thread.
+  aibo::StreamRecorder recorder;
+  aibo::UrbiConnection connection(host, port);
+  if (connection.connect())
+  {
+    ROS_FATAL("%s", connection.errorMessage().c_str());
+    return 1;
+  }
+  // The speaker thread and the receive thread both send; a queue lets
+  // them share writes instead of taking turns on the socket.
+  if (sendQueue > 0)
+    connection.enableSendQueue(sendQueue);
+  if (!record.empty())
+  {
+    if (recorder.open(record))
+    {
+      ROS_FATAL("%s", recorder.errorMessage().c_str());
+      return 1;
+    }
+    connection.setRecorder(&recorder);
+  }
+
+  Bridge bridge(nh, playBytes > 0 ? playBytes : 65536);
+  aibo::MicrophoneStream microphone(connection, micro);
+  microphone.setCallback(std::bind(&Bridge::publish, &bridge,
+				   std::placeholders::_1));
+  aibo::SpeakerStream speakerStream(connection, speaker);
+  aibo::CallbackTable table;
+  table.add(micro.tag, microphone);
+  table.add(speaker.tag, speakerStream);
+  connection.setHandler(&table);
+  connection.start();
+  if (microphone.start())
+  {
+    ROS_FATAL("cannot start the microphone loop on %s", host.c_str());
+    connection.close();
+    return 1;
+  }
+  speakerStream.play(std::bind(&Bridge::read, &bridge,
+			       std::placeholders::_1, std::placeholders::_2));
+  ros::Subscriber sub = nh.subscribe("audio/play", 16, &Bridge::receive,
+				     &bridge);
+
+  ros::spin();
+  speakerStream.stop();
+  microphone.stop();
+  connection.close();
+  const aibo::MicrophoneStats& m = microphone.stats();
+  const aibo::SpeakerStats& s = speakerStream.stats();
+  ROS_INFO("microphone: %zu received, %zu chunks published, %zu overruns, "
+	   "%zu errors", m.received.load(), m.published.load(),
+	   m.overruns.load(), m.errors.load());
+  ROS_INFO("speaker: %zu chunks, %llu bytes, %zu underruns",
+	   s.chunks.load(), s.bytes.load(), s.underruns.load());
+  return 0;
+}
@@ -0,0 +1,477 @@
+/// \file audio_stream.cc
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+#include "aibo_server/audio_stream.hh"
+
+namespace aibo
+{
+  namespace
+  {
+    /// Room for "speaker.val = bin <size> raw <format>;".
+    enum { HEADER_ROOM = 96 };
+
+    unsigned le16(const unsigned char* p)
+    {
+      return p[0] | p[1] << 8;
+    }
+
+    unsigned long le32(const unsigned char* p)
+    {
+      return p[0] | p[1] << 8 | p[2] << 16 | (unsigned long) p[3] << 24;
+    }
+  }
+
+  bool
+  parseSoundHeader(const StringRef& header, AudioFormat& format, bool& wav)
+  {
+    // Copy to get NUL termination; headers are a few words long.
+    char buf[64];
+    size_t len = std::min(header.size(), sizeof buf - 1);
+    memcpy(buf, header.data(), len);
+    buf[len] = 0;
+    char name[16];
+    unsigned channels, rate, bits, sign;
+    if (sscanf(buf, "%15s %u %u %u %u", name, &channels, &rate, &bits,
+	       &sign) != 5)
+      return false;
+    if (!strcasecmp(name, "wav"))
+      wav = true;
+    else if (!strcasecmp(name, "raw"))
+      wav = false;
+    else
+      return false;
+    if (!channels || !rate || !bits || bits % 8 || (sign != 1 && sign != 2))
+      return false;
+    format.channels = channels;
+    format.rate = rate;
+    format.sampleBits = bits;
+    format.sampleSigned = sign == 1;
+    return true;
+  }
+
+  /*------------.
+  | WavReader.  |
+  `------------*/
+
+  WavReader::WavReader()
+    : file_(0), size_(0), left_(0)
+  {}
+
+  WavReader::~WavReader()
+  {
+    close();
+  }
+
+  int
+  WavReader::fail(const std::string& msg)
+  {
+    errorMessage_ = msg;
+    close();
+    return -1;
+  }
+
+  int
+  WavReader::open(const std::string& path)
+  {
+    close();
+    file_ = fopen(path.c_str(), "rb");
+    if (!file_)
+      return fail(path + ": " + strerror(errno));
+    unsigned char riff[12];
+    if (fread(riff, 1, sizeof riff, file_) != sizeof riff
+	|| memcmp(riff, "RIFF", 4) || memcmp(riff + 8, "WAVE", 4))
+      return fail(path + ": not a WAV file");
+
+    // Chunks up to the samples; fmt must come first.
+    bool fmt = false;
+    for (;;)
+    {
+      unsigned char chunk[8];
+      if (fread(chunk, 1, sizeof chunk, file_) != sizeof chunk)
+	return fail(path + ": no data chunk");
+      unsigned long size = le32(chunk + 4);
+      if (!memcmp(chunk, "data", 4))
+      {
+	if (!fmt)
+	  return fail(path + ": data before fmt chunk");
+	size_ = left_ = size;
+	return 0;
+      }
+      if (!memcmp(chunk, "fmt ", 4) && size >= 16)
+      {
+	unsigned char f[16];
+	if (fread(f, 1, sizeof f, file_) != sizeof f)
+	  return fail(path + ": truncated fmt chunk");
+	// Only integer PCM, tag 1.
+	if (le16(f) != 1)
+	  return fail(path + ": not PCM");
+	format_.channels = le16(f + 2);
+	format_.rate = le32(f + 4);
+	format_.sampleBits = le16(f + 14);
+	format_.sampleSigned = format_.sampleBits > 8;
+	if (!format_.channels || !format_.rate || !format_.sampleBits
+	    || format_.sampleBits % 8)
+	  return fail(path + ": unsupported sample format");
+	fmt = true;
+	size -= 16;
+      }
+      // Chunks are padded to even sizes.
+      if (fseek(file_, size + (size & 1), SEEK_CUR))
+	return fail(path + ": " + strerror(errno));
+    }
+  }
+
+  void
+  WavReader::close()
+  {
+    if (file_)
+      fclose(file_);
+    file_ = 0;
+    size_ = left_ = 0;
+  }
+
+  long
+  WavReader::read(char* buffer, size_t len)
+  {
+    if (!file_)
+      return -1;
+    size_t n = fread(buffer, 1, std::min(len, left_), file_);
+    if (!n && left_ && ferror(file_))
+      return -1;
+    // A truncated file ends early.
+    left_ = n ? left_ - n : 0;
+    return n;
+  }
+
+  /*-------------------.
+  | MicrophoneStream.  |
+  `-------------------*/
+
+  MicrophoneStream::MicrophoneStream(UrbiConnection& connection,
+				     const MicrophoneConfig& config)
+    : connection_(connection),
+      config_(config),
+      ring_(std::max(config.ringBytes, 2 * config.chunkBytes)),
+      // Robot binaries are 2048 bytes; leave room for much smaller ones.
+      marks_(ring_.capacity() / 64),
+      pushed_(0),
+      stopping_(false),
+      sleeping_(false)
+  {
+    config_.chunkBytes -= config_.chunkBytes % 4;
+    if (!config_.chunkBytes)
+      config_.chunkBytes = 4;
+    thread_ = std::thread(&MicrophoneStream::run, this);
+  }
+
+  MicrophoneStream::~MicrophoneStream()
+  {
+    stopping_ = true;
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      work_.notify_all();
+    }
+    thread_.join();
+  }
+
+  int
+  MicrophoneStream::start()
+  {
+    return connection_.sendf("%s_loop: loop { %s: micro.val },\n",
+			     config_.tag.c_str(), config_.tag.c_str());
+  }
+
+  int
+  MicrophoneStream::stop()
+  {
+    return connection_.sendf("stop %s_loop;\n", config_.tag.c_str());
+  }
+
+  void
+  MicrophoneStream::onMessage(const UrbiMessageView& msg)
+  {
+    if (msg.tag != StringRef(config_.tag) || !msg.binaryCount)
+      return;
+    Mark m;
+    m.received = steadyTime();
+    m.timestamp = msg.timestamp;
+    ++stats_.received;
+    const BinaryRef& bin = msg.binaries[0];
+    bool wav;
+    if (!parseSoundHeader(bin.header, m.format, wav))
+    {
+      ++stats_.errors;
+      return;
+    }
+    const char* data = bin.data.data();
+    size_t size = bin.data.size();
+    if (wav && size >= 44 && !memcmp(data, "RIFF", 4))
+    {
+      data += 44;
+      size -= 44;
+    }
+    if (!size)
+      return;
+    // Only the publisher frees room, so there is at least as much when
+    // pushing as measured here.
+    if (ring_.capacity() - ring_.size() < size
+	|| marks_.capacity() == marks_.size())
+    {
+      ++stats_.overruns;
+      return;
+    }
+    // The mark goes first, so that the publisher finds it for every
+    // byte it can pop.
+    pushed_ += size;
+    m.end = pushed_;
+    marks_.push(&m, 1);
+    ring_.push(reinterpret_cast<const uint8_t*>(data), size);
+    // The ring's release store could otherwise pass the load of
+    // sleeping_; see run().
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_ && ring_.size() >= config_.chunkBytes)
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      work_.notify_one();
+    }
+  }
+
+  void
+  MicrophoneStream::run()
+  {
+    std::vector<uint8_t> data(config_.chunkBytes);
+    unsigned long long seq = 0;
+    while (!stopping_)
+    {
+      if (!ring_.pop(data.data(), data.size()))
+      {
+	std::unique_lock<std::mutex> lock(lock_);
+	sleeping_ = true;
+	// The receive thread pushes, then checks sleeping_; we set
+	// sleeping_, then check the ring.  The fences on both sides keep
+	// each store before the following load, so either it notifies or
+	// we see its bytes.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!stopping_ && ring_.size() < data.size())
+	  work_.wait(lock);
+	sleeping_ = false;
+	continue;
+      }
+
+      // The first binary ending at or after the chunk completed it.
+      uint64_t end = ring_.popped();
+      const Mark* m = marks_.front();
+      while (m->end < end)
+      {
+	marks_.drop(1);
+	m = marks_.front();
+      }
+      AudioChunk chunk;
+      chunk.data = data.data();
+      chunk.size = data.size();
+      chunk.format = m->format;
+      chunk.seq = seq++;
+      chunk.timestamp = m->timestamp;
+      chunk.received = m->received;
+      if (m->end == end)
+	marks_.drop(1);
+      ++stats_.published;
+      if (callback_)
+	callback_(chunk);
+    }
+  }
+
+  /*----------------.
+  | SpeakerStream.  |
+  `----------------*/
+
+  SpeakerStream::SpeakerStream(UrbiConnection& connection,
+			       const SpeakerConfig& config)
+    : connection_(connection),
+      config_(config),
+      playing_(false),
+      stopping_(false),
+      emptyAt_(0),
+      sent_(0),
+      sentAtQuery_(0),
+      queryPending_(false)
+  {
+    size_t frame = config_.format.frameBytes();
+    config_.chunkBytes -= config_.chunkBytes % frame;
+    if (!config_.chunkBytes)
+      config_.chunkBytes = frame;
+    // "<tag>: speaker.remain;\n" follows the chunk.
+    packet_.resize(HEADER_ROOM + config_.chunkBytes + config_.tag.size()
+		   + 32);
+  }
+
+  SpeakerStream::~SpeakerStream()
+  {
+    stop();
+  }
+
+  int
+  SpeakerStream::play(const Source& source)
+  {
+    if (playing_)
+      return -1;
+    if (thread_.joinable())
+      thread_.join();
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      sent_ = 0;
+    }
+    stopping_ = false;
+    playing_ = true;
+    thread_ = std::thread(&SpeakerStream::run, this, source);
+    return 0;
+  }
+
+  void
+  SpeakerStream::stop()
+  {
+    stopping_ = true;
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      wake_.notify_all();
+    }
+    if (thread_.joinable())
+      thread_.join();
+    playing_ = false;
+  }
+
+  void
+  SpeakerStream::wait()
+  {
+    if (thread_.joinable())
+      thread_.join();
+    double left;
+    while ((left = queued()) > 0)
+      std::this_thread::sleep_for(std::chrono::duration<double>(left));
+  }
+
+  double
+  SpeakerStream::queued() const
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    return std::max(emptyAt_ - steadyTime(), 0.0);
+  }
+
+  void
+  SpeakerStream::onMessage(const UrbiMessageView& msg)
+  {
+    if (msg.type != MESSAGE_DATA || msg.tag != StringRef(config_.tag))
+      return;
+    double now = steadyTime();
+    char buf[32];
+    size_t len = std::min(msg.text.size(), sizeof buf - 1);
+    memcpy(buf, msg.text.data(), len);
+    buf[len] = 0;
+    char* end;
+    double remain = strtod(buf, &end);
+    if (end == buf)
+      return;
+    std::lock_guard<std::mutex> lock(lock_);
+    // The robot had remain ms left of what was sent up to the query,
+    // and has been sent more since.
+    emptyAt_ = now + remain / 1000
+      + (sent_ - sentAtQuery_) / config_.format.bytesPerSecond();
+    queryPending_ = false;
+    ++stats_.remainReplies;
+  }
+
+  size_t
+  SpeakerStream::fill(const Source& source, char* buffer, bool& end)
+  {
+    size_t size = 0;
+    while (size < config_.chunkBytes)
+    {
+      long n = source(buffer + size, config_.chunkBytes - size);
+      if (n < 0)
+	end = true;
+      if (n <= 0)
+	break;
+      size += n;
+    }
+    return size;
+  }
+
+  int
+  SpeakerStream::send(char* data, size_t size)
+  {
+    const AudioFormat& f = config_.format;
+    char header[HEADER_ROOM];
+    int h = snprintf(header, sizeof header,
+		     "speaker.val = bin %zu raw %u %u %u %d;", size,
+		     f.channels, f.rate, f.sampleBits, f.sampleSigned ? 1 : 2);
+    char* begin = data - h;
+    memcpy(begin, header, h);
+    size_t len = h + size;
+
+    bool query;
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      double now = steadyTime();
+      if (sent_ && emptyAt_ < now)
+	++stats_.underruns;
+      emptyAt_ = std::max(emptyAt_, now) + size / f.bytesPerSecond();
+      sent_ += size;
+      query = !queryPending_;
+      if (query)
+      {
+	queryPending_ = true;
+	sentAtQuery_ = sent_;
+      }
+    }
+    if (query)
+      len += snprintf(data + size, packet_.size() - HEADER_ROOM - size,
+		      "%s: speaker.remain;\n", config_.tag.c_str());
+    if (connection_.send(begin, len, PRIORITY_LOW))
+      return -1;
+    ++stats_.chunks;
+    stats_.bytes += size;
+    return 0;
+  }
+
+  void
+  SpeakerStream::run(Source source)
+  {
+    const double lead = config_.leadMs / 1000.0;
+    const double chunkTime =
+      config_.chunkBytes / config_.format.bytesPerSecond();
+    char* data = &packet_[HEADER_ROOM];
+    bool end = false;
+    while (!end && !stopping_)
+    {
+      {
+	// Send only once the robot is down to the lead.
+	std::unique_lock<std::mutex> lock(lock_);
+	double ahead = emptyAt_ - steadyTime();
+	if (ahead > lead)
+	{
+	  if (!stopping_)
+	    wake_.wait_for(lock, std::chrono::duration<double>(ahead - lead));
+	  continue;
+	}
+      }
+      size_t size = fill(source, data, end);
+      if (size && send(data, size))
+	break;
+      if (!size && !end)
+      {
+	// A live source with nothing yet: check again within a chunk.
+	std::unique_lock<std::mutex> lock(lock_);
+	if (!stopping_)
+	  wake_.wait_for(lock, std::chrono::duration<double>(chunkTime / 4));
+      }
+    }
+    playing_ = false;
+  }
+
+} // namespace aibo
@@ -0,0 +1,264 @@
+/// \file callback_table.cc
+
+#include <algorithm>
+
+#include "aibo_server/callback_table.hh"
+
+namespace aibo
+{
+  const char* const CallbackTable::WILDCARD_TAG = "__UWildcardCallback";
+  const char* const CallbackTable::ERROR_TAG = "__UErrorCallback";
+
+  struct CallbackTable::Entry
+  {
+    Entry(CallbackId id, const std::string& tag, const Callback& cb)
+      : id(id), tag(tag), callback(cb), removed(false)
+    {}
+
+    CallbackId id;
+    std::string tag;
+    Callback callback;
+    /// Set on removal so that dispatches still holding an older index
+    /// skip the entry.
+    std::atomic<bool> removed;
+  };
+
+  namespace
+  {
+    /// FNV-1a.
+    size_t hashTag(const StringRef& tag)
+    {
+      size_t h = 2166136261u;
+      for (const char* p = tag.begin(); p != tag.end(); ++p)
+	h = (h ^ static_cast<unsigned char>(*p)) * 16777619u;
+      return h;
+    }
+  }
+
+  /// Immutable snapshot of the registrations, an open-addressing hash
+  /// table from tag to the callbacks of that tag.
+  struct CallbackTable::Index
+  {
+    struct Slot
+    {
+      Slot()
+	: hash(0)
+      {}
+
+      size_t hash;
+      std::string tag;
+      Entries entries;
+    };
+
+    explicit Index(const Entries& all)
+    {
+      size_t n = 0;
+      for (size_t i = 0; i < all.size(); ++i)
+	if (all[i]->tag != WILDCARD_TAG && all[i]->tag != ERROR_TAG)
+	  ++n;
+      // Keep the load factor at or below one half.
+      size_t size = 1;
+      while (size < 2 * n)
+	size *= 2;
+      slots.resize(size);
+      mask = size - 1;
+      for (size_t i = 0; i < all.size(); ++i)
+      {
+	const EntryPtr& e = all[i];
+	if (e->tag == WILDCARD_TAG)
+	  wildcard.push_back(e);
+	else if (e->tag == ERROR_TAG)
+	  error.push_back(e);
+	else
+	{
+	  size_t h = hashTag(e->tag);
+	  size_t j = h & mask;
+	  while (!slots[j].entries.empty() && slots[j].tag != e->tag)
+	    j = (j + 1) & mask;
+	  slots[j].hash = h;
+	  slots[j].tag = e->tag;
+	  slots[j].entries.push_back(e);
+	}
+      }
+    }
+
+    /// Callbacks of \a tag, or 0.
+    const Entries* find(const StringRef& tag) const
+    {
+      size_t h = hashTag(tag);
+      for (size_t j = h & mask; !slots[j].entries.empty(); j = (j + 1) & mask)
+	if (slots[j].hash == h && StringRef(slots[j].tag) == tag)
+	  return &slots[j].entries;
+      return 0;
+    }
+
+    std::vector<Slot> slots;
+    size_t mask;
+    Entries wildcard;
+    Entries error;
+  };
+
+  /// Marks a dispatch in progress, and reclaims retired indexes when
+  /// the last dispatch ends.
+  class CallbackTable::ReadGuard
+  {
+  public:
+    explicit ReadGuard(CallbackTable& t)
+      : table_(t)
+    {
+      table_.readers_.fetch_add(1);
+    }
+
+    ~ReadGuard()
+    {
+      if (table_.readers_.fetch_sub(1) == 1 && table_.retiredCount_.load())
+      {
+	// Never wait for a writer on the receive thread; if one is
+	// active, it reclaims instead.
+	std::unique_lock<std::mutex> lock(table_.lock_, std::try_to_lock);
+	if (lock)
+	  table_.reclaim();
+      }
+    }
+
+  private:
+    CallbackTable& table_;
+  };
+
+  CallbackTable::CallbackTable()
+    : current_(new Index(Entries())),
+      readers_(0),
+      retiredCount_(0),
+      nextId_(0)
+  {}
+
+  CallbackTable::~CallbackTable()
+  {
+    for (size_t i = 0; i < retired_.size(); ++i)
+      delete retired_[i];
+    delete current_.load();
+  }
+
+  CallbackId
+  CallbackTable::add(const std::string& tag, const Callback& cb)
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    CallbackId id = ++nextId_;
+    entries_.push_back(EntryPtr(new Entry(id, tag, cb)));
+    publish();
+    return id;
+  }
+
+  CallbackId
+  CallbackTable::add(const std::string& tag, UrbiMessageHandler& handler)
+  {
+    UrbiMessageHandler* h = &handler;
+    return add(tag, [h] (const UrbiMessageView& msg)
+	       {
+		 h->onMessage(msg);
+		 return URBI_CONTINUE;
+	       });
+  }
+
+  bool
+  CallbackTable::remove(CallbackId id)
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i)
+      if ((*i)->id == id)
+      {
+	(*i)->removed = true;
+	entries_.erase(i);
+	publish();
+	return true;
+      }
+    return false;
+  }
+
+  size_t
+  CallbackTable::removeTag(const std::string& tag)
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    size_t before = entries_.size();
+    Entries::iterator end =
+      std::remove_if(entries_.begin(), entries_.end(),
+		     [&tag] (const EntryPtr& e)
+		     {
+		       if (e->tag != tag)
+			 return false;
+		       e->removed = true;
+		       return true;
+		     });
+    entries_.erase(end, entries_.end());
+    size_t n = before - entries_.size();
+    if (n)
+      publish();
+    return n;
+  }
+
+  void
+  CallbackTable::clear()
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    for (size_t i = 0; i < entries_.size(); ++i)
+      entries_[i]->removed = true;
+    entries_.clear();
+    publish();
+  }
+
+  size_t
+  CallbackTable::size() const
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    return entries_.size();
+  }
+
+  void
+  CallbackTable::publish()
+  {
+    const Index* old = current_.exchange(new Index(entries_));
+    retired_.push_back(old);
+    retiredCount_ = retired_.size();
+    reclaim();
+  }
+
+  void
+  CallbackTable::reclaim()
+  {
+    // A dispatch increments readers_ before loading current_.  If none
+    // is counted now, any later one loads an index published after the
+    // retired ones, which are therefore unreachable.
+    if (readers_.load())
+      return;
+    for (size_t i = 0; i < retired_.size(); ++i)
+      delete retired_[i];
+    retired_.clear();
+    retiredCount_ = 0;
+  }
+
+  void
+  CallbackTable::call(const Entries& entries, const UrbiMessageView& msg)
+  {
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+      Entry& e = *entries[i];
+      if (!e.removed.load(std::memory_order_relaxed)
+	  && e.callback(msg) == URBI_REMOVE)
+	remove(e.id);
+    }
+  }
+
+  void
+  CallbackTable::onMessage(const UrbiMessageView& msg)
+  {
+    ReadGuard guard(*this);
+    const Index* index = current_.load();
+    if (const Entries* entries = index->find(msg.tag))
+      call(*entries, msg);
+    if (msg.type == MESSAGE_ERROR && !index->error.empty())
+      call(index->error, msg);
+    if (!index->wildcard.empty())
+      call(index->wildcard, msg);
+  }
+
+} // namespace aibo
@@ -0,0 +1,115 @@
+/// \file camera_bridge_node.cc
+/// \brief Publish the Aibo camera as sensor_msgs/Image.
+///
+/// Parameters:
+///   ~host         URBI server (default "aibo")
+///   ~port         URBI port (default 54000)
+///   ~format       "jpeg" or "ycrcb" (default "jpeg")
+///   ~jpeg_factor  JPEG quality, 0 to 100 (default 80)
+///   ~resolution   0: 208x160, 1: 104x80, 2: 52x40 (default 0)
+///   ~workers      decoding threads (default 2)
+///   ~pool_size    decoded images in flight (default 4)
+///   ~frame_id     (default "camera")
+///   ~record       log directory to record the raw stream to (default none)
+
+#include <ros/ros.h>
+#include <sensor_msgs/Image.h>
+
+#include "aibo_server/camera_stream.hh"
+#include "aibo_server/stream_log.hh"
+
+namespace
+{
+  typedef aibo::CameraStream<sensor_msgs::Image> Stream;
+
+  class Bridge
+  {
+  public:
+    Bridge(ros::NodeHandle& nh, const std::string& frameId)
+      : pub_(nh.advertise<sensor_msgs::Image>("camera/image_raw", 1)),
+	frameId_(frameId)
+    {}
+
+    void publish(const Stream::ImagePtr& img, const aibo::CameraJob&)
+    {
+      img->header.stamp = ros::Time::now();
+      img->header.frame_id = frameId_;
+      // Intra-process subscribers get the pooled message itself.  The
+      // boost pointer keeps the std one alive, and with it the pool
+      // slot, until the last subscriber lets go.
+      Stream::ImagePtr keep = img;
+      boost::shared_ptr<const sensor_msgs::Image>
+	msg(img.get(), [keep] (const sensor_msgs::Image*) mutable
+	    { keep.reset(); });
+      pub_.publish(msg);
+    }
+
+  private:
+    ros::Publisher pub_;
+    std::string frameId_;
+  };
+}
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "camera_bridge");
+  ros::NodeHandle nh;
+  ros::NodeHandle pnh("~");
+
+  std::string host, format, frameId, record;
+  int port, workers, poolSize;
+  aibo::CameraConfig config;
+  pnh.param<std::string>("host", host, "aibo");
+  pnh.param("port", port, static_cast<int>(aibo::URBI_PORT));
+  pnh.param<std::string>("format", format, "jpeg");
+  pnh.param("jpeg_factor", config.jpegFactor, config.jpegFactor);
+  pnh.param("resolution", config.resolution, config.resolution);
+  pnh.param("workers", workers, static_cast<int>(config.workers));
+  pnh.param("pool_size", poolSize, static_cast<int>(config.poolSize));
+  pnh.param<std::string>("frame_id", frameId, "camera");
+  pnh.param<std::string>("record", record, "");
+  config.format = format == "jpeg" ? aibo::CAMERA_JPEG : aibo::CAMERA_YCRCB;
+  config.workers = workers > 0 ? workers : 1;
+  config.poolSize = poolSize > 0 ? poolSize : 1;
+
+  // Declared first so that it outlives the receive thread.
+  aibo::StreamRecorder recorder;
+  aibo::UrbiConnection connection(host, port);
+  if (connection.connect())
+  {
+    ROS_FATAL("%s", connection.errorMessage().c_str());
+    return 1;
+  }
+  if (!record.empty())
+  {
+    if (recorder.open(record))
+    {
+      ROS_FATAL("%s", recorder.errorMessage().c_str());
+      return 1;
+    }
+    connection.setRecorder(&recorder);
+  }
+
+  Bridge bridge(nh, frameId);
+  Stream stream(connection, config);
+  stream.setCallback(std::bind(&Bridge::publish, &bridge,
+			       std::placeholders::_1, std::placeholders::_2));
+  connection.setHandler(&stream);
+  connection.start();
+  if (stream.start())
+  {
+    ROS_FATAL("cannot start the camera loop on %s", host.c_str());
+    connection.close();
+    return 1;
+  }
+
+  ros::spin();
+  stream.stop();
+  connection.close();
+  const aibo::CameraStats& s = stream.stats();
+  ROS_INFO("camera: %zu received, %zu published, %zu replaced, "
+	   "%zu without image, %zu stale, %zu errors",
+	   s.received.load(), s.published.load(), s.replaced.load(),
+	   s.noImage.load(), s.stale.load(), s.errors.load());
+  return 0;
+}
@@ -0,0 +1,62 @@
+/// \file camera_stream.cc
+
+#include <utility>
+
+#include "aibo_server/camera_stream.hh"
+
+namespace aibo
+{
+  LatestJobQueue::LatestJobQueue(size_t capacity)
+    : closed_(false),
+      jobs_(capacity ? capacity : 1),
+      head_(0),
+      count_(0)
+  {}
+
+  bool
+  LatestJobQueue::push(const CameraJob& job)
+  {
+    bool replaced = false;
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (count_ == jobs_.size())
+      {
+	// Overwriting the oldest job releases its binary.
+	jobs_[head_] = job;
+	head_ = (head_ + 1) % jobs_.size();
+	replaced = true;
+      }
+      else
+	jobs_[(head_ + count_++) % jobs_.size()] = job;
+    }
+    cond_.notify_one();
+    return replaced;
+  }
+
+  bool
+  LatestJobQueue::pop(CameraJob& job)
+  {
+    std::unique_lock<std::mutex> lock(lock_);
+    cond_.wait(lock, [this] { return closed_ || count_; });
+    if (!count_)
+      return false;
+    job = std::move(jobs_[head_]);
+    jobs_[head_].data.reset();
+    head_ = (head_ + 1) % jobs_.size();
+    --count_;
+    return true;
+  }
+
+  void
+  LatestJobQueue::close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      closed_ = true;
+      for (; count_; --count_, head_ = (head_ + 1) % jobs_.size())
+	jobs_[head_].data.reset();
+    }
+    cond_.notify_all();
+  }
+
+} // namespace aibo
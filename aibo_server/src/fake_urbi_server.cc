@@ -0,0 +1,548 @@
+/// \file fake_urbi_server.cc
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "aibo_server/fake_urbi_server.hh"
+
+namespace aibo
+{
+  namespace
+  {
+    std::string trim(const std::string& s)
+    {
+      size_t b = s.find_first_not_of(" \t\r\n");
+      if (b == std::string::npos)
+	return std::string();
+      size_t e = s.find_last_not_of(" \t\r\n;");
+      return s.substr(b, e - b + 1);
+    }
+
+    bool startsWith(const std::string& s, const char* p)
+    {
+      return !s.compare(0, strlen(p), p);
+    }
+
+    /// Position of the first \a c outside brackets and strings.
+    size_t findTopLevel(const std::string& s, const char* chars,
+			size_t from = 0)
+    {
+      int depth = 0;
+      bool str = false;
+      for (size_t i = from; i < s.size(); ++i)
+      {
+	char c = s[i];
+	if (str)
+	{
+	  if (c == '\\')
+	    ++i;
+	  else if (c == '"')
+	    str = false;
+	}
+	else if (c == '"')
+	  str = true;
+	else if (c == '[' || c == '{' || c == '(')
+	  ++depth;
+	else if (c == ']' || c == '}' || c == ')')
+	  --depth;
+	else if (!depth && strchr(chars, c))
+	  return i;
+      }
+      return std::string::npos;
+    }
+
+    /// "legRF1.val" -> "legRF1".
+    std::string deviceOf(const std::string& expr)
+    {
+      std::string d = trim(expr);
+      if (d.size() > 4 && !d.compare(d.size() - 4, 4, ".val"))
+	d.erase(d.size() - 4);
+      return d;
+    }
+
+    bool isIdentifier(const std::string& s)
+    {
+      if (s.empty() || isdigit(static_cast<unsigned char>(s[0])))
+	return false;
+      for (size_t i = 0; i < s.size(); ++i)
+	if (!isalnum(static_cast<unsigned char>(s[i])) && s[i] != '_')
+	  return false;
+      return true;
+    }
+
+    /// Devices named in "[a.val, b.val]".
+    std::vector<std::string> deviceList(const std::string& list)
+    {
+      std::vector<std::string> res;
+      std::string inner = trim(list);
+      if (inner.size() < 2 || inner[0] != '[')
+	return res;
+      inner = inner.substr(1, inner.rfind(']') - 1);
+      size_t pos = 0;
+      while (pos <= inner.size())
+      {
+	size_t comma = findTopLevel(inner, ",", pos);
+	if (comma == std::string::npos)
+	  comma = inner.size();
+	std::string d = deviceOf(inner.substr(pos, comma - pos));
+	if (!d.empty())
+	  res.push_back(d);
+	pos = comma + 1;
+      }
+      return res;
+    }
+  }
+
+  FakeUrbiServer::FakeUrbiServer(int port, unsigned cycleUs)
+    : port_(port),
+      cycleUs_(cycleUs),
+      delayUs_(0),
+      listen_(-1),
+      start_(0),
+      running_(false),
+      speakerEnd_(0),
+      speakerBytes_(0),
+      speakerUnderruns_(0),
+      speakerPeakUs_(0)
+  {}
+
+  FakeUrbiServer::~FakeUrbiServer()
+  {
+    stop();
+  }
+
+  long long
+  FakeUrbiServer::nowUs() const
+  {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now()
+				       .time_since_epoch()).count();
+  }
+
+  int
+  FakeUrbiServer::start()
+  {
+    listen_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_ < 0)
+      return -1;
+    int one = 1;
+    setsockopt(listen_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port_);
+    if (bind(listen_, reinterpret_cast<sockaddr*>(&addr), sizeof addr)
+	|| ::listen(listen_, 4))
+    {
+      ::close(listen_);
+      listen_ = -1;
+      return -1;
+    }
+    socklen_t len = sizeof addr;
+    getsockname(listen_, reinterpret_cast<sockaddr*>(&addr), &len);
+    port_ = ntohs(addr.sin_port);
+    start_ = nowUs();
+    running_ = true;
+    thread_ = std::thread(&FakeUrbiServer::run, this);
+    return 0;
+  }
+
+  void
+  FakeUrbiServer::stop()
+  {
+    running_ = false;
+    if (thread_.joinable())
+      thread_.join();
+    for (size_t i = 0; i < clients_.size(); ++i)
+      ::close(clients_[i].fd);
+    clients_.clear();
+    if (listen_ >= 0)
+      ::close(listen_);
+    listen_ = -1;
+  }
+
+  void
+  FakeUrbiServer::setDevice(const std::string& name, double value)
+  {
+    std::lock_guard<std::mutex> lock(deviceLock_);
+    devices_[name] = value;
+  }
+
+  double
+  FakeUrbiServer::value(const std::string& device)
+  {
+    {
+      std::lock_guard<std::mutex> lock(deviceLock_);
+      std::map<std::string, double>::const_iterator i = devices_.find(device);
+      if (i != devices_.end())
+	return i->second;
+    }
+    double phase = 0;
+    for (size_t i = 0; i < device.size(); ++i)
+      phase += device[i];
+    return 30 * sin((nowUs() - start_) * 1e-6 + phase);
+  }
+
+  std::string
+  FakeUrbiServer::header(const std::string& tag) const
+  {
+    char buf[96];
+    snprintf(buf, sizeof buf, "[%08lld:%s] ",
+	     (nowUs() - start_) / 1000, tag.c_str());
+    return buf;
+  }
+
+  std::string
+  FakeUrbiServer::valueList(const std::vector<std::string>& devices)
+  {
+    std::string res = "[";
+    for (size_t i = 0; i < devices.size(); ++i)
+    {
+      char buf[32];
+      snprintf(buf, sizeof buf, i ? ",%f" : "%f", value(devices[i]));
+      res += buf;
+    }
+    return res + "]";
+  }
+
+  bool
+  FakeUrbiServer::write(Client& c, const std::string& data)
+  {
+    const char* p = data.data();
+    size_t len = data.size();
+    while (len)
+    {
+      ssize_t n = ::send(c.fd, p, len, MSG_NOSIGNAL);
+      if (n < 0)
+      {
+	if (errno == EINTR)
+	  continue;
+	return false;
+      }
+      p += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  void
+  FakeUrbiServer::run()
+  {
+    long long nextCycle = nowUs();
+    while (running_)
+    {
+      bool streaming = false;
+      long long due = -1;
+      for (size_t i = 0; i < clients_.size(); ++i)
+      {
+	streaming |= !clients_[i].streams.empty();
+	if (!clients_[i].delayed.empty()
+	    && (due < 0 || clients_[i].delayed.front().due < due))
+	  due = clients_[i].delayed.front().due;
+      }
+
+      long long wait = nextCycle - nowUs();
+      int timeout = 100;
+      if (streaming)
+	timeout = wait <= 0 ? 0 : std::min<long long>((wait + 999) / 1000, 100);
+      if (due >= 0)
+      {
+	long long d = due - nowUs();
+	timeout = std::min<long long>(timeout, d <= 0 ? 0 : (d + 999) / 1000);
+      }
+
+      std::vector<pollfd> fds(clients_.size() + 1);
+      fds[0].fd = listen_;
+      fds[0].events = POLLIN;
+      for (size_t i = 0; i < clients_.size(); ++i)
+      {
+	fds[i + 1].fd = clients_[i].fd;
+	fds[i + 1].events = POLLIN;
+      }
+      if (poll(&fds[0], fds.size(), timeout) < 0 && errno != EINTR)
+	break;
+
+      // Walk backwards so that erasing does not shift unvisited entries.
+      for (size_t i = clients_.size(); i-- > 0;)
+	if (fds[i + 1].revents && !read(clients_[i]))
+	{
+	  ::close(clients_[i].fd);
+	  clients_.erase(clients_.begin() + i);
+	}
+      if (fds[0].revents & POLLIN)
+	accept();
+
+      long long now = nowUs();
+      for (size_t i = 0; i < clients_.size(); ++i)
+	deliver(clients_[i], now);
+      if (now < nextCycle)
+	continue;
+      for (size_t i = 0; i < clients_.size(); ++i)
+	tick(clients_[i], now);
+      nextCycle += cycleUs_;
+      if (nextCycle < now)
+	nextCycle = now + cycleUs_;
+    }
+  }
+
+  void
+  FakeUrbiServer::accept()
+  {
+    int fd = ::accept(listen_, 0, 0);
+    if (fd < 0)
+      return;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    Client c;
+    c.fd = fd;
+    std::string banner = header("start")
+      + "*** ********************************************************\n"
+      + header("start") + "*** URBI Kernel version 1.5 (fake ERS-7 server)\n"
+      + header("ident") + "*** Ident: fake_urbi_server\n";
+    if (write(c, banner))
+      clients_.push_back(c);
+    else
+      ::close(fd);
+  }
+
+  bool
+  FakeUrbiServer::read(Client& c)
+  {
+    char buf[4096];
+    ssize_t n = recv(c.fd, buf, sizeof buf, 0);
+    if (n < 0 && errno == EINTR)
+      return true;
+    if (n <= 0)
+      return false;
+    if (delayUs_)
+    {
+      Delayed d;
+      d.due = nowUs() + delayUs_;
+      d.data.assign(buf, n);
+      c.delayed.push_back(d);
+    }
+    else
+      process(c, buf, n);
+    return true;
+  }
+
+  void
+  FakeUrbiServer::deliver(Client& c, long long now)
+  {
+    while (!c.delayed.empty() && c.delayed.front().due <= now)
+    {
+      Delayed d;
+      d.data.swap(c.delayed.front().data);
+      c.delayed.pop_front();
+      process(c, d.data.data(), d.data.size());
+    }
+  }
+
+  void
+  FakeUrbiServer::process(Client& c, const char* data, size_t len)
+  {
+    c.input.append(data, len);
+    for (;;)
+    {
+      if (c.binaryLeft)
+      {
+	size_t n = std::min(c.binaryLeft, c.input.size());
+	if (!n)
+	  break;
+	speak(c, n);
+	c.binaryLeft -= n;
+	c.input.erase(0, n);
+	continue;
+      }
+      size_t pos = findTopLevel(c.input, ";,");
+      if (pos == std::string::npos)
+	break;
+      std::string statement = trim(c.input.substr(0, pos));
+      c.input.erase(0, pos + 1);
+      if (!statement.empty())
+	execute(c, statement);
+    }
+  }
+
+  void
+  FakeUrbiServer::execute(Client& c, const std::string& statement)
+  {
+    if (startsWith(statement, "stop "))
+    {
+      std::string label = trim(statement.substr(5));
+      for (size_t i = c.streams.size(); i-- > 0;)
+	if (c.streams[i].label == label)
+	  c.streams.erase(c.streams.begin() + i);
+      return;
+    }
+
+    std::string tag = "notag";
+    std::string body = statement;
+    size_t colon = findTopLevel(statement, ":");
+    if (colon != std::string::npos)
+    {
+      tag = trim(statement.substr(0, colon));
+      body = trim(statement.substr(colon + 1));
+    }
+
+    if (startsWith(body, "loop") || startsWith(body, "every"))
+    {
+      Stream s;
+      s.label = tag;
+      s.periodUs = 0;
+      if (startsWith(body, "every("))
+      {
+	char* unit;
+	double period = strtod(body.c_str() + 6, &unit);
+	s.periodUs = static_cast<unsigned>(period * (*unit == 's' ? 1e6 : 1e3));
+      }
+      size_t open = body.find('{');
+      size_t close = body.rfind('}');
+      if (open == std::string::npos || close == std::string::npos)
+      {
+	write(c, header("error") + "!!! parse error in loop body\n");
+	return;
+      }
+      std::string inner = trim(body.substr(open + 1, close - open - 1));
+      size_t icolon = findTopLevel(inner, ":");
+      s.tag = icolon == std::string::npos
+	? "notag" : trim(inner.substr(0, icolon));
+      s.devices = deviceList(inner.substr(icolon + 1));
+      s.micro = deviceOf(inner.substr(icolon + 1)) == "micro";
+      s.next = 0;
+      c.streams.push_back(s);
+      return;
+    }
+
+    size_t eq = findTopLevel(body, "=");
+    if (eq != std::string::npos)
+    {
+      std::string value = trim(body.substr(eq + 1));
+      if (startsWith(value, "bin "))
+	receiveBinary(c, deviceOf(body.substr(0, eq)), value.substr(4));
+      else
+	setDevice(deviceOf(body.substr(0, eq)), strtod(value.c_str(), 0));
+      return;
+    }
+
+    if (body == "speaker.remain")
+    {
+      char buf[32];
+      long long left = std::max(speakerEnd_ - nowUs(), 0LL);
+      snprintf(buf, sizeof buf, "%lld\n", left / 1000);
+      write(c, header(tag) + buf);
+      return;
+    }
+
+    if (!body.empty() && body[0] == '[')
+    {
+      write(c, header(tag) + valueList(deviceList(body)) + "\n");
+      return;
+    }
+    std::string device = deviceOf(body);
+    if (device == "micro")
+    {
+      write(c, micro(c, tag));
+      return;
+    }
+    if (!isIdentifier(device))
+    {
+      write(c, header(tag) + "!!! parse error\n");
+      return;
+    }
+    char buf[32];
+    snprintf(buf, sizeof buf, "%f\n", value(device));
+    write(c, header(tag) + buf);
+  }
+
+  void
+  FakeUrbiServer::tick(Client& c, long long now)
+  {
+    for (size_t i = 0; i < c.streams.size(); ++i)
+    {
+      Stream& s = c.streams[i];
+      if (now < s.next)
+	continue;
+      s.next = (s.next ? s.next : now) + s.periodUs;
+      if (s.next < now)
+	s.next = now + s.periodUs;
+      std::string msg = s.micro
+	? micro(c, s.tag) : header(s.tag) + valueList(s.devices) + "\n";
+      if (observer_)
+	observer_(s.tag);
+      write(c, msg);
+    }
+  }
+
+  void
+  FakeUrbiServer::receiveBinary(Client& c, const std::string& device,
+				const std::string& spec)
+  {
+    size_t size;
+    char format[16];
+    unsigned channels, rate, bits;
+    int n = sscanf(spec.c_str(), "%zu %15s %u %u %u", &size, format,
+		   &channels, &rate, &bits);
+    if (n < 1)
+    {
+      write(c, header("error") + "!!! parse error in binary header\n");
+      return;
+    }
+    c.binaryLeft = size;
+    c.binaryRate = 0;
+    if (device == "speaker" && n == 5 && !strcmp(format, "raw"))
+      c.binaryRate = double(channels) * rate * bits / 8;
+  }
+
+  void
+  FakeUrbiServer::speak(Client& c, size_t bytes)
+  {
+    if (!c.binaryRate)
+      return;
+    long long now = nowUs();
+    if (speakerEnd_ && speakerEnd_ < now)
+      ++speakerUnderruns_;
+    speakerEnd_ = std::max(speakerEnd_, now)
+      + static_cast<long long>(bytes * 1e6 / c.binaryRate);
+    speakerBytes_ += bytes;
+    if (speakerEnd_ - now > speakerPeakUs_)
+      speakerPeakUs_ = speakerEnd_ - now;
+  }
+
+  std::string
+  FakeUrbiServer::micro(Client& c, const std::string& tag)
+  {
+    // One 32 ms ERS-7 cycle: 512 frames of 16 kHz 16-bit stereo.
+    enum { FRAMES = 512, BYTES = FRAMES * 4 };
+    char buf[64];
+    snprintf(buf, sizeof buf, "BIN %d raw 2 16000 16 1\n", int(BYTES));
+    std::string msg = header(tag) + buf;
+    size_t at = msg.size();
+    msg.resize(at + BYTES);
+    for (size_t i = 0; i < FRAMES; ++i)
+    {
+      double t = (c.microFrames + i) / 16000.0;
+      int v = static_cast<int>(8000 * sin(2 * M_PI * 440 * t));
+      for (size_t ch = 0; ch < 2; ++ch)
+      {
+	msg[at + 4 * i + 2 * ch] = v & 0xff;
+	msg[at + 4 * i + 2 * ch + 1] = (v >> 8) & 0xff;
+      }
+    }
+    c.microFrames += FRAMES;
+    return msg + "\n";
+  }
+
+} // namespace aibo
@@ -0,0 +1,56 @@
+/// \file fake_urbi_server_main.cc
+/// \brief Run FakeUrbiServer until interrupted.
+///
+/// Usage: fake_urbi_server [-p port] [-c cycle_us] [-d delay_us]
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "aibo_server/fake_urbi_server.hh"
+
+namespace
+{
+  volatile sig_atomic_t interrupted = 0;
+
+  void onSignal(int)
+  {
+    interrupted = 1;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  int port = aibo::URBI_PORT;
+  unsigned cycle = 32000;
+  unsigned delay = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:c:d:")) != -1)
+    switch (opt)
+    {
+    case 'p': port = atoi(optarg); break;
+    case 'c': cycle = strtoul(optarg, 0, 10); break;
+    case 'd': delay = strtoul(optarg, 0, 10); break;
+    default:
+      fprintf(stderr, "usage: %s [-p port] [-c cycle_us] [-d delay_us]\n",
+	      argv[0]);
+      return 1;
+    }
+
+  aibo::FakeUrbiServer server(port, cycle);
+  server.setLinkDelay(delay);
+  if (server.start())
+  {
+    perror("fake_urbi_server");
+    return 1;
+  }
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  printf("fake URBI server listening on port %d, %u us cycle\n",
+	 server.port(), cycle);
+  while (!interrupted)
+    pause();
+  server.stop();
+  return 0;
+}
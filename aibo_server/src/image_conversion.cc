@@ -0,0 +1,293 @@
+/// \file image_conversion.cc
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#include <jpeglib.h>
+
+#include "aibo_server/image_conversion.hh"
+
+namespace aibo
+{
+  bool
+  parseImageHeader(const StringRef& header, CameraFormat& format,
+		   size_t& width, size_t& height)
+  {
+    // Copy to get NUL termination; headers are a few words long.
+    char buf[64];
+    size_t len = std::min(header.size(), sizeof buf - 1);
+    memcpy(buf, header.data(), len);
+    buf[len] = 0;
+    char name[16];
+    unsigned w, h;
+    if (sscanf(buf, "%15s %u %u", name, &w, &h) != 3
+	|| w > CAMERA_MAX_WIDTH || h > CAMERA_MAX_HEIGHT)
+      return false;
+    if (!strcasecmp(name, "jpeg"))
+      format = CAMERA_JPEG;
+    else if (!strcasecmp(name, "YCrCb") || !strcasecmp(name, "YCbCr"))
+      format = CAMERA_YCRCB;
+    else if (!strcasecmp(name, "rgb"))
+      format = CAMERA_RGB;
+    else
+      return false;
+    width = w;
+    height = h;
+    return true;
+  }
+
+  /*------------------.
+  | YCrCb to RGB.     |
+  `------------------*/
+
+  // JFIF coefficients in Q14, applied to chroma scaled by 4 and
+  // keeping the high 16 bits of the product, which is exactly what
+  // _mm_mulhi_epi16 computes.  The scalar code does the same so that
+  // both paths give identical results.
+  namespace
+  {
+    enum
+      {
+	CR_R = 22970,	// 1.402
+	CB_G = 5638,	// 0.344136
+	CR_G = 11700,	// 0.714136
+	CB_B = 29032	// 1.772
+      };
+
+    inline int mulhi(int a, int b)
+    {
+      return (a * b) >> 16;
+    }
+
+    inline uint8_t clamp(int v)
+    {
+      return v < 0 ? 0 : v > 255 ? 255 : v;
+    }
+  }
+
+  void
+  ycrcbToRgbScalar(const uint8_t* src, uint8_t* dst, size_t pixels)
+  {
+    for (size_t i = 0; i < pixels; ++i, src += 3, dst += 3)
+    {
+      int y = src[0];
+      int cr = (src[1] - 128) * 4;
+      int cb = (src[2] - 128) * 4;
+      dst[0] = clamp(y + mulhi(cr, CR_R));
+      dst[1] = clamp(y - mulhi(cb, CB_G) - mulhi(cr, CR_G));
+      dst[2] = clamp(y + mulhi(cb, CB_B));
+    }
+  }
+
+#ifdef __SSE2__
+  namespace
+  {
+    // SSE2 has no byte shuffle, so planes are split and merged with
+    // rounds of unpacks.  Three rounds of "interleave the low half of
+    // one register with the high half of the next" sort 48 packed
+    // bytes into three planes of 16.
+    inline void
+    deinterleave3(const uint8_t* src, __m128i& a, __m128i& b, __m128i& c)
+    {
+      __m128i t0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+      __m128i t1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+      __m128i t2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+      for (int round = 0; round < 4; ++round)
+      {
+	__m128i u0 = _mm_unpacklo_epi8(t0, _mm_unpackhi_epi64(t1, t1));
+	__m128i u1 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t0, t0), t2);
+	__m128i u2 = _mm_unpacklo_epi8(t1, _mm_unpackhi_epi64(t2, t2));
+	t0 = u0;
+	t1 = u1;
+	t2 = u2;
+      }
+      a = t0;
+      b = t1;
+      c = t2;
+    }
+
+    // The reverse: pair a with b and c with zero, merge the pairs into
+    // 4-byte groups, then squeeze the zero byte out of each group.
+    inline void
+    interleave3(uint8_t* dst, __m128i a, __m128i b, __m128i c)
+    {
+      const __m128i z = _mm_setzero_si128();
+      __m128i ab0 = _mm_unpacklo_epi8(a, b);
+      __m128i ab1 = _mm_unpackhi_epi8(a, b);
+      __m128i c0 = _mm_unpacklo_epi8(c, z);
+      __m128i c1 = _mm_unpackhi_epi8(c, z);
+
+      __m128i p00 = _mm_unpacklo_epi16(ab0, c0);
+      __m128i p01 = _mm_unpackhi_epi16(ab0, c0);
+      __m128i p02 = _mm_unpacklo_epi16(ab1, c1);
+      __m128i p03 = _mm_unpackhi_epi16(ab1, c1);
+
+      __m128i p10 = _mm_unpacklo_epi32(p00, p01);
+      __m128i p11 = _mm_unpackhi_epi32(p00, p01);
+      __m128i p12 = _mm_unpacklo_epi32(p02, p03);
+      __m128i p13 = _mm_unpackhi_epi32(p02, p03);
+
+      __m128i p20 = _mm_slli_si128(_mm_unpacklo_epi64(p10, p11), 1);
+      __m128i p21 = _mm_unpackhi_epi64(p10, p11);
+      __m128i p22 = _mm_slli_si128(_mm_unpacklo_epi64(p12, p13), 1);
+      __m128i p23 = _mm_unpackhi_epi64(p12, p13);
+
+      __m128i p30 = _mm_slli_epi64(_mm_unpacklo_epi32(p20, p21), 8);
+      __m128i p31 = _mm_srli_epi64(_mm_unpackhi_epi32(p20, p21), 8);
+      __m128i p32 = _mm_slli_epi64(_mm_unpacklo_epi32(p22, p23), 8);
+      __m128i p33 = _mm_srli_epi64(_mm_unpackhi_epi32(p22, p23), 8);
+
+      __m128i p40 = _mm_unpacklo_epi64(p30, p31);
+      __m128i p41 = _mm_unpackhi_epi64(p30, p31);
+      __m128i p42 = _mm_unpacklo_epi64(p32, p33);
+      __m128i p43 = _mm_unpackhi_epi64(p32, p33);
+
+      __m128i v0 = _mm_or_si128(_mm_srli_si128(p40, 2), _mm_slli_si128(p41, 10));
+      __m128i v1 = _mm_or_si128(_mm_srli_si128(p41, 6), _mm_slli_si128(p42, 6));
+      __m128i v2 = _mm_or_si128(_mm_srli_si128(p42, 10), _mm_slli_si128(p43, 2));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), v0);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 16), v1);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 32), v2);
+    }
+
+    struct Coefficients
+    {
+      Coefficients()
+	: bias(_mm_set1_epi16(128)),
+	  crR(_mm_set1_epi16(CR_R)),
+	  cbG(_mm_set1_epi16(CB_G)),
+	  crG(_mm_set1_epi16(CR_G)),
+	  cbB(_mm_set1_epi16(CB_B))
+      {}
+
+      __m128i bias, crR, cbG, crG, cbB;
+    };
+
+    // Eight pixels held as 16-bit lanes.
+    inline void
+    convert8(const Coefficients& k, __m128i y, __m128i cr, __m128i cb,
+	     __m128i& r, __m128i& g, __m128i& b)
+    {
+      cr = _mm_slli_epi16(_mm_sub_epi16(cr, k.bias), 2);
+      cb = _mm_slli_epi16(_mm_sub_epi16(cb, k.bias), 2);
+      r = _mm_add_epi16(y, _mm_mulhi_epi16(cr, k.crR));
+      g = _mm_sub_epi16(_mm_sub_epi16(y, _mm_mulhi_epi16(cb, k.cbG)),
+			_mm_mulhi_epi16(cr, k.crG));
+      b = _mm_add_epi16(y, _mm_mulhi_epi16(cb, k.cbB));
+    }
+  }
+#endif
+
+  void
+  ycrcbToRgb(const uint8_t* src, uint8_t* dst, size_t pixels)
+  {
+#ifdef __SSE2__
+    const Coefficients k;
+    const __m128i z = _mm_setzero_si128();
+    size_t blocks = pixels / 16;
+    for (size_t i = 0; i < blocks; ++i, src += 48, dst += 48)
+    {
+      __m128i y, cr, cb;
+      deinterleave3(src, y, cr, cb);
+      __m128i rl, gl, bl, rh, gh, bh;
+      convert8(k, _mm_unpacklo_epi8(y, z), _mm_unpacklo_epi8(cr, z),
+	       _mm_unpacklo_epi8(cb, z), rl, gl, bl);
+      convert8(k, _mm_unpackhi_epi8(y, z), _mm_unpackhi_epi8(cr, z),
+	       _mm_unpackhi_epi8(cb, z), rh, gh, bh);
+      interleave3(dst, _mm_packus_epi16(rl, rh), _mm_packus_epi16(gl, gh),
+		  _mm_packus_epi16(bl, bh));
+    }
+    pixels -= blocks * 16;
+#endif
+    ycrcbToRgbScalar(src, dst, pixels);
+  }
+
+  /*--------------.
+  | JpegDecoder.  |
+  `--------------*/
+
+  struct JpegDecoder::Impl
+  {
+    struct ErrorManager
+    {
+      jpeg_error_mgr pub;
+      jmp_buf jump;
+    };
+
+    static void onError(j_common_ptr cinfo)
+    {
+      ErrorManager* err = reinterpret_cast<ErrorManager*>(cinfo->err);
+      longjmp(err->jump, 1);
+    }
+
+    static void onMessage(j_common_ptr)
+    {}
+
+    jpeg_decompress_struct cinfo;
+    ErrorManager err;
+  };
+
+  JpegDecoder::JpegDecoder()
+    : impl_(new Impl)
+  {
+    impl_->cinfo.err = jpeg_std_error(&impl_->err.pub);
+    impl_->err.pub.error_exit = &Impl::onError;
+    impl_->err.pub.output_message = &Impl::onMessage;
+    jpeg_create_decompress(&impl_->cinfo);
+  }
+
+  JpegDecoder::~JpegDecoder()
+  {
+    jpeg_destroy_decompress(&impl_->cinfo);
+    delete impl_;
+  }
+
+  bool
+  JpegDecoder::decode(const uint8_t* data, size_t len,
+		      std::vector<uint8_t>& rgb, size_t width, size_t height)
+  {
+    jpeg_decompress_struct& cinfo = impl_->cinfo;
+    if (setjmp(impl_->err.jump))
+    {
+      jpeg_abort_decompress(&cinfo);
+      return false;
+    }
+    jpeg_mem_src(&cinfo, const_cast<unsigned char*>(data), len);
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK)
+    {
+      jpeg_abort_decompress(&cinfo);
+      return false;
+    }
+    cinfo.out_color_space = JCS_RGB;
+    // The ERS-7 images are small; favor speed over exactness.
+    cinfo.dct_method = JDCT_IFAST;
+    cinfo.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(&cinfo);
+    // Never size the buffer from the data: a corrupt or hostile frame
+    // would make every pooled image grow to match.
+    if (cinfo.output_width != width || cinfo.output_height != height
+	|| width > CAMERA_MAX_WIDTH || height > CAMERA_MAX_HEIGHT)
+    {
+      jpeg_abort_decompress(&cinfo);
+      return false;
+    }
+    size_t stride = width * 3;
+    rgb.resize(stride * height);
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+      JSAMPROW row = &rgb[cinfo.output_scanline * stride];
+      jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    return true;
+  }
+
+} // namespace aibo
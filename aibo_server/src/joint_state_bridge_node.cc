@@ -0,0 +1,115 @@
+/// \file joint_state_bridge_node.cc
+/// \brief Publish sensor_msgs/JointState from a single server-side joint loop.
+///
+/// Parameters:
+///   ~host       URBI server (default "aibo")
+///   ~port       URBI port (default 54000)
+///   ~period_ms  sampling period, 0 for every motor cycle (default 0)
+///   ~record     log directory to record the raw stream to (default none)
+///   robot_description  joints to stream; the revolute joints of
+///                      Aibo.urdf are used if it is not set.
+
+#include <cmath>
+
+#include <ros/ros.h>
+#include <sensor_msgs/JointState.h>
+#include <urdf/model.h>
+
+#include "aibo_server/joint_stream.hh"
+#include "aibo_server/stream_log.hh"
+
+namespace
+{
+  std::vector<std::string> jointNames(ros::NodeHandle& nh)
+  {
+    std::vector<std::string> res;
+    urdf::Model model;
+    if (!nh.hasParam("robot_description")
+	|| !model.initParam("robot_description"))
+    {
+      ROS_WARN("no usable robot_description, using the Aibo.urdf joint list");
+      return aibo::defaultJointNames();
+    }
+    for (auto i = model.joints_.begin(); i != model.joints_.end(); ++i)
+      if (i->second->type == urdf::Joint::REVOLUTE)
+	res.push_back(i->first);
+    return res;
+  }
+
+  class Bridge
+  {
+  public:
+    Bridge(ros::NodeHandle& nh, const std::vector<std::string>& joints)
+      : pub_(nh.advertise<sensor_msgs::JointState>("joint_states", 10))
+    {
+      msg_.name = joints;
+      msg_.position.resize(joints.size());
+    }
+
+    void publish(int, const double* values, size_t count)
+    {
+      msg_.header.stamp = ros::Time::now();
+      for (size_t i = 0; i < count; ++i)
+	msg_.position[i] = values[i] * M_PI / 180;
+      pub_.publish(msg_);
+    }
+
+  private:
+    ros::Publisher pub_;
+    sensor_msgs::JointState msg_;
+  };
+}
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "joint_state_bridge");
+  ros::NodeHandle nh;
+  ros::NodeHandle pnh("~");
+
+  std::string host, record;
+  int port, period;
+  pnh.param<std::string>("host", host, "aibo");
+  pnh.param("port", port, static_cast<int>(aibo::URBI_PORT));
+  pnh.param("period_ms", period, 0);
+  pnh.param<std::string>("record", record, "");
+
+  // Declared first so that it outlives the receive thread.
+  aibo::StreamRecorder recorder;
+  aibo::UrbiConnection connection(host, port);
+  if (connection.connect())
+  {
+    ROS_FATAL("%s", connection.errorMessage().c_str());
+    return 1;
+  }
+  if (!record.empty())
+  {
+    if (recorder.open(record))
+    {
+      ROS_FATAL("%s", recorder.errorMessage().c_str());
+      return 1;
+    }
+    connection.setRecorder(&recorder);
+  }
+
+  std::vector<std::string> joints = jointNames(nh);
+  Bridge bridge(nh, joints);
+  aibo::JointStream stream(connection, joints);
+  stream.setCallback(std::bind(&Bridge::publish, &bridge,
+			       std::placeholders::_1, std::placeholders::_2,
+			       std::placeholders::_3));
+  connection.setHandler(&stream);
+  connection.start();
+  if (stream.start(period))
+  {
+    ROS_FATAL("cannot install the joint loop on %s", host.c_str());
+    connection.close();
+    return 1;
+  }
+  ROS_INFO("streaming %zu joints from %s:%d", joints.size(),
+	   host.c_str(), port);
+
+  ros::spin();
+  stream.stop();
+  connection.close();
+  return 0;
+}
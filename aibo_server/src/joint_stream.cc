@@ -0,0 +1,93 @@
+/// \file joint_stream.cc
+
+#include "aibo_server/joint_stream.hh"
+
+namespace aibo
+{
+  std::string
+  urbiDeviceName(const std::string& joint)
+  {
+    if (joint.compare(0, 5, "legRB") == 0)
+      return "legRH" + joint.substr(5);
+    if (joint.compare(0, 5, "legLB") == 0)
+      return "legLH" + joint.substr(5);
+    return joint;
+  }
+
+  const std::vector<std::string>&
+  defaultJointNames()
+  {
+    static const char* const names[] =
+    {
+      "legRF1", "legRF2", "legRF3", "legLF1", "legLF2", "legLF3",
+      "legRB1", "legRB2", "legRB3", "legLB1", "legLB2", "legLB3",
+      "neck", "headPan", "headTilt", "tailPan", "tailTilt",
+    };
+    static const std::vector<std::string>
+      res(names, names + sizeof names / sizeof *names);
+    return res;
+  }
+
+  JointStream::JointStream(UrbiConnection& connection,
+			   const std::vector<std::string>& joints,
+			   const std::string& tag)
+    : connection_(connection),
+      joints_(joints),
+      tag_(tag),
+      running_(false)
+  {}
+
+  JointStream::~JointStream()
+  {
+    if (running_ && connection_.connected())
+      stop();
+  }
+
+  std::string
+  JointStream::command(unsigned periodMs) const
+  {
+    std::string cmd = tag_ + "_loop: ";
+    if (periodMs)
+      cmd += "every(" + std::to_string(periodMs) + "ms) { ";
+    else
+      cmd += "loop { ";
+    cmd += tag_ + ": [";
+    for (size_t i = 0; i < joints_.size(); ++i)
+    {
+      if (i)
+	cmd += ", ";
+      cmd += urbiDeviceName(joints_[i]) + ".val";
+    }
+    cmd += "] },\n";
+    return cmd;
+  }
+
+  int
+  JointStream::start(unsigned periodMs)
+  {
+    std::string cmd = command(periodMs);
+    if (int rc = connection_.send(cmd.data(), cmd.size()))
+      return rc;
+    running_ = true;
+    return 0;
+  }
+
+  int
+  JointStream::stop()
+  {
+    running_ = false;
+    return connection_.sendf("stop %s_loop;\n", tag_.c_str());
+  }
+
+  void
+  JointStream::onMessage(const UrbiMessageView& msg)
+  {
+    if (msg.type != MESSAGE_DATA || msg.tag != StringRef(tag_))
+      return;
+    if (!values_.parse(msg.text) || values_.type() != VALUE_NUMBERS
+	|| values_.size() != joints_.size() || !callback_)
+      return;
+    callback_(msg.timestamp, values_.numbers(), values_.size());
+  }
+
+} // namespace aibo
@@ -0,0 +1,143 @@
+/// \file kinematics.cc
+
+#include <cstring>
+
+#include "aibo_server/kinematics.hh"
+
+namespace aibo
+{
+  namespace
+  {
+    struct ChainEntry
+    {
+      unsigned dof;
+      JointModel (*joint)(unsigned);
+      const char* (*tip)();
+      JointModel (*tipJoint)();
+      void (*forward)(const double*, Transform&);
+      void (*jacobian)(const double*, Transform&, double*);
+    };
+
+    template <KinematicChain C>
+    JointModel joint(unsigned i)
+    {
+      return ChainKinematics<C>::joint(i);
+    }
+
+    template <KinematicChain C>
+    const char* tip()
+    {
+      return ChainKinematics<C>::tip();
+    }
+
+    template <KinematicChain C>
+    JointModel tipJoint()
+    {
+      return ChainKinematics<C>::tipJoint();
+    }
+
+    template <KinematicChain C>
+    ChainEntry entry()
+    {
+      ChainEntry e =
+	{
+	  ChainKinematics<C>::DOF, &joint<C>, &tip<C>, &tipJoint<C>,
+	  &ChainKinematics<C>::forward, &ChainKinematics<C>::jacobian
+	};
+      return e;
+    }
+
+    /// Entries for chains C and above.
+    template <int C>
+    struct ChainTable
+    {
+      static void fill(ChainEntry* t)
+      {
+	t[C] = entry<KinematicChain(C)>();
+	ChainTable<C + 1>::fill(t);
+      }
+    };
+
+    template <>
+    struct ChainTable<CHAIN_COUNT>
+    {
+      static void fill(ChainEntry*)
+      {}
+    };
+
+    const ChainEntry* chains()
+    {
+      static ChainEntry table[CHAIN_COUNT];
+      static bool init = (ChainTable<0>::fill(table), true);
+      (void) init;
+      return table;
+    }
+  }
+
+  unsigned
+  chainDof(KinematicChain chain)
+  {
+    return chains()[chain].dof;
+  }
+
+  JointModel
+  chainJoint(KinematicChain chain, unsigned i)
+  {
+    return chains()[chain].joint(i);
+  }
+
+  const char*
+  chainTip(KinematicChain chain)
+  {
+    return chains()[chain].tip();
+  }
+
+  JointModel
+  chainTipJoint(KinematicChain chain)
+  {
+    return chains()[chain].tipJoint();
+  }
+
+  void
+  forward(KinematicChain chain, const double* q, Transform& tip)
+  {
+    chains()[chain].forward(q, tip);
+  }
+
+  void
+  jacobian(KinematicChain chain, const double* q, Transform& tip,
+	   double* jac)
+  {
+    chains()[chain].jacobian(q, tip, jac);
+  }
+
+  bool
+  findJoint(const std::string& name, KinematicChain& chain, unsigned& index)
+  {
+    for (int c = 0; c < CHAIN_COUNT; ++c)
+      for (unsigned i = 0; i < chains()[c].dof; ++i)
+	if (name == chains()[c].joint(i).name)
+	{
+	  chain = KinematicChain(c);
+	  index = i;
+	  return true;
+	}
+    return false;
+  }
+
+  Transform
+  compose(const Transform& a, const Transform& b)
+  {
+    Transform res;
+    for (int i = 0; i < 3; ++i)
+    {
+      for (int j = 0; j < 3; ++j)
+	res.r[3 * i + j] = a.r[3 * i] * b.r[j] + a.r[3 * i + 1] * b.r[3 + j]
+	  + a.r[3 * i + 2] * b.r[6 + j];
+      res.p[i] = a.r[3 * i] * b.p[0] + a.r[3 * i + 1] * b.p[1]
+	+ a.r[3 * i + 2] * b.p[2] + a.p[i];
+    }
+    return res;
+  }
+
+} // namespace aibo
@@ -0,0 +1,221 @@
+/// \file request_pipeline.cc
+
+#include <chrono>
+#include <cstdio>
+
+#include "aibo_server/request_pipeline.hh"
+#include "aibo_server/urbi_value.hh"
+
+namespace aibo
+{
+  namespace
+  {
+    /// A client error message, as UrbiConnection reports them.
+    UrbiMessage clientErrorMessage(const char* what)
+    {
+      char text[256];
+      snprintf(text, sizeof text, "!!! %s", what);
+      UrbiMessageView v;
+      v.tag = UrbiConnection::CLIENTERROR_TAG;
+      v.type = MESSAGE_ERROR;
+      v.text = v.raw = text;
+      v.message = v.text.substr(4);
+      return UrbiMessage(v);
+    }
+  }
+
+  RequestPipeline::RequestPipeline(UrbiConnection& connection,
+				   UrbiMessageHandler* next,
+				   const std::string& prefix)
+    : connection_(connection),
+      next_(next),
+      prefix_(prefix + "_"),
+      nextId_(0)
+  {}
+
+  RequestPipeline::~RequestPipeline()
+  {}
+
+  std::string
+  RequestPipeline::tag(unsigned id) const
+  {
+    char buf[16];
+    snprintf(buf, sizeof buf, "%u", id);
+    return prefix_ + buf;
+  }
+
+  UrbiRequest
+  RequestPipeline::add(const std::string& expression, std::string& cmd)
+  {
+    UrbiRequest r;
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      r.id = ++nextId_;
+      r.reply = pending_[r.id].get_future();
+    }
+    cmd += tag(r.id);
+    cmd += ": ";
+    cmd += expression;
+    cmd += ";\n";
+    return r;
+  }
+
+  void
+  RequestPipeline::fail(const std::vector<UrbiRequest>& requests,
+			const char* what)
+  {
+    UrbiMessage err = clientErrorMessage(what);
+    for (size_t i = 0; i < requests.size(); ++i)
+    {
+      std::promise<UrbiMessage> p;
+      {
+	std::lock_guard<std::mutex> lock(lock_);
+	auto it = pending_.find(requests[i].id);
+	if (it == pending_.end())
+	  continue;
+	p = std::move(it->second);
+	pending_.erase(it);
+      }
+      p.set_value(err);
+    }
+  }
+
+  UrbiRequest
+  RequestPipeline::get(const std::string& expression)
+  {
+    std::string cmd;
+    std::vector<UrbiRequest> r(1);
+    r[0] = add(expression, cmd);
+    if (connection_.send(cmd.data(), cmd.size()))
+      fail(r, "send failed");
+    return std::move(r[0]);
+  }
+
+  std::vector<UrbiRequest>
+  RequestPipeline::getAll(const std::vector<std::string>& expressions)
+  {
+    std::string cmd;
+    std::vector<UrbiRequest> res;
+    res.reserve(expressions.size());
+    for (size_t i = 0; i < expressions.size(); ++i)
+      res.push_back(add(expressions[i], cmd));
+    if (!cmd.empty() && connection_.send(cmd.data(), cmd.size()))
+      fail(res, "send failed");
+    return res;
+  }
+
+  int
+  RequestPipeline::getDevices(const std::vector<std::string>& devices,
+			      std::vector<double>& values, double timeout,
+			      std::string* error)
+  {
+    std::vector<std::string> exprs(devices.size());
+    for (size_t i = 0; i < devices.size(); ++i)
+      exprs[i] = devices[i] + ".val";
+    std::vector<UrbiRequest> reqs = getAll(exprs);
+    values.resize(devices.size());
+
+    std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now()
+      + std::chrono::duration_cast<std::chrono::steady_clock::duration>
+      (std::chrono::duration<double>(timeout));
+    int rc = 0;
+    std::string what;
+    for (size_t i = 0; i < reqs.size(); ++i)
+    {
+      if (rc)
+      {
+	cancel(reqs[i].id);
+	continue;
+      }
+      if (reqs[i].reply.wait_until(deadline) != std::future_status::ready)
+      {
+	cancel(reqs[i].id);
+	what = devices[i] + ": no reply";
+	rc = -1;
+	continue;
+      }
+      UrbiMessage reply = reqs[i].reply.get();
+      UrbiValue v;
+      if (reply.type() != MESSAGE_DATA)
+      {
+	what = devices[i] + ": " + reply.text().str();
+	rc = -1;
+      }
+      else if (!v.parse(reply.text()) || v.type() != VALUE_DOUBLE)
+      {
+	what = devices[i] + ": not a number: " + reply.text().str();
+	rc = -1;
+      }
+      else
+	values[i] = v.number();
+    }
+    if (rc && error)
+      *error = what;
+    return rc;
+  }
+
+  bool
+  RequestPipeline::cancel(unsigned id)
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    return pending_.erase(id);
+  }
+
+  size_t
+  RequestPipeline::pending() const
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    return pending_.size();
+  }
+
+  void
+  RequestPipeline::onMessage(const UrbiMessageView& msg)
+  {
+    if (msg.tag.startsWith(prefix_))
+    {
+      unsigned id = 0;
+      bool digits = msg.tag.size() > prefix_.size();
+      for (size_t i = prefix_.size(); i < msg.tag.size() && digits; ++i)
+	if ('0' <= msg.tag[i] && msg.tag[i] <= '9')
+	  id = id * 10 + msg.tag[i] - '0';
+	else
+	  digits = false;
+      if (digits)
+      {
+	std::promise<UrbiMessage> p;
+	bool found = false;
+	{
+	  std::lock_guard<std::mutex> lock(lock_);
+	  auto it = pending_.find(id);
+	  if (it != pending_.end())
+	  {
+	    p = std::move(it->second);
+	    pending_.erase(it);
+	    found = true;
+	  }
+	}
+	if (found)
+	{
+	  p.set_value(UrbiMessage(msg));
+	  return;
+	}
+      }
+    }
+    else if (msg.tag == StringRef(UrbiConnection::CLIENTERROR_TAG))
+    {
+      // The connection is gone; nobody will answer.
+      std::unordered_map<unsigned, std::promise<UrbiMessage> > lost;
+      {
+	std::lock_guard<std::mutex> lock(lock_);
+	lost.swap(pending_);
+      }
+      UrbiMessage err(msg);
+      for (auto it = lost.begin(); it != lost.end(); ++it)
+	it->second.set_value(err);
+    }
+    if (next_)
+      next_->onMessage(msg);
+  }
+
+} // namespace aibo
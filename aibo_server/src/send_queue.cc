@@ -0,0 +1,440 @@
+/// \file send_queue.cc
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "aibo_server/send_queue.hh"
+
+#ifndef IOV_MAX
+# define IOV_MAX 1024
+#endif
+
+namespace aibo
+{
+  namespace
+  {
+    const uint32_t NIL = 0xffffffff;
+
+    inline uint32_t indexOf(uint64_t head)
+    {
+      return static_cast<uint32_t>(head);
+    }
+
+    inline uint64_t makeHead(uint64_t old, uint32_t index)
+    {
+      return ((old >> 32) + 1) << 32 | index;
+    }
+
+    /// How long the flusher waits for the kernel to send what it holds
+    /// when maxInFlight is reached.
+    const std::chrono::microseconds IN_FLIGHT_POLL(200);
+  }
+
+  SendQueue::SendQueue(int fd, size_t depth)
+    : fd_(fd),
+      maxInFlight_(MAX_IN_FLIGHT),
+      stopping_(false),
+      finished_(false),
+      pushers_(0),
+      failed_(false),
+      error_(0),
+      sleeping_(false),
+      spaceWaiters_(0),
+      commands_(0),
+      writes_(0),
+      partialLane_(-1),
+      partial_(0)
+  {
+    laneDepth_[PRIORITY_HIGH] = std::max<size_t>(depth / 4, 1);
+    laneDepth_[PRIORITY_LOW] = std::max<size_t>(depth / 4, 1);
+    laneDepth_[PRIORITY_NORMAL] =
+      std::max<size_t>(depth - 2 * (depth / 4), 1);
+    nodes_ = std::vector<Node>(laneDepth_[PRIORITY_HIGH]
+			       + laneDepth_[PRIORITY_NORMAL]
+			       + laneDepth_[PRIORITY_LOW]);
+    uint32_t i = nodes_.size();
+    for (size_t p = PRIORITY_COUNT; p-- > 0;)
+    {
+      free_[p] = NIL;
+      lanes_[p] = NIL;
+      pending_[p].reserve(laneDepth_[p]);
+      pendingFirst_[p] = 0;
+      for (size_t k = 0; k < laneDepth_[p]; ++k)
+      {
+	nodes_[--i].priority = static_cast<SendPriority>(p);
+	release(i);
+      }
+    }
+    iov_.reserve(std::min<size_t>(nodes_.size(), IOV_MAX));
+    sent_.reserve(iov_.capacity());
+  }
+
+  SendQueue::~SendQueue()
+  {
+    stop();
+  }
+
+  void
+  SendQueue::start()
+  {
+    if (!thread_.joinable() && !stopping_)
+      thread_ = std::thread(&SendQueue::run, this);
+  }
+
+  void
+  SendQueue::stop(double timeout)
+  {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      stopping_ = true;
+    }
+    work_.notify_one();
+    space_.notify_all();
+    if (!thread_.joinable())
+      return;
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      if (!done_.wait_for(lock, std::chrono::duration<double>(timeout),
+			  [this] { return finished_; }))
+      {
+	// The peer stopped reading.  Give up on the backlog, and make a
+	// write blocked on the full socket return.
+	error_ = ETIMEDOUT;
+	failed_ = true;
+	shutdown(fd_, SHUT_WR);
+      }
+    }
+    thread_.join();
+  }
+
+  bool
+  SendQueue::enter()
+  {
+    // The flusher reads stopping_, then pushers_, then the lanes; we
+    // bump pushers_, then read stopping_.  Either it waits for us, or
+    // we fail.
+    ++pushers_;
+    if (!stopping_ && !failed_)
+      return true;
+    leave();
+    return false;
+  }
+
+  void
+  SendQueue::leave()
+  {
+    if (--pushers_ == 0 && stopping_)
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      work_.notify_one();
+    }
+  }
+
+  uint32_t
+  SendQueue::acquire(SendPriority priority, bool wait)
+  {
+    std::atomic<uint64_t>& pool = free_[priority];
+    for (;;)
+    {
+      uint64_t head = pool.load();
+      while (indexOf(head) != NIL)
+      {
+	uint32_t next = nodes_[indexOf(head)].next.load(std::memory_order_relaxed);
+	if (pool.compare_exchange_weak(head, makeHead(head, next)))
+	  return indexOf(head);
+      }
+      if (!wait || stopping_ || failed_)
+	return NIL;
+      // Full: wait for the flusher.  It checks spaceWaiters_ after
+      // releasing nodes, and we check the free list after announcing
+      // ourselves, so one of us sees the other.
+      std::unique_lock<std::mutex> lock(lock_);
+      ++spaceWaiters_;
+      space_.wait(lock, [this, &pool]
+		  {
+		    return indexOf(pool.load()) != NIL || stopping_ || failed_;
+		  });
+      --spaceWaiters_;
+    }
+  }
+
+  void
+  SendQueue::release(uint32_t i)
+  {
+    Node& n = nodes_[i];
+    if (n.big.capacity() > 4 * INLINE_SIZE)
+      std::string().swap(n.big);
+    else
+      n.big.clear();
+    std::atomic<uint64_t>& pool = free_[n.priority];
+    uint64_t head = pool.load();
+    do
+      n.next.store(indexOf(head), std::memory_order_relaxed);
+    while (!pool.compare_exchange_weak(head, makeHead(head, i)));
+  }
+
+  void
+  SendQueue::enqueue(uint32_t i)
+  {
+    Node& n = nodes_[i];
+    std::atomic<uint32_t>& lane = lanes_[n.priority];
+    uint32_t head = lane.load();
+    do
+      n.next.store(head, std::memory_order_relaxed);
+    while (!lane.compare_exchange_weak(head, i));
+    if (sleeping_)
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      work_.notify_one();
+    }
+  }
+
+  int
+  SendQueue::push(const void* data, size_t len, SendPriority priority,
+		  bool wait)
+  {
+    if (!enter())
+      return -1;
+    uint32_t i = acquire(priority, wait);
+    if (i == NIL)
+    {
+      leave();
+      return -1;
+    }
+    Node& n = nodes_[i];
+    n.size = len;
+    if (len <= INLINE_SIZE)
+      memcpy(n.data, data, len);
+    else
+      n.big.assign(static_cast<const char*>(data), len);
+    enqueue(i);
+    leave();
+    return 0;
+  }
+
+  int
+  SendQueue::pushf(SendPriority priority, const char* format, ...)
+  {
+    va_list args;
+    va_start(args, format);
+    int res = vpushf(priority, format, args);
+    va_end(args);
+    return res;
+  }
+
+  int
+  SendQueue::vpushf(SendPriority priority, const char* format, va_list args)
+  {
+    if (!enter())
+      return -1;
+    uint32_t i = acquire(priority, true);
+    if (i == NIL)
+    {
+      leave();
+      return -1;
+    }
+    Node& n = nodes_[i];
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(n.data, INLINE_SIZE, format, copy);
+    va_end(copy);
+    if (len < 0)
+    {
+      release(i);
+      leave();
+      return -1;
+    }
+    if (len >= INLINE_SIZE)
+    {
+      n.big.resize(len + 1);
+      vsnprintf(&n.big[0], len + 1, format, args);
+      n.big.resize(len);
+    }
+    n.size = len;
+    enqueue(i);
+    leave();
+    return 0;
+  }
+
+  bool
+  SendQueue::grab()
+  {
+    bool any = false;
+    for (size_t p = 0; p < PRIORITY_COUNT; ++p)
+    {
+      std::vector<uint32_t>& pending = pending_[p];
+      pending.erase(pending.begin(), pending.begin() + pendingFirst_[p]);
+      pendingFirst_[p] = 0;
+      // Lanes are LIFO; reverse to send in push order.
+      size_t first = pending.size();
+      for (uint32_t i = lanes_[p].exchange(NIL); i != NIL;
+	   i = nodes_[i].next.load(std::memory_order_relaxed))
+	pending.push_back(i);
+      std::reverse(pending.begin() + first, pending.end());
+      any |= !pending.empty();
+    }
+    return any;
+  }
+
+  size_t
+  SendQueue::room() const
+  {
+    int queued;
+    if (!maxInFlight_ || ioctl(fd_, SIOCOUTQ, &queued) < 0)
+      return SIZE_MAX;
+    return size_t(queued) < maxInFlight_ ? maxInFlight_ - queued : 0;
+  }
+
+  bool
+  SendQueue::flush()
+  {
+    size_t budget = room();
+    if (!budget)
+      return false;
+
+    // A command cut by a short write goes first, then the others by
+    // lane, until the budget is spent; the last one may overshoot it.
+    iov_.clear();
+    sent_.clear();
+    size_t bytes = 0;
+    if (partialLane_ >= 0)
+    {
+      uint32_t i = pending_[partialLane_][pendingFirst_[partialLane_]];
+      const Node& n = nodes_[i];
+      iovec v = { const_cast<char*>(n.bytes()) + partial_, n.size - partial_ };
+      iov_.push_back(v);
+      sent_.push_back(i);
+      bytes += v.iov_len;
+    }
+    for (int p = 0; p < PRIORITY_COUNT; ++p)
+      for (size_t k = pendingFirst_[p] + (p == partialLane_);
+	   k < pending_[p].size() && bytes < budget
+	     && iov_.size() < IOV_MAX;
+	   ++k)
+      {
+	const Node& n = nodes_[pending_[p][k]];
+	iovec v = { const_cast<char*>(n.bytes()), n.size };
+	iov_.push_back(v);
+	sent_.push_back(pending_[p][k]);
+	bytes += v.iov_len;
+      }
+
+    // sendmsg() rather than writev() for MSG_NOSIGNAL.
+    msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov_[0];
+    msg.msg_iovlen = iov_.size();
+    ssize_t w;
+    while ((w = sendmsg(fd_, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+      continue;
+    if (w < 0)
+    {
+      // After a timeout in stop(), keep its error rather than the
+      // EPIPE of the shut down socket.
+      if (!failed_)
+	error_ = errno;
+      failed_ = true;
+      discard();
+      return true;
+    }
+    ++writes_;
+
+    size_t written = w;
+    size_t k = 0;
+    for (; k < sent_.size() && written >= iov_[k].iov_len; ++k)
+    {
+      written -= iov_[k].iov_len;
+      SendPriority p = nodes_[sent_[k]].priority;
+      ++pendingFirst_[p];
+      release(sent_[k]);
+    }
+    commands_ += k;
+    if (k < sent_.size())
+    {
+      // sent_[k] is the first pending command of its lane.
+      int p = nodes_[sent_[k]].priority;
+      partial_ = (p == partialLane_ && !k ? partial_ : 0) + written;
+      partialLane_ = p;
+    }
+    else
+    {
+      partialLane_ = -1;
+      partial_ = 0;
+    }
+    if (spaceWaiters_)
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      space_.notify_all();
+    }
+    return true;
+  }
+
+  void
+  SendQueue::discard()
+  {
+    for (size_t p = 0; p < PRIORITY_COUNT; ++p)
+    {
+      for (size_t k = pendingFirst_[p]; k < pending_[p].size(); ++k)
+	release(pending_[p][k]);
+      pending_[p].clear();
+      pendingFirst_[p] = 0;
+    }
+    partialLane_ = -1;
+    partial_ = 0;
+    std::lock_guard<std::mutex> lock(lock_);
+    space_.notify_all();
+  }
+
+  void
+  SendQueue::run()
+  {
+    while (!stopping_)
+    {
+      if (grab())
+      {
+	if (failed_)
+	  discard();
+	else if (!flush())
+	{
+	  // The kernel holds enough; keep the rest in the lanes, where
+	  // urgent commands can still overtake it.
+	  std::unique_lock<std::mutex> lock(lock_);
+	  work_.wait_for(lock, IN_FLIGHT_POLL);
+	}
+	continue;
+      }
+      std::unique_lock<std::mutex> lock(lock_);
+      sleeping_ = true;
+      // Producers push, then check sleeping_; we set sleeping_, then
+      // check the lanes.  Either they notify or we see their command.
+      bool empty = true;
+      for (size_t p = 0; p < PRIORITY_COUNT; ++p)
+	empty &= lanes_[p].load() == NIL;
+      if (empty && !stopping_)
+	work_.wait(lock);
+      sleeping_ = false;
+    }
+
+    // Pushes that got in before stop() may still be filling their
+    // node; wait for them, after which nothing more can be queued,
+    // and send everything.
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      work_.wait(lock, [this] { return !pushers_; });
+    }
+    while (grab() && !failed_)
+      if (!flush())
+	std::this_thread::sleep_for(IN_FLIGHT_POLL);
+    discard();
+    std::lock_guard<std::mutex> lock(lock_);
+    finished_ = true;
+    done_.notify_all();
+  }
+
+} // namespace aibo
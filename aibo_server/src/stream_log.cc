@@ -0,0 +1,421 @@
+/// \file stream_log.cc
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aibo_server/stream_log.hh"
+
+namespace aibo
+{
+  namespace
+  {
+    const char SEGMENT_MAGIC[8] = {'A', 'I', 'B', 'O', 'S', 'E', 'G', '1'};
+    const char INDEX_MAGIC[8] = {'A', 'I', 'B', 'O', 'I', 'D', 'X', '1'};
+    enum { LOG_VERSION = 1 };
+
+    size_t align8(size_t n)
+    {
+      return (n + 7) & ~size_t(7);
+    }
+
+    std::string segmentPath(const std::string& dir, unsigned i)
+    {
+      char name[16];
+      snprintf(name, sizeof name, "/%06u.seg", i);
+      return dir + name;
+    }
+
+    std::string indexPath(const std::string& dir)
+    {
+      return dir + "/index";
+    }
+
+    int64_t steadyNs()
+    {
+      using namespace std::chrono;
+      return duration_cast<nanoseconds>(steady_clock::now()
+					.time_since_epoch()).count();
+    }
+
+    int64_t wallNs()
+    {
+      using namespace std::chrono;
+      return duration_cast<nanoseconds>(system_clock::now()
+					.time_since_epoch()).count();
+    }
+  }
+
+  /*-----------------.
+  | StreamRecorder.  |
+  `-----------------*/
+
+  StreamRecorder::StreamRecorder(size_t segmentSize)
+    : segmentSize_(std::max(segmentSize, size_t(4096))),
+      segments_(0),
+      fd_(-1),
+      map_(0),
+      mapSize_(0),
+      index_(0),
+      offset_(0),
+      base_(0),
+      messages_(0),
+      now_(0)
+  {}
+
+  StreamRecorder::~StreamRecorder()
+  {
+    close();
+  }
+
+  int
+  StreamRecorder::fail(const std::string& what)
+  {
+    errorMessage_ = what + ": " + strerror(errno);
+    return -1;
+  }
+
+  int
+  StreamRecorder::open(const std::string& dir)
+  {
+    close();
+    dir_ = dir;
+    if (mkdir(dir.c_str(), 0755) && errno != EEXIST)
+      return fail("cannot create " + dir);
+    int fd = ::open(indexPath(dir).c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+      return fail("cannot create " + indexPath(dir));
+    index_ = fdopen(fd, "wb");
+    if (!index_)
+    {
+      ::close(fd);
+      return fail("cannot open " + indexPath(dir));
+    }
+    IndexHeader h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, INDEX_MAGIC, sizeof h.magic);
+    h.version = LOG_VERSION;
+    h.entrySize = sizeof(IndexEntry);
+    if (fwrite(&h, sizeof h, 1, index_) != 1 || fflush(index_))
+      return fail("cannot write " + indexPath(dir));
+    segments_ = 0;
+    offset_ = 0;
+    base_ = 0;
+    messages_ = 0;
+    return newSegment(0);
+  }
+
+  int
+  StreamRecorder::newSegment(size_t minSize)
+  {
+    closeSegment();
+    std::string path = segmentPath(dir_, segments_);
+    size_t size = std::max(segmentSize_, sizeof(SegmentHeader)
+			   + sizeof(RecordHeader) + align8(minSize));
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd_ < 0)
+      return fail("cannot create " + path);
+    // Allocate the blocks now: running out of disk while writing
+    // through the mapping would raise SIGBUS.
+    if (int e = posix_fallocate(fd_, 0, size))
+    {
+      errno = e;
+      fail("cannot allocate " + path);
+      ::close(fd_);
+      fd_ = -1;
+      return -1;
+    }
+    void* p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED)
+    {
+      fail("cannot map " + path);
+      ::close(fd_);
+      fd_ = -1;
+      return -1;
+    }
+    map_ = static_cast<char*>(p);
+    mapSize_ = size;
+    SegmentHeader* h = reinterpret_cast<SegmentHeader*>(map_);
+    memset(h, 0, sizeof *h);
+    memcpy(h->magic, SEGMENT_MAGIC, sizeof h->magic);
+    h->version = LOG_VERSION;
+    h->headerSize = sizeof *h;
+    h->offset = offset_;
+    h->created = wallNs();
+    h->used = sizeof *h;
+    ++segments_;
+    return 0;
+  }
+
+  void
+  StreamRecorder::closeSegment()
+  {
+    if (!map_)
+      return;
+    uint64_t used = reinterpret_cast<SegmentHeader*>(map_)->used;
+    munmap(map_, mapSize_);
+    map_ = 0;
+    mapSize_ = 0;
+    if (ftruncate(fd_, used))
+      fail("cannot trim segment");
+    ::close(fd_);
+    fd_ = -1;
+  }
+
+  void
+  StreamRecorder::close()
+  {
+    closeSegment();
+    if (index_)
+    {
+      fclose(index_);
+      index_ = 0;
+    }
+  }
+
+  int
+  StreamRecorder::record(const char* data, size_t len,
+			 unsigned long long position)
+  {
+    if (!map_)
+      return -1;
+    now_ = steadyNs();
+    SegmentHeader* h = reinterpret_cast<SegmentHeader*>(map_);
+    size_t need = sizeof(RecordHeader) + align8(len);
+    if (h->used + need > mapSize_)
+    {
+      if (newSegment(len))
+	return -1;
+      h = reinterpret_cast<SegmentHeader*>(map_);
+    }
+    char* p = map_ + h->used;
+    RecordHeader r;
+    r.time = now_;
+    r.offset = offset_;
+    r.size = len;
+    r.reserved = 0;
+    memcpy(p, &r, sizeof r);
+    memcpy(p + sizeof r, data, len);
+    // Publish the record only once it is complete.
+    h->used += need;
+    base_ = position - offset_;
+    offset_ += len;
+    return 0;
+  }
+
+  void
+  StreamRecorder::index(const UrbiMessageView& msg,
+			unsigned long long position)
+  {
+    // Started before the recording.
+    if (position < base_)
+      return;
+    IndexEntry e;
+    memset(&e, 0, sizeof e);
+    e.offset = position - base_;
+    e.time = now_;
+    e.timestamp = msg.timestamp;
+    e.type = msg.type;
+    e.tagSize = std::min<size_t>(msg.tag.size(), 0xffff);
+    memcpy(e.tag, msg.tag.data(),
+	   std::min<size_t>(msg.tag.size(), IndexEntry::TAG_SIZE));
+    if (index_ && fwrite(&e, sizeof e, 1, index_) == 1)
+      ++messages_;
+  }
+
+  /*------------.
+  | StreamLog.  |
+  `------------*/
+
+  StreamLog::StreamLog()
+    : index_(0),
+      indexSize_(0)
+  {}
+
+  StreamLog::~StreamLog()
+  {
+    close();
+  }
+
+  int
+  StreamLog::fail(const std::string& what)
+  {
+    errorMessage_ = what;
+    close();
+    return -1;
+  }
+
+  void
+  StreamLog::close()
+  {
+    for (size_t i = 0; i < mappings_.size(); ++i)
+      munmap(mappings_[i].data, mappings_[i].size);
+    mappings_.clear();
+    records_.clear();
+    index_ = 0;
+    indexSize_ = 0;
+  }
+
+  namespace
+  {
+    /// Map \a path read-only. Return 0 if it cannot be.
+    void* mapFile(const std::string& path, size_t& size)
+    {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+	return 0;
+      struct stat st;
+      void* p = MAP_FAILED;
+      if (!fstat(fd, &st) && st.st_size)
+      {
+	size = st.st_size;
+	p = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+      }
+      ::close(fd);
+      return p == MAP_FAILED ? 0 : p;
+    }
+  }
+
+  int
+  StreamLog::open(const std::string& dir)
+  {
+    close();
+    for (unsigned s = 0; ; ++s)
+    {
+      std::string path = segmentPath(dir, s);
+      if (access(path.c_str(), F_OK))
+	break;
+      Mapping m;
+      m.data = mapFile(path, m.size);
+      if (!m.data)
+	return fail("cannot map " + path + ": " + strerror(errno));
+      mappings_.push_back(m);
+      const char* base = static_cast<const char*>(m.data);
+      const SegmentHeader* h = reinterpret_cast<const SegmentHeader*>(base);
+      if (m.size < sizeof *h || memcmp(h->magic, SEGMENT_MAGIC, sizeof h->magic)
+	  || h->version != LOG_VERSION || h->used > m.size
+	  || h->headerSize < sizeof *h)
+	return fail(path + ": not a stream log segment");
+      if (h->offset != size())
+	return fail(path + ": segment does not follow the previous one");
+      for (size_t pos = h->headerSize;
+	   pos + sizeof(RecordHeader) <= h->used;)
+      {
+	RecordHeader rh;
+	memcpy(&rh, base + pos, sizeof rh);
+	size_t next = pos + sizeof rh + align8(rh.size);
+	if (next > h->used)
+	  return fail(path + ": truncated record");
+	Record r;
+	r.time = rh.time;
+	r.offset = rh.offset;
+	r.data = base + pos + sizeof rh;
+	r.size = rh.size;
+	records_.push_back(r);
+	pos = next;
+      }
+    }
+    if (mappings_.empty())
+      return fail("no segment in " + dir);
+
+    std::string path = indexPath(dir);
+    Mapping m;
+    m.data = mapFile(path, m.size);
+    if (!m.data)
+      return fail("cannot map " + path + ": " + strerror(errno));
+    mappings_.push_back(m);
+    const char* base = static_cast<const char*>(m.data);
+    const IndexHeader* h = reinterpret_cast<const IndexHeader*>(base);
+    if (m.size < sizeof *h || memcmp(h->magic, INDEX_MAGIC, sizeof h->magic)
+	|| h->version != LOG_VERSION || h->entrySize != sizeof(IndexEntry))
+      return fail(path + ": not a stream log index");
+    index_ = reinterpret_cast<const IndexEntry*>(base + sizeof *h);
+    indexSize_ = (m.size - sizeof *h) / sizeof(IndexEntry);
+    // After a crash the index may outlive the last complete record.
+    uint64_t end = size();
+    while (indexSize_ && index_[indexSize_ - 1].offset >= end)
+      --indexSize_;
+    return 0;
+  }
+
+  LogRecord
+  StreamLog::record(size_t i) const
+  {
+    LogRecord r;
+    r.time = records_[i].time;
+    r.offset = records_[i].offset;
+    r.data = StringRef(records_[i].data, records_[i].size);
+    return r;
+  }
+
+  uint64_t
+  StreamLog::size() const
+  {
+    return records_.empty() ? 0
+      : records_.back().offset + records_.back().size;
+  }
+
+  size_t
+  StreamLog::findRecord(uint64_t offset) const
+  {
+    if (offset >= size())
+      return records_.size();
+    auto it = std::upper_bound(records_.begin(), records_.end(), offset,
+			       [] (uint64_t o, const Record& r)
+			       {
+				 return o < r.offset;
+			       });
+    return it - records_.begin() - 1;
+  }
+
+  size_t
+  StreamLog::seekTime(int64_t time) const
+  {
+    return std::lower_bound(index_, index_ + indexSize_, time,
+			    [] (const IndexEntry& e, int64_t t)
+			    {
+			      return e.time < t;
+			    }) - index_;
+  }
+
+  size_t
+  StreamLog::seekTimestamp(int timestamp) const
+  {
+    return std::lower_bound(index_, index_ + indexSize_, timestamp,
+			    [] (const IndexEntry& e, int t)
+			    {
+			      return e.timestamp < t;
+			    }) - index_;
+  }
+
+  size_t
+  StreamLog::findTag(const StringRef& tag, size_t from) const
+  {
+    size_t stored = std::min<size_t>(tag.size(), IndexEntry::TAG_SIZE);
+    for (size_t i = from; i < indexSize_; ++i)
+      if (index_[i].tagSize == tag.size()
+	  && !memcmp(index_[i].tag, tag.data(), stored))
+	return i;
+    return indexSize_;
+  }
+
+  void
+  StreamLog::copy(uint64_t begin, uint64_t end, std::string& out) const
+  {
+    end = std::min(end, size());
+    for (size_t i = findRecord(begin); i < records_.size() && begin < end; ++i)
+    {
+      const Record& r = records_[i];
+      size_t skip = begin - r.offset;
+      size_t n = std::min<uint64_t>(r.size - skip, end - begin);
+      out.append(r.data + skip, n);
+      begin += n;
+    }
+  }
+
+} // namespace aibo
@@ -0,0 +1,206 @@
+/// \file stream_replay_server.cc
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "aibo_server/stream_replay_server.hh"
+
+namespace aibo
+{
+  namespace
+  {
+    /// Chunks per sendmsg().
+    enum { BATCH = 64 };
+
+    int64_t steadyNs()
+    {
+      using namespace std::chrono;
+      return duration_cast<nanoseconds>(steady_clock::now()
+					.time_since_epoch()).count();
+    }
+  }
+
+  StreamReplayServer::StreamReplayServer(const StreamLog& log, int port)
+    : log_(log),
+      port_(port),
+      speed_(1),
+      begin_(0),
+      loop_(false),
+      listen_(-1),
+      running_(false),
+      playbacks_(0),
+      bytes_(0)
+  {}
+
+  StreamReplayServer::~StreamReplayServer()
+  {
+    stop();
+  }
+
+  int
+  StreamReplayServer::start()
+  {
+    listen_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_ < 0)
+      return -1;
+    int one = 1;
+    setsockopt(listen_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port_);
+    if (bind(listen_, reinterpret_cast<sockaddr*>(&addr), sizeof addr)
+	|| ::listen(listen_, 4))
+    {
+      ::close(listen_);
+      listen_ = -1;
+      return -1;
+    }
+    socklen_t len = sizeof addr;
+    getsockname(listen_, reinterpret_cast<sockaddr*>(&addr), &len);
+    port_ = ntohs(addr.sin_port);
+    running_ = true;
+    thread_ = std::thread(&StreamReplayServer::run, this);
+    return 0;
+  }
+
+  void
+  StreamReplayServer::stop()
+  {
+    running_ = false;
+    if (thread_.joinable())
+      thread_.join();
+    if (listen_ >= 0)
+      ::close(listen_);
+    listen_ = -1;
+  }
+
+  void
+  StreamReplayServer::run()
+  {
+    while (running_)
+    {
+      pollfd p;
+      p.fd = listen_;
+      p.events = POLLIN;
+      if (poll(&p, 1, 100) <= 0)
+	continue;
+      int fd = ::accept(listen_, 0, 0);
+      if (fd < 0)
+	continue;
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+      // Let stop() interrupt a send to a client that does not read.
+      timeval tv = {0, 100000};
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+      size_t first = log_.findRecord(begin_);
+      while (running_ && first < log_.recordCount() && play(fd, first))
+      {
+	++playbacks_;
+	if (!loop_)
+	  break;
+      }
+      ::close(fd);
+    }
+  }
+
+  bool
+  StreamReplayServer::drain(int fd, int timeoutMs)
+  {
+    pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    if (poll(&p, 1, timeoutMs) <= 0)
+      return true;
+    char buf[4096];
+    ssize_t n = recv(fd, buf, sizeof buf, MSG_DONTWAIT);
+    return n > 0 || (n < 0 && (errno == EINTR || errno == EAGAIN));
+  }
+
+  bool
+  StreamReplayServer::send(int fd, iovec* iov, size_t count)
+  {
+    while (count && running_)
+    {
+      msghdr m;
+      memset(&m, 0, sizeof m);
+      m.msg_iov = iov;
+      m.msg_iovlen = count;
+      ssize_t n = sendmsg(fd, &m, MSG_NOSIGNAL);
+      if (n < 0)
+      {
+	if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+	{
+	  if (!drain(fd, 0))
+	    return false;
+	  continue;
+	}
+	return false;
+      }
+      bytes_ += n;
+      while (count && size_t(n) >= iov->iov_len)
+      {
+	n -= iov->iov_len;
+	++iov;
+	--count;
+      }
+      if (count)
+      {
+	iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+	iov->iov_len -= n;
+      }
+    }
+    return !count;
+  }
+
+  bool
+  StreamReplayServer::play(int fd, size_t first)
+  {
+    const int64_t t0 = steadyNs();
+    const int64_t base = log_.record(first).time;
+    size_t i = first;
+    while (running_ && i < log_.recordCount())
+    {
+      if (speed_ > 0)
+      {
+	int64_t wait = t0 + int64_t((log_.record(i).time - base) / speed_)
+	  - steadyNs();
+	if (wait > 0)
+	{
+	  // Sleep in poll() so that client input keeps being read.
+	  if (!drain(fd, std::min<int64_t>((wait + 999999) / 1000000, 100)))
+	    return false;
+	  continue;
+	}
+      }
+      else if (!drain(fd, 0))
+	return false;
+
+      // Every chunk that is due by now, in one call.
+      iovec iov[BATCH];
+      size_t n = 0;
+      int64_t now = speed_ > 0 ? steadyNs() : 0;
+      for (; n < BATCH && i < log_.recordCount(); ++n, ++i)
+      {
+	LogRecord r = log_.record(i);
+	if (n && speed_ > 0 && t0 + int64_t((r.time - base) / speed_) > now)
+	  break;
+	size_t skip = i == first && begin_ > r.offset ? begin_ - r.offset : 0;
+	iov[n].iov_base = const_cast<char*>(r.data.data()) + skip;
+	iov[n].iov_len = r.data.size() - skip;
+      }
+      if (!send(fd, iov, n))
+	return false;
+    }
+    return running_;
+  }
+
+} // namespace aibo
@@ -0,0 +1,269 @@
+/// \file urbi_connection.cc
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "aibo_server/stream_log.hh"
+#include "aibo_server/urbi_connection.hh"
+
+namespace aibo
+{
+  const char* const UrbiConnection::CLIENTERROR_TAG = "client_error";
+
+  double
+  steadyTime()
+  {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+  }
+
+  namespace
+  {
+    /// Minimum room handed to recv().
+    enum { READ_SIZE = 16 * 1024 };
+  }
+
+  UrbiConnection::UrbiConnection(const std::string& host, int port)
+    : sd_(-1),
+      host_(host),
+      port_(port),
+      rc_(0),
+      closed_(false),
+      handler_(0),
+      recorder_(0),
+      dispatch_(*this)
+  {}
+
+  UrbiConnection::~UrbiConnection()
+  {
+    close();
+  }
+
+  int
+  UrbiConnection::connect()
+  {
+    char service[16];
+    snprintf(service, sizeof service, "%d", port_);
+    addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res;
+    if (int e = getaddrinfo(host_.c_str(), service, &hints, &res))
+    {
+      errorMessage_ = std::string("cannot resolve ") + host_ + ": "
+	+ gai_strerror(e);
+      return rc_ = -1;
+    }
+    int err = 0;
+    for (addrinfo* a = res; a; a = a->ai_next)
+    {
+      int sd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (sd < 0)
+      {
+	err = errno;
+	continue;
+      }
+      if (!::connect(sd, a->ai_addr, a->ai_addrlen))
+      {
+	sd_ = sd;
+	break;
+      }
+      err = errno;
+      ::close(sd);
+    }
+    freeaddrinfo(res);
+    if (sd_ < 0)
+    {
+      errorMessage_ = "cannot connect to " + host_ + ": " + strerror(err);
+      return rc_ = -1;
+    }
+    // Commands are small and latency matters more than packet count.
+    int one = 1;
+    setsockopt(sd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    closed_ = false;
+    return rc_ = 0;
+  }
+
+  void
+  UrbiConnection::start()
+  {
+    if (sd_ >= 0 && !thread_.joinable())
+      thread_ = std::thread(&UrbiConnection::receiveLoop, this);
+  }
+
+  void
+  UrbiConnection::enableSendQueue(size_t depth)
+  {
+    if (sd_ < 0 || sendQueue_)
+      return;
+    sendQueue_.reset(new SendQueue(sd_, depth));
+    sendQueue_->start();
+  }
+
+  void
+  UrbiConnection::close()
+  {
+    // Let queued commands out before the socket goes away, unless the
+    // server stopped reading.  The queue itself stays until
+    // destruction: send() may be running in another thread, and must
+    // fail rather than touch a deleted queue.
+    if (sendQueue_)
+      sendQueue_->stop();
+    closed_ = true;
+    if (sd_ >= 0)
+      shutdown(sd_, SHUT_RDWR);
+    if (thread_.joinable() && thread_.get_id() != std::this_thread::get_id())
+      thread_.join();
+    if (sd_ >= 0)
+    {
+      ::close(sd_);
+      sd_ = -1;
+    }
+  }
+
+  int
+  UrbiConnection::send(const void* data, size_t len, SendPriority priority)
+  {
+    if (sendQueue_)
+      return sendQueue_->push(data, len, priority) ? rc_ = -1 : 0;
+    std::lock_guard<std::mutex> lock(sendLock_);
+    const char* p = static_cast<const char*>(data);
+    while (len)
+    {
+      ssize_t n = ::send(sd_, p, len, MSG_NOSIGNAL);
+      if (n < 0)
+      {
+	if (errno == EINTR)
+	  continue;
+	return rc_ = -1;
+      }
+      p += n;
+      len -= n;
+    }
+    return 0;
+  }
+
+  int
+  UrbiConnection::sendf(const char* format, ...)
+  {
+    va_list args;
+    va_start(args, format);
+    int res = vsendf(format, args);
+    va_end(args);
+    return res;
+  }
+
+  int
+  UrbiConnection::sendf(SendPriority priority, const char* format, ...)
+  {
+    va_list args;
+    va_start(args, format);
+    int res = vsendf(priority, format, args);
+    va_end(args);
+    return res;
+  }
+
+  int
+  UrbiConnection::vsendf(const char* format, va_list args)
+  {
+    return vsendf(PRIORITY_NORMAL, format, args);
+  }
+
+  int
+  UrbiConnection::vsendf(SendPriority priority, const char* format,
+			 va_list args)
+  {
+    if (sendQueue_)
+      return sendQueue_->vpushf(priority, format, args) ? rc_ = -1 : 0;
+    char buf[1024];
+    va_list copy;
+    va_copy(copy, args);
+    int n = vsnprintf(buf, sizeof buf, format, copy);
+    va_end(copy);
+    if (n < 0)
+      return rc_ = -1;
+    if (size_t(n) < sizeof buf)
+      return send(buf, n, priority);
+    std::string big(n + 1, '\0');
+    vsnprintf(&big[0], n + 1, format, args);
+    return send(big.data(), n, priority);
+  }
+
+  void
+  UrbiConnection::onReceive(const char*, size_t)
+  {}
+
+  void
+  UrbiConnection::clientError(const char* msg, int code)
+  {
+    char text[256];
+    snprintf(text, sizeof text, "!!! %s (%d)", msg, code);
+    UrbiMessageView v;
+    v.tag = CLIENTERROR_TAG;
+    v.type = MESSAGE_ERROR;
+    v.text = v.raw = text;
+    v.message = v.text.substr(4);
+    if (handler_)
+      handler_->onMessage(v);
+  }
+
+  void
+  UrbiConnection::receiveLoop()
+  {
+    while (!closed_)
+    {
+      size_t avail;
+      char* dst = parser_.prepare(READ_SIZE, avail);
+      if (!dst)
+      {
+	clientError("message too large, dropping buffered data");
+	parser_.reset();
+	continue;
+      }
+      ssize_t n = recv(sd_, dst, avail, 0);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+      {
+	if (!closed_)
+	  clientError(n ? strerror(errno) : "connection closed by server",
+		      n ? errno : 0);
+	closed_ = true;
+	break;
+      }
+      // The new bytes follow those already buffered.
+      unsigned long long position = parser_.offset() + parser_.pending();
+      parser_.commit(n);
+      if (recorder_ && recorder_->record(dst, n, position))
+      {
+	clientError(("recording stopped: "
+		     + recorder_->errorMessage()).c_str());
+	recorder_ = 0;
+      }
+      onReceive(dst, n);
+      if (recorder_)
+	parser_.parse(dispatch_);
+      else if (handler_)
+	parser_.parse(*handler_);
+      else
+	parser_.reset();
+    }
+  }
+
+  void
+  UrbiConnection::Dispatch::onMessage(const UrbiMessageView& msg)
+  {
+    c_.recorder_->index(msg, c_.parser_.offset());
+    if (c_.handler_)
+      c_.handler_->onMessage(msg);
+  }
+
+} // namespace aibo
@@ -0,0 +1,96 @@
+/// \file urbi_message.cc
+
+#include <ostream>
+
+#include "aibo_server/urbi_message.hh"
+
+namespace aibo
+{
+  std::ostream& operator<<(std::ostream& s, const StringRef& r)
+  {
+    return s.write(r.data(), r.size());
+  }
+
+  std::ostream& operator<<(std::ostream& s, const UrbiMessageView& m)
+  {
+    return s << '[' << m.timestamp << ':' << m.tag << "] "
+	     << m.textWithoutBinaries();
+  }
+
+  std::string
+  UrbiMessageView::textWithoutBinaries() const
+  {
+    std::string res;
+    const char* p = text.begin();
+    for (size_t i = 0; i < binaryCount; ++i)
+    {
+      res.append(p, binaries[i].data.begin());
+      p = binaries[i].data.end();
+    }
+    res.append(p, text.end());
+    return res;
+  }
+
+  namespace
+  {
+    /// Move \a r from the raw text at \a from, of \a size bytes, to
+    /// the copy at \a to.  Parts that do not point into the raw text,
+    /// like the static tag of client errors, are kept as they are.
+    StringRef rebase(const StringRef& r, const char* from, size_t size,
+		     const char* to)
+    {
+      if (!r.data() || r.data() < from || r.data() + r.size() > from + size)
+	return r;
+      return StringRef(to + (r.data() - from), r.size());
+    }
+  }
+
+  UrbiMessage::UrbiMessage()
+  {}
+
+  UrbiMessage::UrbiMessage(const UrbiMessageView& v)
+  {
+    assign(v);
+  }
+
+  UrbiMessage::UrbiMessage(const UrbiMessage& m)
+  {
+    assign(m.view_);
+  }
+
+  UrbiMessage&
+  UrbiMessage::operator=(const UrbiMessage& m)
+  {
+    if (this != &m)
+      assign(m.view_);
+    return *this;
+  }
+
+  void
+  UrbiMessage::assign(const UrbiMessageView& v)
+  {
+    // Copy first: v may refer into our own storage.
+    std::string raw(v.raw.data(), v.raw.size());
+    std::vector<BinaryRef> bins(v.binaries, v.binaries + v.binaryCount);
+    raw_.swap(raw);
+    binaries_.swap(bins);
+
+    const char* from = v.raw.data();
+    size_t size = v.raw.size();
+    const char* to = raw_.data();
+    view_.timestamp = v.timestamp;
+    view_.type = v.type;
+    view_.raw = StringRef(to, raw_.size());
+    view_.tag = rebase(v.tag, from, size, to);
+    view_.text = rebase(v.text, from, size, to);
+    view_.message = rebase(v.message, from, size, to);
+    for (size_t i = 0; i < binaries_.size(); ++i)
+    {
+      binaries_[i].header = rebase(binaries_[i].header, from, size, to);
+      binaries_[i].data = rebase(binaries_[i].data, from, size, to);
+    }
+    view_.binaries = binaries_.empty() ? 0 : &binaries_[0];
+    view_.binaryCount = binaries_.size();
+  }
+
+} // namespace aibo
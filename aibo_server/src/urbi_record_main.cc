@@ -0,0 +1,102 @@
+/// \file urbi_record_main.cc
+/// \brief Record the stream of an URBI server to a log until interrupted.
+///
+/// Usage: urbi_record [-p port] [-s segment_mb] [-f script] [-t seconds]
+///                    host log_dir
+///   -f  file of URBI commands sent once connected, e.g. the loops of
+///       the bridge nodes
+///   -t  stop after this many seconds (default: on SIGINT)
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+#include "aibo_server/stream_log.hh"
+#include "aibo_server/urbi_connection.hh"
+
+namespace
+{
+  volatile sig_atomic_t interrupted = 0;
+
+  void onSignal(int)
+  {
+    interrupted = 1;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  int port = aibo::URBI_PORT;
+  size_t segmentMb = 64;
+  const char* script = 0;
+  double seconds = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:s:f:t:")) != -1)
+    switch (opt)
+    {
+    case 'p': port = atoi(optarg); break;
+    case 's': segmentMb = strtoul(optarg, 0, 10); break;
+    case 'f': script = optarg; break;
+    case 't': seconds = atof(optarg); break;
+    default:
+      optind = argc;
+    }
+  if (argc - optind != 2)
+  {
+    fprintf(stderr, "usage: %s [-p port] [-s segment_mb] [-f script]"
+	    " [-t seconds] host log_dir\n", argv[0]);
+    return 1;
+  }
+  const char* host = argv[optind];
+  const char* dir = argv[optind + 1];
+
+  std::string commands;
+  if (script)
+  {
+    std::ifstream f(script);
+    if (!f)
+    {
+      perror(script);
+      return 1;
+    }
+    std::ostringstream ss;
+    ss << f.rdbuf();
+    commands = ss.str();
+  }
+
+  aibo::StreamRecorder recorder(segmentMb << 20);
+  if (recorder.open(dir))
+  {
+    fprintf(stderr, "%s\n", recorder.errorMessage().c_str());
+    return 1;
+  }
+  aibo::UrbiConnection connection(host, port);
+  if (connection.connect())
+  {
+    fprintf(stderr, "%s\n", connection.errorMessage().c_str());
+    return 1;
+  }
+  connection.setRecorder(&recorder);
+  connection.start();
+  if (!commands.empty() && connection.send(commands.data(), commands.size()))
+  {
+    fprintf(stderr, "cannot send %s\n", script);
+    return 1;
+  }
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  printf("recording %s:%d to %s\n", host, port, dir);
+  for (unsigned ticks = 0;
+       !interrupted && connection.connected()
+	 && (seconds <= 0 || ticks < seconds * 10); ++ticks)
+    usleep(100000);
+  connection.close();
+  recorder.close();
+  printf("%llu bytes, %zu messages\n", recorder.bytes(),
+	 recorder.messages());
+  return 0;
+}
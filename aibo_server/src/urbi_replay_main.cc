@@ -0,0 +1,103 @@
+/// \file urbi_replay_main.cc
+/// \brief Serve a recorded stream as a stand-in robot.
+///
+/// Usage: urbi_replay [-p port] [-x speed] [-t seconds | -g tag] [-l]
+///                    [-n playbacks] log_dir
+///   -x  1 for real time, 4 for four times faster, 0 for as fast as
+///       the client reads (default: 1)
+///   -t  start this many seconds into the log
+///   -g  start at the first message with this tag
+///   -l  loop instead of closing the connection at the end
+///   -n  exit after this many complete playbacks (default: never)
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "aibo_server/stream_replay_server.hh"
+
+namespace
+{
+  volatile sig_atomic_t interrupted = 0;
+
+  void onSignal(int)
+  {
+    interrupted = 1;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  int port = aibo::URBI_PORT;
+  double speed = 1;
+  double seconds = -1;
+  const char* tag = 0;
+  bool loop = false;
+  size_t playbacks = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:x:t:g:ln:")) != -1)
+    switch (opt)
+    {
+    case 'p': port = atoi(optarg); break;
+    case 'x': speed = atof(optarg); break;
+    case 't': seconds = atof(optarg); break;
+    case 'g': tag = optarg; break;
+    case 'l': loop = true; break;
+    case 'n': playbacks = strtoul(optarg, 0, 10); break;
+    default:
+      optind = argc;
+    }
+  if (argc - optind != 1)
+  {
+    fprintf(stderr, "usage: %s [-p port] [-x speed] [-t seconds | -g tag]"
+	    " [-l] [-n playbacks] log_dir\n", argv[0]);
+    return 1;
+  }
+
+  aibo::StreamLog log;
+  if (log.open(argv[optind]))
+  {
+    fprintf(stderr, "%s\n", log.errorMessage().c_str());
+    return 1;
+  }
+  if (!log.recordCount())
+  {
+    fprintf(stderr, "%s: empty log\n", argv[optind]);
+    return 1;
+  }
+  const int64_t first = log.record(0).time;
+  const int64_t last = log.record(log.recordCount() - 1).time;
+
+  size_t entry = 0;
+  if (tag)
+    entry = log.findTag(tag);
+  else if (seconds > 0)
+    entry = log.seekTime(first + int64_t(seconds * 1e9));
+  if (entry >= log.indexSize())
+  {
+    fprintf(stderr, "nothing to play from the requested position\n");
+    return 1;
+  }
+
+  aibo::StreamReplayServer server(log, port);
+  server.setSpeed(speed);
+  server.setStart(entry ? log.entry(entry).offset : 0);
+  server.setLoop(loop);
+  if (server.start())
+  {
+    perror("urbi_replay");
+    return 1;
+  }
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  printf("serving %llu bytes, %zu messages, %.1f s on port %d\n",
+	 (unsigned long long) log.size(), log.indexSize(),
+	 (last - first) * 1e-9, server.port());
+  while (!interrupted && (!playbacks || server.playbacks() < playbacks))
+    usleep(100000);
+  server.stop();
+  printf("%llu bytes sent, %zu playbacks\n", server.bytesSent(),
+	 server.playbacks());
+  return 0;
+}
@@ -0,0 +1,277 @@
+/// \file urbi_stream_parser.cc
+
+#include <cstdlib>
+#include <cstring>
+
+#include "aibo_server/urbi_stream_parser.hh"
+
+namespace aibo
+{
+  namespace
+  {
+    bool isTokenBoundary(char c)
+    {
+      return c == ' ' || c == '[' || c == ',' || c == '\t';
+    }
+
+    const char* find(const char* begin, const char* end, char c)
+    {
+      return static_cast<const char*>(memchr(begin, c, end - begin));
+    }
+  }
+
+  UrbiStreamParser::UrbiStreamParser(size_t initialSize, size_t maxSize)
+    : buffer_(initialSize, maxSize),
+      offset_(0)
+  {
+    resetMessage();
+  }
+
+  void
+  UrbiStreamParser::reset()
+  {
+    offset_ += buffer_.size();
+    buffer_.clear();
+    resetMessage();
+  }
+
+  void
+  UrbiStreamParser::resetMessage()
+  {
+    state_ = STATE_SYNC;
+    pos_ = 0;
+    headerEnd_ = 0;
+    textEnd_ = 0;
+    inString_ = false;
+    escape_ = false;
+    binaryRemaining_ = 0;
+    binaryPos_.clear();
+  }
+
+  size_t
+  UrbiStreamParser::parse(UrbiMessageHandler& handler)
+  {
+    size_t count = 0;
+    while (buffer_.size())
+    {
+      const char* msg = buffer_.data();
+      if (state_ == STATE_SYNC)
+      {
+	// Resynchronize on the next header.
+	const char* start = find(msg, msg + buffer_.size(), '[');
+	if (!start)
+	{
+	  offset_ += buffer_.size();
+	  buffer_.clear();
+	  break;
+	}
+	offset_ += start - msg;
+	buffer_.consume(start - msg);
+	msg = buffer_.data();
+	state_ = STATE_HEADER;
+	pos_ = 1;
+      }
+      if (!scan(msg, buffer_.size()))
+      {
+	if (state_ != STATE_SYNC)
+	  break;
+	// Malformed message: drop what was scanned and look for the next
+	// header.
+	offset_ += pos_;
+	buffer_.consume(pos_);
+	resetMessage();
+	continue;
+      }
+      dispatch(msg, handler);
+      offset_ += pos_;
+      buffer_.consume(pos_);
+      resetMessage();
+      ++count;
+    }
+    return count;
+  }
+
+  bool
+  UrbiStreamParser::scan(const char* msg, size_t len)
+  {
+    while (pos_ < len)
+    {
+      switch (state_)
+      {
+      case STATE_SYNC:
+	return false;
+
+      case STATE_HEADER:
+      {
+	const char* e = find(msg + pos_, msg + len, ']');
+	if (!e)
+	{
+	  pos_ = len;
+	  return false;
+	}
+	headerEnd_ = e - msg;
+	pos_ = headerEnd_ + 1;
+	state_ = STATE_TEXT;
+	break;
+      }
+
+      case STATE_TEXT:
+	for (; pos_ < len; ++pos_)
+	{
+	  char c = msg[pos_];
+	  if (c == '\n')
+	  {
+	    textEnd_ = pos_;
+	    ++pos_;
+	    return true;
+	  }
+	  if (inString_)
+	  {
+	    if (escape_)
+	      escape_ = false;
+	    else if (c == '\\')
+	      escape_ = true;
+	    else if (c == '"')
+	      inString_ = false;
+	    continue;
+	  }
+	  if (c == '"')
+	  {
+	    inString_ = true;
+	    continue;
+	  }
+	  if (c != 'B' || !isTokenBoundary(msg[pos_ - 1]))
+	    continue;
+	  // Possible "BIN ": wait for enough bytes to decide.
+	  if (len - pos_ < 4)
+	    return false;
+	  if (memcmp(msg + pos_, "BIN ", 4))
+	    continue;
+	  // System and error messages are plain text.
+	  const char* text = msg + headerEnd_ + 1;
+	  if (*text == ' ')
+	    ++text;
+	  if (!memcmp(text, "***", 3) || !memcmp(text, "!!!", 3))
+	    continue;
+	  BinaryPos b;
+	  b.header = pos_ + 4;
+	  b.headerEnd = b.data = b.size = 0;
+	  binaryPos_.push_back(b);
+	  pos_ += 4;
+	  state_ = STATE_BINARY_HEADER;
+	  break;
+	}
+	break;
+
+      case STATE_BINARY_HEADER:
+      {
+	const char* nl = find(msg + pos_, msg + len, '\n');
+	if (!nl)
+	{
+	  pos_ = len;
+	  return false;
+	}
+	BinaryPos& b = binaryPos_.back();
+	const char* after = msg + b.header;
+	while (after < nl && *after == ' ')
+	  ++after;
+	// Digits only: no sign, and no skipping over the line end.  A size
+	// that could never fit the buffer is as corrupt as a missing one.
+	const char* digits = after;
+	size_t size = 0;
+	const size_t max = buffer_.maxSize();
+	for (; after < nl && '0' <= *after && *after <= '9'; ++after)
+	{
+	  size = size * 10 + (*after - '0');
+	  if (size > max)
+	    break;
+	}
+	if (after == digits || size > max)
+	{
+	  state_ = STATE_SYNC;
+	  pos_ = nl + 1 - msg;
+	  return false;
+	}
+	while (after < nl && *after == ' ')
+	  ++after;
+	const char* hend = nl;
+	if (hend > after && hend[-1] == '\r')
+	  --hend;
+	b.header = after - msg;
+	b.headerEnd = hend - msg;
+	b.data = nl + 1 - msg;
+	b.size = size;
+	binaryRemaining_ = size;
+	pos_ = b.data;
+	state_ = STATE_BINARY_DATA;
+	break;
+      }
+
+      case STATE_BINARY_DATA:
+      {
+	size_t avail = len - pos_;
+	if (avail < binaryRemaining_)
+	{
+	  binaryRemaining_ -= avail;
+	  pos_ = len;
+	  return false;
+	}
+	pos_ += binaryRemaining_;
+	binaryRemaining_ = 0;
+	state_ = STATE_TEXT;
+	break;
+      }
+      }
+    }
+    return false;
+  }
+
+  void
+  UrbiStreamParser::dispatch(const char* msg, UrbiMessageHandler& handler)
+  {
+    UrbiMessageView v;
+
+    // Header: [timestamp:tag]
+    const char* hbegin = msg + 1;
+    const char* hend = msg + headerEnd_;
+    const char* colon = find(hbegin, hend, ':');
+    v.timestamp = strtol(hbegin, 0, 10);
+    if (colon)
+      v.tag = StringRef(colon + 1, hend - colon - 1);
+
+    const char* tbegin = hend + 1;
+    const char* tend = msg + textEnd_;
+    if (tbegin < tend && *tbegin == ' ')
+      ++tbegin;
+    if (tend > tbegin && tend[-1] == '\r')
+      --tend;
+    v.text = StringRef(tbegin, tend - tbegin);
+    v.raw = StringRef(msg, tend - msg);
+
+    if (v.text.startsWith(StringRef("***", 3)))
+      v.type = MESSAGE_SYSTEM;
+    else if (v.text.startsWith(StringRef("!!!", 3)))
+      v.type = MESSAGE_ERROR;
+    if (v.type == MESSAGE_DATA)
+      v.message = v.text;
+    else
+    {
+      v.message = v.text.substr(3);
+      if (!v.message.empty() && v.message[0] == ' ')
+	v.message = v.message.substr(1);
+    }
+
+    binaryRefs_.resize(binaryPos_.size());
+    for (size_t i = 0; i < binaryPos_.size(); ++i)
+    {
+      const BinaryPos& b = binaryPos_[i];
+      binaryRefs_[i].header = StringRef(msg + b.header, b.headerEnd - b.header);
+      binaryRefs_[i].data = StringRef(msg + b.data, b.size);
+    }
+    v.binaries = binaryRefs_.empty() ? 0 : &binaryRefs_[0];
+    v.binaryCount = binaryRefs_.size();
+
+    handler.onMessage(v);
+  }
+
+} // namespace aibo
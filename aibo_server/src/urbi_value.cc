@@ -0,0 +1,565 @@
+/// \file urbi_value.cc
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <ostream>
+#include <utility>
+
+#include "aibo_server/urbi_value.hh"
+
+namespace aibo
+{
+  namespace
+  {
+    /// Nesting limit, to bound recursion on hostile input.
+    enum { MAX_DEPTH = 64 };
+
+    inline const char* skipSpaces(const char* p, const char* end)
+    {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+	++p;
+      return p;
+    }
+
+    inline bool startsNumber(char c)
+    {
+      return ('0' <= c && c <= '9') || c == '-' || c == '+' || c == '.';
+    }
+
+    /// Parse the number at \a p into \a out.  The text need not be NUL
+    /// terminated, so fall back to strtod on a stack copy.
+    const char* parseNumberSlow(const char* p, const char* end, double& out)
+    {
+      char buf[64];
+      size_t n = 0;
+      while (p + n < end && n < sizeof buf - 1
+	     && (startsNumber(p[n]) || p[n] == 'e' || p[n] == 'E'))
+      {
+	buf[n] = p[n];
+	++n;
+      }
+      buf[n] = 0;
+      char* stop;
+      out = strtod(buf, &stop);
+      if (stop == buf)
+	return 0;
+      return p + (stop - buf);
+    }
+
+    /// Plain decimals such as the server prints, "-12.500000", are
+    /// converted exactly without strtod: with at most 15 significant
+    /// digits both the mantissa and the power of ten are exact doubles,
+    /// so a single division rounds correctly (Clinger's fast path).
+    const char* parseNumber(const char* p, const char* end, double& out)
+    {
+      static const double pow10[] =
+	{
+	  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+      const char* q = p;
+      bool negative = false;
+      if (q < end && (*q == '-' || *q == '+'))
+	negative = *q++ == '-';
+      unsigned long long mantissa = 0;
+      int digits = 0;
+      int scale = 0;
+      const char* start = q;
+      for (; q < end && '0' <= *q && *q <= '9'; ++q, ++digits)
+	mantissa = mantissa * 10 + (*q - '0');
+      bool integer = q != start;
+      if (q < end && *q == '.')
+	for (start = ++q; q < end && '0' <= *q && *q <= '9'; ++q, ++digits)
+	{
+	  mantissa = mantissa * 10 + (*q - '0');
+	  ++scale;
+	}
+      if ((!integer && q == start) || digits > 15 || scale > 22
+	  || (q < end && (*q == 'e' || *q == 'E')))
+	return parseNumberSlow(p, end, out);
+      out = static_cast<double>(mantissa) / pow10[scale];
+      if (negative)
+	out = -out;
+      return q;
+    }
+
+    const std::string& emptyString()
+    {
+      static const std::string res;
+      return res;
+    }
+  }
+
+  UrbiValue::UrbiValue()
+    : type_(VALUE_VOID), number_(0)
+  {}
+
+  UrbiValue::UrbiValue(double d)
+    : type_(VALUE_DOUBLE), number_(d)
+  {}
+
+  UrbiValue::UrbiValue(const std::string& s)
+    : type_(VALUE_STRING)
+  {
+    new (&string_) std::string(s);
+  }
+
+  UrbiValue::UrbiValue(const std::vector<double>& numbers)
+    : type_(VALUE_NUMBERS)
+  {
+    new (&numbers_) std::vector<double>(numbers);
+  }
+
+  UrbiValue::UrbiValue(const UrbiValue& v)
+    : type_(VALUE_VOID)
+  {
+    copy(v);
+  }
+
+  UrbiValue::UrbiValue(UrbiValue&& v) noexcept
+    : type_(VALUE_VOID)
+  {
+    move(v);
+  }
+
+  UrbiValue::~UrbiValue()
+  {
+    destroy();
+  }
+
+  UrbiValue&
+  UrbiValue::operator=(const UrbiValue& v)
+  {
+    if (this != &v)
+      copy(v);
+    return *this;
+  }
+
+  UrbiValue&
+  UrbiValue::operator=(UrbiValue&& v) noexcept
+  {
+    if (this != &v)
+      move(v);
+    return *this;
+  }
+
+  UrbiValue&
+  UrbiValue::operator=(double d)
+  {
+    reset(VALUE_DOUBLE);
+    number_ = d;
+    return *this;
+  }
+
+  UrbiValue&
+  UrbiValue::operator=(const std::string& s)
+  {
+    reset(VALUE_STRING);
+    string_ = s;
+    return *this;
+  }
+
+  void
+  UrbiValue::destroy() noexcept
+  {
+    switch (type_)
+    {
+    case VALUE_STRING:
+      string_.~basic_string();
+      break;
+    case VALUE_LIST:
+      list_.~vector();
+      break;
+    case VALUE_NUMBERS:
+      numbers_.~vector();
+      break;
+    default:
+      break;
+    }
+    type_ = VALUE_VOID;
+  }
+
+  void
+  UrbiValue::reset(ValueType t) noexcept
+  {
+    if (type_ == t)
+    {
+      clear();
+      return;
+    }
+    destroy();
+    switch (t)
+    {
+    case VALUE_STRING:
+      new (&string_) std::string();
+      break;
+    case VALUE_LIST:
+      new (&list_) std::vector<UrbiValue>();
+      break;
+    case VALUE_NUMBERS:
+      new (&numbers_) std::vector<double>();
+      break;
+    default:
+      break;
+    }
+    type_ = t;
+  }
+
+  void
+  UrbiValue::clear()
+  {
+    switch (type_)
+    {
+    case VALUE_STRING:
+      string_.clear();
+      break;
+    case VALUE_LIST:
+      list_.clear();
+      break;
+    case VALUE_NUMBERS:
+      numbers_.clear();
+      break;
+    default:
+      number_ = 0;
+      break;
+    }
+  }
+
+  void
+  UrbiValue::copy(const UrbiValue& v)
+  {
+    // Only a list holds values; reset() would free \a v if it is one of
+    // its elements.
+    if (type_ == VALUE_LIST)
+    {
+      UrbiValue tmp(v);
+      move(tmp);
+      return;
+    }
+    reset(v.type_);
+    switch (v.type_)
+    {
+    case VALUE_DOUBLE:
+      number_ = v.number_;
+      break;
+    case VALUE_STRING:
+      string_ = v.string_;
+      break;
+    case VALUE_BINARY:
+      binary_ = v.binary_;
+      break;
+    case VALUE_LIST:
+      list_ = v.list_;
+      break;
+    case VALUE_NUMBERS:
+      numbers_ = v.numbers_;
+      break;
+    case VALUE_VOID:
+      break;
+    }
+  }
+
+  void
+  UrbiValue::move(UrbiValue& v) noexcept
+  {
+    if (type_ == VALUE_LIST)
+    {
+      UrbiValue tmp;
+      tmp.move(v);
+      destroy();
+      move(tmp);
+      return;
+    }
+    reset(v.type_);
+    switch (v.type_)
+    {
+    case VALUE_DOUBLE:
+      number_ = v.number_;
+      break;
+    case VALUE_STRING:
+      string_.swap(v.string_);
+      break;
+    case VALUE_BINARY:
+      binary_ = v.binary_;
+      break;
+    case VALUE_LIST:
+      list_.swap(v.list_);
+      break;
+    case VALUE_NUMBERS:
+      numbers_.swap(v.numbers_);
+      break;
+    case VALUE_VOID:
+      break;
+    }
+    v.destroy();
+  }
+
+  const std::string&
+  UrbiValue::string() const
+  {
+    return type_ == VALUE_STRING ? string_ : emptyString();
+  }
+
+  StringRef
+  UrbiValue::header() const
+  {
+    if (type_ != VALUE_BINARY)
+      return StringRef();
+    return StringRef(binary_.header, binary_.headerSize);
+  }
+
+  StringRef
+  UrbiValue::data() const
+  {
+    if (type_ != VALUE_BINARY)
+      return StringRef();
+    return StringRef(binary_.data, binary_.dataSize);
+  }
+
+  size_t
+  UrbiValue::size() const
+  {
+    switch (type_)
+    {
+    case VALUE_LIST:
+      return list_.size();
+    case VALUE_NUMBERS:
+      return numbers_.size();
+    default:
+      return 0;
+    }
+  }
+
+  const double*
+  UrbiValue::numbers() const
+  {
+    return type_ == VALUE_NUMBERS ? numbers_.data() : 0;
+  }
+
+  const std::vector<UrbiValue>&
+  UrbiValue::list() const
+  {
+    static const std::vector<UrbiValue> empty;
+    return type_ == VALUE_LIST ? list_ : empty;
+  }
+
+  bool
+  UrbiValue::toNumbers(std::vector<double>& out) const
+  {
+    out.clear();
+    switch (type_)
+    {
+    case VALUE_DOUBLE:
+      out.push_back(number_);
+      return true;
+    case VALUE_NUMBERS:
+      out.assign(numbers_.begin(), numbers_.end());
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  bool
+  UrbiValue::parse(const StringRef& text)
+  {
+    const char* end = text.end();
+    const char* p = parse(text.begin(), end);
+    if (p && skipSpaces(p, end) == end)
+      return true;
+    destroy();
+    return false;
+  }
+
+  const char*
+  UrbiValue::parse(const char* begin, const char* end)
+  {
+    const char* p = parseValue(skipSpaces(begin, end), end, 0);
+    if (!p)
+      destroy();
+    return p;
+  }
+
+  const char*
+  UrbiValue::parseValue(const char* p, const char* end, int depth)
+  {
+    if (p == end)
+    {
+      reset(VALUE_VOID);
+      return p;
+    }
+    if (depth > MAX_DEPTH)
+      return 0;
+
+    if (startsNumber(*p))
+    {
+      double d;
+      p = parseNumber(p, end, d);
+      if (p)
+	*this = d;
+      return p;
+    }
+
+    if (*p == '"')
+    {
+      reset(VALUE_STRING);
+      for (++p; p < end; ++p)
+      {
+	if (*p == '"')
+	  return p + 1;
+	if (*p == '\\' && p + 1 < end)
+	{
+	  ++p;
+	  switch (*p)
+	  {
+	  case 'n': string_ += '\n'; break;
+	  case 't': string_ += '\t'; break;
+	  default: string_ += *p; break;
+	  }
+	}
+	else
+	  string_ += *p;
+      }
+      return 0;
+    }
+
+    if (*p == '[')
+      return parseList(p + 1, end, depth + 1);
+
+    if (end - p > 4 && !memcmp(p, "BIN ", 4))
+    {
+      // BIN <size> <header>\n<size bytes>
+      char buf[24];
+      size_t n = 0;
+      for (const char* q = p + 4; q < end && n < sizeof buf - 1
+	     && '0' <= *q && *q <= '9'; ++q)
+	buf[n++] = *q;
+      buf[n] = 0;
+      if (!n)
+	return 0;
+      size_t size = strtoul(buf, 0, 10);
+      const char* h = skipSpaces(p + 4 + n, end);
+      const char* nl = static_cast<const char*>(memchr(h, '\n', end - h));
+      if (!nl || size_t(end - nl - 1) < size)
+	return 0;
+      reset(VALUE_BINARY);
+      binary_.header = h;
+      binary_.headerSize = nl - h;
+      binary_.data = nl + 1;
+      binary_.dataSize = size;
+      return nl + 1 + size;
+    }
+    return 0;
+  }
+
+  const char*
+  UrbiValue::parseList(const char* p, const char* end, int depth)
+  {
+    // A list of values is parsed into its own elements, so that their
+    // storage is reused.  Anything else optimistically stores numbers
+    // densely, and falls back to a list of values at the first element
+    // that is not a number.
+    if (type_ != VALUE_LIST)
+      reset(VALUE_NUMBERS);
+    size_t n = 0;
+    bool numbers = true;
+    for (p = skipSpaces(p, end); ; )
+    {
+      if (p == end)
+	return 0;
+      if (*p == ']')
+      {
+	++p;
+	break;
+      }
+      if (type_ == VALUE_NUMBERS && startsNumber(*p))
+      {
+	double d;
+	p = parseNumber(p, end, d);
+	if (!p)
+	  return 0;
+	numbers_.push_back(d);
+      }
+      else
+      {
+	if (type_ == VALUE_NUMBERS)
+	{
+	  std::vector<double> numbers;
+	  numbers.swap(numbers_);
+	  reset(VALUE_LIST);
+	  list_.reserve(numbers.size() + 1);
+	  for (size_t i = 0; i < numbers.size(); ++i)
+	    list_.push_back(UrbiValue(numbers[i]));
+	  n = list_.size();
+	}
+	if (n == list_.size())
+	  list_.push_back(UrbiValue());
+	UrbiValue& e = list_[n++];
+	p = e.parseValue(p, end, depth);
+	if (!p)
+	  return 0;
+	numbers &= e.type_ == VALUE_DOUBLE;
+      }
+      p = skipSpaces(p, end);
+      if (p < end && *p == ',')
+	p = skipSpaces(p + 1, end);
+      else if (p < end && *p != ']')
+	return 0;
+    }
+
+    if (type_ == VALUE_LIST)
+    {
+      list_.erase(list_.begin() + n, list_.end());
+      // Reused for a list that turned out to hold numbers only.
+      if (numbers)
+      {
+	std::vector<double> dense(n);
+	for (size_t i = 0; i < n; ++i)
+	  dense[i] = list_[i].number_;
+	reset(VALUE_NUMBERS);
+	numbers_.swap(dense);
+      }
+    }
+    return p;
+  }
+
+  std::ostream&
+  UrbiValue::print(std::ostream& s) const
+  {
+    switch (type_)
+    {
+    case VALUE_VOID:
+      break;
+    case VALUE_DOUBLE:
+      s << number_;
+      break;
+    case VALUE_STRING:
+      s << '"' << string_ << '"';
+      break;
+    case VALUE_BINARY:
+      s << "BIN " << binary_.dataSize << ' ' << header();
+      break;
+    case VALUE_LIST:
+      s << '[';
+      for (size_t i = 0; i < list_.size(); ++i)
+	list_[i].print(i ? s << ", " : s);
+      s << ']';
+      break;
+    case VALUE_NUMBERS:
+      s << '[';
+      for (size_t i = 0; i < numbers_.size(); ++i)
+	(i ? s << ", " : s) << numbers_[i];
+      s << ']';
+      break;
+    }
+    return s;
+  }
+
+  std::ostream&
+  operator<<(std::ostream& s, const UrbiValue& v)
+  {
+    return v.print(s);
+  }
+
+} // namespace aibo
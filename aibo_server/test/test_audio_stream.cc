@@ -0,0 +1,271 @@
+/// \file test/test_audio_stream.cc
+/// \brief SpscRing wraparound and MicrophoneStream chunking.
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "aibo_server/audio_stream.hh"
+#include "aibo_server/spsc_ring.hh"
+#include "aibo_server/urbi_stream_parser.hh"
+
+namespace
+{
+  /// Byte \a i of the captured audio.
+  uint8_t sample(size_t i)
+  {
+    return static_cast<uint8_t>(i * 7 % 251);
+  }
+
+  /// Chunks published by a MicrophoneStream, copied out of the callback.
+  class Chunks
+  {
+  public:
+    void add(const aibo::AudioChunk& c)
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      chunks_.push_back(c);
+      data_.push_back(std::vector<uint8_t>(c.data, c.data + c.size));
+    }
+
+    size_t size() const
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      return chunks_.size();
+    }
+
+    /// Wait until at least \a n chunks arrived, for at most a second.
+    bool wait(size_t n) const
+    {
+      for (int i = 0; i < 100 && size() < n; ++i)
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      return size() >= n;
+    }
+
+    aibo::AudioChunk chunk(size_t i) const
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      return chunks_[i];
+    }
+
+    std::vector<uint8_t> data(size_t i) const
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      return data_[i];
+    }
+
+  private:
+    mutable std::mutex lock_;
+    std::vector<aibo::AudioChunk> chunks_;
+    std::vector<std::vector<uint8_t> > data_;
+  };
+
+  /// A micro.val message holding \a data, stamped \a timestamp.
+  std::string binary(int timestamp, const std::string& header,
+		     const std::string& data, const char* tag = "aibo_micro")
+  {
+    char buf[128];
+    snprintf(buf, sizeof buf, "[%08d:%s] BIN %zu %s\n", timestamp, tag,
+	     data.size(), header.c_str());
+    return buf + data + "\n";
+  }
+
+  /// The next \a n bytes of the captured audio, from \a pos on.
+  std::string audio(size_t& pos, size_t n)
+  {
+    std::string s;
+    for (size_t i = 0; i < n; ++i)
+      s += static_cast<char>(sample(pos++));
+    return s;
+  }
+
+  void feed(aibo::MicrophoneStream& stream, const std::string& s)
+  {
+    aibo::UrbiStreamParser parser;
+    parser.feed(s.data(), s.size());
+    parser.parse(stream);
+  }
+}
+
+TEST(SpscRing, CapacityIsAPowerOfTwo)
+{
+  EXPECT_EQ(8u, aibo::SpscRing<int>(5).capacity());
+  EXPECT_EQ(8u, aibo::SpscRing<int>(8).capacity());
+  EXPECT_EQ(1u, aibo::SpscRing<int>(1).capacity());
+}
+
+TEST(SpscRing, AllOrNothing)
+{
+  aibo::SpscRing<int> ring(4);
+  int in[] = { 1, 2, 3, 4, 5 };
+  int out[5] = { 0 };
+  EXPECT_FALSE(ring.pop(out, 1));
+  EXPECT_EQ(0, ring.front());
+  EXPECT_FALSE(ring.push(in, 5));
+  EXPECT_TRUE(ring.empty());
+  EXPECT_TRUE(ring.push(in, 3));
+  EXPECT_FALSE(ring.push(in, 2));
+  EXPECT_EQ(3u, ring.size());
+  EXPECT_FALSE(ring.pop(out, 4));
+  EXPECT_EQ(3u, ring.size());
+  EXPECT_TRUE(ring.pop(out, 3));
+  EXPECT_EQ(3, out[2]);
+  EXPECT_EQ(3u, ring.popped());
+}
+
+TEST(SpscRing, Wraparound)
+{
+  // Push and pop sizes that are prime to the capacity, so that copies
+  // split at the end of the buffer at every offset.
+  aibo::SpscRing<uint8_t> ring(16);
+  std::vector<uint8_t> in(16), out(16);
+  size_t pushed = 0, popped = 0;
+  for (int round = 0; round < 200; ++round)
+  {
+    size_t n = 1 + round % 7;
+    while (ring.capacity() - ring.size() >= n)
+    {
+      for (size_t i = 0; i < n; ++i)
+	in[i] = sample(pushed + i);
+      ASSERT_TRUE(ring.push(in.data(), n));
+      pushed += n;
+    }
+    size_t m = 1 + round % 5;
+    while (ring.size() >= m)
+    {
+      ASSERT_TRUE(ring.pop(out.data(), m));
+      for (size_t i = 0; i < m; ++i)
+	ASSERT_EQ(sample(popped + i), out[i]) << "byte " << popped + i;
+      popped += m;
+    }
+    ASSERT_EQ(popped, ring.popped());
+    ASSERT_EQ(pushed - popped, ring.size());
+  }
+  EXPECT_GT(popped, 10 * ring.capacity());
+}
+
+TEST(SpscRing, FrontAndDrop)
+{
+  aibo::SpscRing<int> ring(4);
+  for (int i = 0; i < 10; ++i)
+  {
+    ASSERT_TRUE(ring.push(&i, 1));
+    ASSERT_EQ(i, *ring.front());
+    ring.drop(1);
+  }
+  EXPECT_EQ(10u, ring.popped());
+  int in[] = { 1, 2 };
+  ring.push(in, 2);
+  ring.drop(5);
+  EXPECT_TRUE(ring.empty());
+  EXPECT_EQ(12u, ring.popped());
+}
+
+TEST(MicrophoneStream, ChunksSpanBinaries)
+{
+  aibo::UrbiConnection none("localhost");
+  aibo::MicrophoneConfig config;
+  config.chunkBytes = 258;	// Rounded down to 256.
+  aibo::MicrophoneStream stream(none, config);
+  Chunks chunks;
+  stream.setCallback([&chunks] (const aibo::AudioChunk& c)
+		     {
+		       chunks.add(c);
+		     });
+
+  // 768 bytes: three chunks, completed by the 2nd, 4th and 4th binary.
+  size_t pos = 0;
+  std::string s;
+  s += binary(1, "raw 2 16000 16 1", audio(pos, 100));
+  s += binary(2, "raw 2 16000 16 1", audio(pos, 300));
+  s += binary(3, "raw 2 16000 16 1", audio(pos, 50));
+  s += binary(4, "raw 1 8000 16 1", audio(pos, 318));
+  // Not ours, and not sound.
+  s += binary(5, "raw 2 16000 16 1", "xxxx", "other");
+  s += binary(6, "jpeg 208 160", "yyyy");
+  feed(stream, s);
+
+  ASSERT_TRUE(chunks.wait(3));
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  ASSERT_EQ(3u, chunks.size());
+  const int timestamps[] = { 2, 4, 4 };
+  for (size_t c = 0; c < 3; ++c)
+  {
+    aibo::AudioChunk chunk = chunks.chunk(c);
+    EXPECT_EQ(c, chunk.seq);
+    EXPECT_EQ(timestamps[c], chunk.timestamp);
+    std::vector<uint8_t> data = chunks.data(c);
+    ASSERT_EQ(256u, data.size());
+    for (size_t i = 0; i < data.size(); ++i)
+      ASSERT_EQ(sample(c * 256 + i), data[i]) << "chunk " << c << " byte " << i;
+  }
+  EXPECT_EQ(2u, chunks.chunk(0).format.channels);
+  EXPECT_EQ(1u, chunks.chunk(2).format.channels);
+  EXPECT_EQ(8000u, chunks.chunk(2).format.rate);
+
+  const aibo::MicrophoneStats& stats = stream.stats();
+  EXPECT_EQ(5u, stats.received);
+  EXPECT_EQ(3u, stats.published);
+  EXPECT_EQ(1u, stats.errors);
+  EXPECT_EQ(0u, stats.overruns);
+}
+
+TEST(MicrophoneStream, SkipsTheWavHeader)
+{
+  aibo::UrbiConnection none("localhost");
+  aibo::MicrophoneConfig config;
+  config.chunkBytes = 64;
+  aibo::MicrophoneStream stream(none, config);
+  Chunks chunks;
+  stream.setCallback([&chunks] (const aibo::AudioChunk& c)
+		     {
+		       chunks.add(c);
+		     });
+  size_t pos = 0;
+  std::string wav = "RIFF" + std::string(40, '\0');
+  feed(stream, binary(1, "wav 2 16000 16 1", wav + audio(pos, 64)));
+  ASSERT_TRUE(chunks.wait(1));
+  std::vector<uint8_t> data = chunks.data(0);
+  ASSERT_EQ(64u, data.size());
+  for (size_t i = 0; i < data.size(); ++i)
+    ASSERT_EQ(sample(i), data[i]);
+}
+
+TEST(MicrophoneStream, CountsOverruns)
+{
+  // The ring holds two chunks, 512 bytes: a larger binary never fits.
+  aibo::UrbiConnection none("localhost");
+  aibo::MicrophoneConfig config;
+  config.chunkBytes = 256;
+  config.ringBytes = 0;
+  aibo::MicrophoneStream stream(none, config);
+  Chunks chunks;
+  stream.setCallback([&chunks] (const aibo::AudioChunk& c)
+		     {
+		       chunks.add(c);
+		     });
+  size_t pos = 0;
+  std::string big = audio(pos, 600);
+  pos = 0;
+  std::string s = binary(1, "raw 2 16000 16 1", big);
+  s += binary(2, "raw 2 16000 16 1", audio(pos, 256));
+  feed(stream, s);
+  ASSERT_TRUE(chunks.wait(1));
+  EXPECT_EQ(2u, stream.stats().received);
+  EXPECT_EQ(1u, stream.stats().overruns);
+  EXPECT_EQ(2, chunks.chunk(0).timestamp);
+  EXPECT_EQ(sample(0), chunks.data(0)[0]);
+}
+
+TEST(MicrophoneStream, StartNeedsAConnection)
+{
+  aibo::UrbiConnection none("localhost");
+  aibo::MicrophoneStream stream(none, aibo::MicrophoneConfig());
+  EXPECT_EQ(-1, stream.start());
+  EXPECT_EQ(-1, stream.stop());
+}
@@ -0,0 +1,146 @@
+/// \file test/test_callback_table.cc
+/// \brief Dispatch order, URBI_REMOVE, and changes made while dispatching.
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "aibo_server/callback_table.hh"
+
+namespace
+{
+  /// Parse \a s and dispatch every message it holds to \a table.
+  void dispatch(aibo::CallbackTable& table, const std::string& s)
+  {
+    aibo::UrbiStreamParser parser;
+    ASSERT_TRUE(parser.feed(s.data(), s.size()));
+    parser.parse(table);
+  }
+
+  /// A callback appending \a name to \a log and returning \a action.
+  aibo::CallbackTable::Callback
+  logger(std::vector<std::string>& log, const std::string& name,
+	 aibo::CallbackAction action = aibo::URBI_CONTINUE)
+  {
+    return [&log, name, action] (const aibo::UrbiMessageView&)
+      {
+	log.push_back(name);
+	return action;
+      };
+  }
+}
+
+TEST(CallbackTable, TagThenErrorThenWildcard)
+{
+  aibo::CallbackTable table;
+  std::vector<std::string> log;
+  table.add(aibo::CallbackTable::WILDCARD_TAG, logger(log, "any"));
+  table.add(aibo::CallbackTable::ERROR_TAG, logger(log, "error"));
+  table.add("a", logger(log, "a1"));
+  table.add("b", logger(log, "b"));
+  table.add("a", logger(log, "a2"));
+  dispatch(table, "[00000001:a] 1\n[00000002:a] !!! oops\n[00000003:c] 1\n");
+  const char* expected[] = { "a1", "a2", "any",
+			     "a1", "a2", "error", "any",
+			     "any" };
+  EXPECT_EQ(std::vector<std::string>(expected, expected + 8), log);
+}
+
+TEST(CallbackTable, RemoveReturnValueUnregisters)
+{
+  aibo::CallbackTable table;
+  std::vector<std::string> log;
+  // The callback owns this; it must be freed once the callback is.
+  std::shared_ptr<int> owned(new int(0));
+  std::weak_ptr<int> watch(owned);
+  table.add("a", [&log, owned] (const aibo::UrbiMessageView&)
+	    {
+	      log.push_back("once");
+	      return aibo::URBI_REMOVE;
+	    });
+  owned.reset();
+  table.add("a", logger(log, "keep"));
+  ASSERT_EQ(2u, table.size());
+
+  dispatch(table, "[00000001:a] 1\n[00000002:a] 2\n");
+  const char* expected[] = { "once", "keep", "keep" };
+  EXPECT_EQ(std::vector<std::string>(expected, expected + 3), log);
+  EXPECT_EQ(1u, table.size());
+  EXPECT_TRUE(watch.expired());
+}
+
+TEST(CallbackTable, RemoveDuringDispatch)
+{
+  aibo::CallbackTable table;
+  std::vector<std::string> log;
+  aibo::CallbackId later = 0;
+  // Removes a callback of the same tag that has not run yet for this
+  // message: it must not run.
+  table.add("a", [&] (const aibo::UrbiMessageView&)
+	    {
+	      log.push_back("remover");
+	      EXPECT_TRUE(!later || table.remove(later));
+	      later = 0;
+	      return aibo::URBI_CONTINUE;
+	    });
+  later = table.add("a", logger(log, "removed"));
+  table.add(aibo::CallbackTable::WILDCARD_TAG, logger(log, "any"));
+
+  dispatch(table, "[00000001:a] 1\n[00000002:a] 2\n");
+  const char* expected[] = { "remover", "any", "remover", "any" };
+  EXPECT_EQ(std::vector<std::string>(expected, expected + 4), log);
+  EXPECT_EQ(2u, table.size());
+}
+
+TEST(CallbackTable, RemoveSelfAndAddDuringDispatch)
+{
+  aibo::CallbackTable table;
+  std::vector<std::string> log;
+  aibo::CallbackId self = 0;
+  // Removes itself and registers a replacement, which only sees the
+  // messages dispatched after it was added.
+  self = table.add("a", [&] (const aibo::UrbiMessageView&)
+		   {
+		     log.push_back("first");
+		     EXPECT_TRUE(table.remove(self));
+		     table.add("a", logger(log, "second"));
+		     return aibo::URBI_CONTINUE;
+		   });
+  dispatch(table, "[00000001:a] 1\n[00000002:a] 2\n[00000003:a] 3\n");
+  const char* expected[] = { "first", "second", "second" };
+  EXPECT_EQ(std::vector<std::string>(expected, expected + 3), log);
+  EXPECT_EQ(1u, table.size());
+}
+
+TEST(CallbackTable, RemoveTagAndHandlers)
+{
+  aibo::CallbackTable table;
+  std::vector<std::string> log;
+  table.add("a", logger(log, "a1"));
+  table.add("a", logger(log, "a2"));
+  aibo::CallbackId b = table.add("b", logger(log, "b"));
+  EXPECT_EQ(2u, table.removeTag("a"));
+  EXPECT_EQ(0u, table.removeTag("a"));
+  EXPECT_TRUE(table.remove(b));
+  EXPECT_FALSE(table.remove(b));
+  dispatch(table, "[00000001:a] 1\n[00000002:b] 2\n");
+  EXPECT_TRUE(log.empty());
+
+  // A handler registration forwards the message as is.
+  struct Texts: public aibo::UrbiMessageHandler
+  {
+    virtual void onMessage(const aibo::UrbiMessageView& msg)
+    {
+      texts.push_back(msg.text.str());
+    }
+    std::vector<std::string> texts;
+  } texts;
+  table.add("c", texts);
+  dispatch(table, "[00000001:c] [1, 2]\n[00000002:d] 3\n");
+  ASSERT_EQ(1u, texts.texts.size());
+  EXPECT_EQ("[1, 2]", texts.texts[0]);
+  table.clear();
+  EXPECT_EQ(0u, table.size());
+}
@@ -0,0 +1,94 @@
+/// \file test/test_image_conversion.cc
+/// \brief The vector conversion matches the scalar one bit for bit.
+
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <vector>
+
+#include "aibo_server/image_conversion.hh"
+
+namespace
+{
+  /// Convert \a src both ways and compare, with a guard byte past the
+  /// end to catch stores beyond the last pixel.
+  void expectSame(const std::vector<uint8_t>& src)
+  {
+    size_t pixels = src.size() / 3;
+    std::vector<uint8_t> fast(src.size() + 1, 0xa5);
+    std::vector<uint8_t> slow(src.size() + 1, 0xa5);
+    aibo::ycrcbToRgb(src.data(), fast.data(), pixels);
+    aibo::ycrcbToRgbScalar(src.data(), slow.data(), pixels);
+    ASSERT_TRUE(fast == slow) << pixels << " pixels";
+  }
+}
+
+TEST(ImageConversion, EveryLength)
+{
+  // Lengths around the vector block size exercise the scalar tail.
+  srand(1);
+  for (size_t pixels = 0; pixels < 100; ++pixels)
+  {
+    std::vector<uint8_t> src(3 * pixels);
+    for (size_t i = 0; i < src.size(); ++i)
+      src[i] = rand();
+    expectSame(src);
+  }
+}
+
+TEST(ImageConversion, EveryTriplet)
+{
+  // Each Y at the extremes of Cr and Cb, and each Cr, Cb pair at the
+  // extremes of Y, so that clamping happens on both sides.
+  const int edges[] = { 0, 1, 127, 128, 129, 254, 255 };
+  std::vector<uint8_t> src;
+  for (int v = 0; v < 256; ++v)
+    for (size_t i = 0; i < sizeof edges / sizeof *edges; ++i)
+      for (size_t j = 0; j < sizeof edges / sizeof *edges; ++j)
+      {
+	uint8_t t[] = {
+	  uint8_t(v), uint8_t(edges[i]), uint8_t(edges[j]),
+	  uint8_t(edges[i]), uint8_t(v), uint8_t(edges[j]),
+	  uint8_t(edges[i]), uint8_t(edges[j]), uint8_t(v),
+	};
+	src.insert(src.end(), t, t + sizeof t);
+      }
+  expectSame(src);
+}
+
+TEST(ImageConversion, KnownColors)
+{
+  const uint8_t src[] = { 0, 128, 128, 255, 128, 128, 76, 255, 85 };
+  uint8_t dst[9];
+  aibo::ycrcbToRgb(src, dst, 3);
+  EXPECT_EQ(0, dst[0]);
+  EXPECT_EQ(0, dst[1]);
+  EXPECT_EQ(0, dst[2]);
+  EXPECT_EQ(255, dst[3]);
+  EXPECT_EQ(255, dst[4]);
+  EXPECT_EQ(255, dst[5]);
+  // Pure red, give or take the fixed point rounding.
+  EXPECT_GE(dst[6], 250);
+  EXPECT_LE(dst[7], 2);
+  EXPECT_LE(dst[8], 2);
+}
+
+TEST(ImageConversion, ImageHeader)
+{
+  aibo::CameraFormat format;
+  size_t width, height;
+  ASSERT_TRUE(aibo::parseImageHeader(aibo::StringRef("jpeg 208 160"),
+				     format, width, height));
+  EXPECT_EQ(aibo::CAMERA_JPEG, format);
+  EXPECT_EQ(208u, width);
+  EXPECT_EQ(160u, height);
+  ASSERT_TRUE(aibo::parseImageHeader(aibo::StringRef("YCbCr 4 2 x"),
+				     format, width, height));
+  EXPECT_EQ(aibo::CAMERA_YCRCB, format);
+  EXPECT_FALSE(aibo::parseImageHeader(aibo::StringRef("png 208 160"),
+				      format, width, height));
+  EXPECT_FALSE(aibo::parseImageHeader(aibo::StringRef("rgb 208"),
+				      format, width, height));
+  EXPECT_FALSE(aibo::parseImageHeader(aibo::StringRef("rgb 99999 160"),
+				      format, width, height));
+}
@@ -0,0 +1,143 @@
+/// \file test/test_joint_stream.cc
+/// \brief JointStream against FakeUrbiServer.
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "aibo_server/fake_urbi_server.hh"
+#include "aibo_server/joint_stream.hh"
+
+namespace
+{
+  /// Samples delivered by a JointStream.
+  class Samples
+  {
+  public:
+    void add(int timestamp, const double* values, size_t count)
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      timestamps_.push_back(timestamp);
+      last_.assign(values, values + count);
+    }
+
+    size_t size() const
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      return timestamps_.size();
+    }
+
+    /// Wait until at least \a n samples arrived, for at most a second.
+    bool wait(size_t n) const
+    {
+      for (int i = 0; i < 100 && size() < n; ++i)
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      return size() >= n;
+    }
+
+    std::vector<int> timestamps() const
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      return timestamps_;
+    }
+
+    std::vector<double> last() const
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      return last_;
+    }
+
+  private:
+    mutable std::mutex lock_;
+    std::vector<int> timestamps_;
+    std::vector<double> last_;
+  };
+}
+
+TEST(JointStream, DeviceNames)
+{
+  EXPECT_EQ("legRH2", aibo::urbiDeviceName("legRB2"));
+  EXPECT_EQ("legLH3", aibo::urbiDeviceName("legLB3"));
+  EXPECT_EQ("legLF1", aibo::urbiDeviceName("legLF1"));
+  EXPECT_EQ("headPan", aibo::urbiDeviceName("headPan"));
+  EXPECT_EQ(17u, aibo::defaultJointNames().size());
+}
+
+TEST(JointStream, Command)
+{
+  std::vector<std::string> joints;
+  joints.push_back("legLB1");
+  joints.push_back("neck");
+  aibo::UrbiConnection none("localhost");
+  aibo::JointStream stream(none, joints, "j");
+  EXPECT_EQ("j_loop: loop { j: [legLH1.val, neck.val] },\n",
+	    stream.command(0));
+  EXPECT_EQ("j_loop: every(64ms) { j: [legLH1.val, neck.val] },\n",
+	    stream.command(64));
+}
+
+TEST(JointStream, StreamsEveryJointFromTheServer)
+{
+  aibo::FakeUrbiServer server(0, 2000);
+  server.setDevice("legLH1", 12.5);
+  server.setDevice("tailTilt", -3);
+  ASSERT_EQ(0, server.start());
+
+  aibo::UrbiConnection connection("localhost", server.port());
+  ASSERT_EQ(0, connection.connect()) << connection.errorMessage();
+  const std::vector<std::string>& joints = aibo::defaultJointNames();
+  aibo::JointStream stream(connection, joints);
+  Samples samples;
+  stream.setCallback([&samples] (int t, const double* v, size_t n)
+		     {
+		       samples.add(t, v, n);
+		     });
+  connection.setHandler(&stream);
+  connection.start();
+  ASSERT_EQ(0, stream.start());
+  ASSERT_TRUE(samples.wait(5));
+
+  std::vector<double> last = samples.last();
+  ASSERT_EQ(joints.size(), last.size());
+  EXPECT_DOUBLE_EQ(12.5, last[9]);	// legLB1
+  EXPECT_DOUBLE_EQ(-3, last[16]);	// tailTilt
+  std::vector<int> t = samples.timestamps();
+  for (size_t i = 1; i < t.size(); ++i)
+    EXPECT_LE(t[i - 1], t[i]);
+
+  // Once stopped, no more samples come.
+  ASSERT_EQ(0, stream.stop());
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  size_t stopped = samples.size();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(stopped, samples.size());
+
+  connection.close();
+  server.stop();
+}
+
+TEST(JointStream, IgnoresOtherMessages)
+{
+  std::vector<std::string> joints(2, "neck");
+  aibo::UrbiConnection none("localhost");
+  aibo::JointStream stream(none, joints, "j");
+  Samples samples;
+  stream.setCallback([&samples] (int t, const double* v, size_t n)
+		     {
+		       samples.add(t, v, n);
+		     });
+  aibo::UrbiStreamParser parser;
+  std::string s =
+    "[00000001:other] [1, 2]\n"
+    "[00000002:j] [1, 2, 3]\n"
+    "[00000003:j] !!! error\n"
+    "[00000004:j] [1, \"a\"]\n"
+    "[00000005:j] [1, 2]\n";
+  parser.feed(s.data(), s.size());
+  parser.parse(stream);
+  ASSERT_EQ(1u, samples.size());
+  EXPECT_EQ(5, samples.timestamps()[0]);
+}
@@ -0,0 +1,232 @@
+/// \file test/test_kinematics.cc
+/// \brief The generated kinematics agree with a plain walk down the
+/// joints of each chain.
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <random>
+
+#include "aibo_server/kinematics.hh"
+
+namespace
+{
+  using aibo::JointModel;
+  using aibo::KinematicChain;
+  using aibo::LEG_COUNT;
+  using aibo::LEG_DOF;
+  using aibo::Transform;
+
+  const double EPS = 1e-9;
+
+  /// Origin of \a j in its parent, fixed axes roll, pitch, yaw.
+  Transform origin(const JointModel& j)
+  {
+    double cr = cos(j.rpy[0]), sr = sin(j.rpy[0]);
+    double cp = cos(j.rpy[1]), sp = sin(j.rpy[1]);
+    double cy = cos(j.rpy[2]), sy = sin(j.rpy[2]);
+    Transform t =
+      {
+	{
+	  cy * cp, cy * sp * sr - sy * cr, cy * sp * cr + sy * sr,
+	  sy * cp, sy * sp * sr + cy * cr, sy * sp * cr - cy * sr,
+	  -sp, cp * sr, cp * cr
+	},
+	{j.xyz[0], j.xyz[1], j.xyz[2]}
+      };
+    return t;
+  }
+
+  /// Rotation of \a q about the unit axis of \a j (Rodrigues).
+  Transform rotation(const JointModel& j, double q)
+  {
+    const double* a = j.axis;
+    double c = cos(q), s = sin(q), v = 1 - c;
+    Transform t =
+      {
+	{
+	  a[0] * a[0] * v + c, a[0] * a[1] * v - a[2] * s,
+	  a[0] * a[2] * v + a[1] * s,
+	  a[0] * a[1] * v + a[2] * s, a[1] * a[1] * v + c,
+	  a[1] * a[2] * v - a[0] * s,
+	  a[0] * a[2] * v - a[1] * s, a[1] * a[2] * v + a[0] * s,
+	  a[2] * a[2] * v + c
+	},
+	{0, 0, 0}
+      };
+    return t;
+  }
+
+  /// Tip of \a chain, composing every joint at run time.
+  Transform walk(KinematicChain chain, const double* q)
+  {
+    Transform t = { {1, 0, 0, 0, 1, 0, 0, 0, 1}, {0, 0, 0} };
+    for (unsigned i = 0; i < aibo::chainDof(chain); ++i)
+    {
+      JointModel j = aibo::chainJoint(chain, i);
+      t = aibo::compose(aibo::compose(t, origin(j)), rotation(j, q[i]));
+    }
+    return aibo::compose(t, origin(aibo::chainTipJoint(chain)));
+  }
+
+  /// Column \a i of the Jacobian of walk(), by central differences:
+  /// dp/dq, and the angular velocity w with dR/dq = [w]x R.
+  void walkJacobian(KinematicChain chain, const double* q, unsigned i,
+		    double col[6])
+  {
+    const double h = 1e-6;
+    double qp[8], qm[8];
+    unsigned dof = aibo::chainDof(chain);
+    for (unsigned k = 0; k < dof; ++k)
+      qp[k] = qm[k] = q[k];
+    qp[i] += h;
+    qm[i] -= h;
+    Transform tp = walk(chain, qp), tm = walk(chain, qm), t = walk(chain, q);
+    double dr[9], s[9];
+    for (int k = 0; k < 9; ++k)
+      dr[k] = (tp.r[k] - tm.r[k]) / (2 * h);
+    // s = dR R^T, skew symmetric.
+    for (int r = 0; r < 3; ++r)
+      for (int c = 0; c < 3; ++c)
+	s[3 * r + c] = dr[3 * r] * t.r[3 * c] + dr[3 * r + 1] * t.r[3 * c + 1]
+	  + dr[3 * r + 2] * t.r[3 * c + 2];
+    for (int k = 0; k < 3; ++k)
+      col[k] = (tp.p[k] - tm.p[k]) / (2 * h);
+    col[3] = s[7];
+    col[4] = s[2];
+    col[5] = s[3];
+  }
+
+  void expectNear(const Transform& expected, const Transform& t,
+		  double eps = EPS)
+  {
+    for (int k = 0; k < 9; ++k)
+      EXPECT_NEAR(expected.r[k], t.r[k], eps) << "r[" << k << "]";
+    for (int k = 0; k < 3; ++k)
+      EXPECT_NEAR(expected.p[k], t.p[k], eps) << "p[" << k << "]";
+  }
+
+  /// A configuration within the joint limits of \a chain.
+  void randomConfig(std::mt19937& gen, KinematicChain chain, double* q)
+  {
+    for (unsigned i = 0; i < aibo::chainDof(chain); ++i)
+    {
+      JointModel j = aibo::chainJoint(chain, i);
+      std::uniform_real_distribution<double> d(j.lower, j.upper);
+      q[i] = d(gen);
+    }
+  }
+}
+
+TEST(Kinematics, SinCos)
+{
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<double> d(-1e3, 1e3);
+  for (int n = 0; n < 1000; ++n)
+  {
+    aibo::LegVector x = { d(gen), d(gen), -0.0, 1e-300 };
+    if (n == 0)
+    {
+      x[0] = M_PI;
+      x[1] = -M_PI / 2;
+    }
+    aibo::LegVector s, c;
+    aibo::sinCos(x, s, c);
+    for (int l = 0; l < LEG_COUNT; ++l)
+    {
+      ASSERT_NEAR(std::sin(x[l]), s[l], 1e-15) << x[l];
+      ASSERT_NEAR(std::cos(x[l]), c[l], 1e-15) << x[l];
+    }
+  }
+}
+
+TEST(Kinematics, ChainsMatchTheWalk)
+{
+  std::mt19937 gen(2);
+  for (int c = 0; c < aibo::CHAIN_COUNT; ++c)
+  {
+    KinematicChain chain = KinematicChain(c);
+    unsigned dof = aibo::chainDof(chain);
+    ASSERT_LE(dof, 8u);
+    for (int n = 0; n < 100; ++n)
+    {
+      double q[8];
+      randomConfig(gen, chain, q);
+      Transform expected = walk(chain, q);
+      Transform tip;
+      aibo::forward(chain, q, tip);
+      expectNear(expected, tip);
+
+      double jac[6 * 8];
+      aibo::jacobian(chain, q, tip, jac);
+      expectNear(expected, tip);
+      for (unsigned i = 0; i < dof; ++i)
+      {
+	double col[6];
+	walkJacobian(chain, q, i, col);
+	for (int k = 0; k < 6; ++k)
+	  ASSERT_NEAR(col[k], jac[k * dof + i], 1e-7)
+	    << "chain " << c << " row " << k << " joint " << i;
+      }
+    }
+  }
+}
+
+TEST(Kinematics, LegsMatchTheWalk)
+{
+  std::mt19937 gen(3);
+  for (int n = 0; n < 200; ++n)
+  {
+    double q[LEG_COUNT][LEG_DOF];
+    for (int l = 0; l < LEG_COUNT; ++l)
+    {
+      ASSERT_EQ(unsigned(LEG_DOF), aibo::chainDof(KinematicChain(l)));
+      randomConfig(gen, KinematicChain(l), q[l]);
+    }
+    // Beyond the limits too: the vector sine has its own reduction.
+    if (n % 10 == 0)
+      q[n / 10 % LEG_COUNT][0] += 40 * M_PI;
+
+    Transform tips[LEG_COUNT], jtips[LEG_COUNT];
+    double jac[LEG_COUNT][6 * LEG_DOF];
+    aibo::forwardLegs(q, tips);
+    aibo::jacobianLegs(q, jtips, jac);
+    for (int l = 0; l < LEG_COUNT; ++l)
+    {
+      KinematicChain chain = KinematicChain(l);
+      Transform expected = walk(chain, q[l]);
+      expectNear(expected, tips[l]);
+      expectNear(expected, jtips[l]);
+      double scalar[6 * LEG_DOF];
+      Transform tip;
+      aibo::jacobian(chain, q[l], tip, scalar);
+      for (int k = 0; k < 6 * LEG_DOF; ++k)
+	ASSERT_NEAR(scalar[k], jac[l][k], EPS) << "leg " << l << " entry " << k;
+      for (unsigned i = 0; i < unsigned(LEG_DOF); ++i)
+      {
+	double col[6];
+	walkJacobian(chain, q[l], i, col);
+	for (int k = 0; k < 6; ++k)
+	  ASSERT_NEAR(col[k], jac[l][k * LEG_DOF + i], 1e-7)
+	    << "leg " << l << " row " << k << " joint " << i;
+      }
+    }
+  }
+}
+
+TEST(Kinematics, FindJoint)
+{
+  for (int c = 0; c < aibo::CHAIN_COUNT; ++c)
+    for (unsigned i = 0; i < aibo::chainDof(KinematicChain(c)); ++i)
+    {
+      KinematicChain chain;
+      unsigned index;
+      ASSERT_TRUE(aibo::findJoint(aibo::chainJoint(KinematicChain(c), i).name,
+				  chain, index));
+      EXPECT_EQ(c, chain);
+      EXPECT_EQ(i, index);
+    }
+  KinematicChain chain;
+  unsigned index;
+  EXPECT_FALSE(aibo::findJoint("no_such_joint", chain, index));
+}
@@ -0,0 +1,235 @@
+/// \file test/test_request_pipeline.cc
+/// \brief RequestPipeline against FakeUrbiServer.
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "aibo_server/fake_urbi_server.hh"
+#include "aibo_server/request_pipeline.hh"
+
+namespace
+{
+  /// Tags of the messages the pipeline passed on.
+  class Forwarded: public aibo::UrbiMessageHandler
+  {
+  public:
+    virtual void onMessage(const aibo::UrbiMessageView& msg)
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      tags_.push_back(msg.tag.str());
+    }
+
+    bool has(const std::string& tag) const
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      for (size_t i = 0; i < tags_.size(); ++i)
+	if (tags_[i] == tag)
+	  return true;
+      return false;
+    }
+
+  private:
+    mutable std::mutex lock_;
+    std::vector<std::string> tags_;
+  };
+
+  /// A fake robot with two joints set, listening on a free port.
+  struct Server: public aibo::FakeUrbiServer
+  {
+    explicit Server(unsigned linkDelayUs)
+      : aibo::FakeUrbiServer(0, 2000)
+    {
+      setDevice("legLF1", 1.5);
+      setDevice("legRF1", -2);
+      setLinkDelay(linkDelayUs);
+      started = !start();
+    }
+
+    bool started;
+  };
+
+  /// A server, a connection to it, and a pipeline installed on it.
+  struct Fixture
+  {
+    explicit Fixture(unsigned linkDelayUs = 0)
+      : server(linkDelayUs),
+	connection("localhost", server.port()),
+	pipeline(connection, &forwarded)
+    {}
+
+    ~Fixture()
+    {
+      connection.close();
+      server.stop();
+    }
+
+    bool start()
+    {
+      if (!server.started || connection.connect())
+	return false;
+      connection.setHandler(&pipeline);
+      connection.start();
+      return true;
+    }
+
+    Server server;
+    aibo::UrbiConnection connection;
+    Forwarded forwarded;
+    aibo::RequestPipeline pipeline;
+  };
+
+  bool ready(std::future<aibo::UrbiMessage>& f, double seconds = 1)
+  {
+    return f.wait_for(std::chrono::duration<double>(seconds))
+      == std::future_status::ready;
+  }
+}
+
+TEST(RequestPipeline, RepliesMatchTheirTags)
+{
+  Fixture f;
+  ASSERT_TRUE(f.start());
+  EXPECT_EQ("aibo_req_7", f.pipeline.tag(7));
+
+  std::vector<std::string> exprs;
+  exprs.push_back("legRF1.val");
+  exprs.push_back("legLF1.val");
+  exprs.push_back("not-a-device.val");
+  std::vector<aibo::UrbiRequest> reqs = f.pipeline.getAll(exprs);
+  ASSERT_EQ(3u, reqs.size());
+  for (size_t i = 0; i < reqs.size(); ++i)
+    ASSERT_TRUE(ready(reqs[i].reply));
+  aibo::UrbiMessage rf = reqs[0].reply.get();
+  aibo::UrbiMessage lf = reqs[1].reply.get();
+  aibo::UrbiMessage bad = reqs[2].reply.get();
+  EXPECT_EQ(f.pipeline.tag(reqs[0].id), rf.tag().str());
+  EXPECT_EQ(-2, atof(rf.text().str().c_str()));
+  EXPECT_EQ(f.pipeline.tag(reqs[1].id), lf.tag().str());
+  EXPECT_EQ(1.5, atof(lf.text().str().c_str()));
+  EXPECT_EQ(aibo::MESSAGE_ERROR, bad.type());
+  EXPECT_EQ(0u, f.pipeline.pending());
+
+  // Messages that are not replies go on to the next handler.
+  f.connection.send("other: legLF1.val;\n", 19);
+  for (int i = 0; i < 100 && !f.forwarded.has("other"); ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_TRUE(f.forwarded.has("other"));
+}
+
+TEST(RequestPipeline, CancelPassesTheLateReplyOn)
+{
+  Fixture f(100000);
+  ASSERT_TRUE(f.start());
+  aibo::UrbiRequest r = f.pipeline.get("legLF1.val");
+  EXPECT_EQ(1u, f.pipeline.pending());
+  EXPECT_TRUE(f.pipeline.cancel(r.id));
+  EXPECT_FALSE(f.pipeline.cancel(r.id));
+  EXPECT_EQ(0u, f.pipeline.pending());
+  ASSERT_TRUE(ready(r.reply, 0));
+  try
+  {
+    r.reply.get();
+    ADD_FAILURE() << "cancelled request completed";
+  }
+  catch (const std::future_error& e)
+  {
+    EXPECT_EQ(std::future_errc::broken_promise, e.code());
+  }
+  std::string tag = f.pipeline.tag(r.id);
+  for (int i = 0; i < 100 && !f.forwarded.has(tag); ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_TRUE(f.forwarded.has(tag));
+}
+
+TEST(RequestPipeline, GetDevices)
+{
+  Fixture f;
+  ASSERT_TRUE(f.start());
+  std::vector<std::string> devices;
+  devices.push_back("legLF1");
+  devices.push_back("legRF1");
+  std::vector<double> values;
+  std::string error;
+  ASSERT_EQ(0, f.pipeline.getDevices(devices, values, 1.0, &error))
+    << error;
+  ASSERT_EQ(2u, values.size());
+  EXPECT_EQ(1.5, values[0]);
+  EXPECT_EQ(-2, values[1]);
+  EXPECT_TRUE(error.empty());
+}
+
+TEST(RequestPipeline, GetDevicesErrors)
+{
+  Fixture f;
+  ASSERT_TRUE(f.start());
+  std::vector<std::string> devices;
+  devices.push_back("legLF1");
+  devices.push_back("bad-name");
+  devices.push_back("legRF1");
+  std::vector<double> values(3, 42);
+  std::string error;
+
+  // An error reply names the device; the devices after it are left
+  // alone and their requests cancelled.
+  EXPECT_EQ(-1, f.pipeline.getDevices(devices, values, 1.0, &error));
+  EXPECT_EQ(0u, error.find("bad-name: ")) << error;
+  EXPECT_EQ(1.5, values[0]);
+  EXPECT_EQ(42, values[1]);
+  EXPECT_EQ(42, values[2]);
+  EXPECT_EQ(0u, f.pipeline.pending());
+
+  // A binary is not a number.
+  devices.assign(1, "micro");
+  EXPECT_EQ(-1, f.pipeline.getDevices(devices, values, 1.0, &error));
+  EXPECT_EQ(0u, error.find("micro: not a number: ")) << error;
+
+  // The error is optional.
+  EXPECT_EQ(-1, f.pipeline.getDevices(devices, values));
+}
+
+TEST(RequestPipeline, GetDevicesTimeout)
+{
+  Fixture f(200000);
+  ASSERT_TRUE(f.start());
+  std::vector<std::string> devices(2, "legLF1");
+  std::vector<double> values;
+  std::string error;
+  EXPECT_EQ(-1, f.pipeline.getDevices(devices, values, 0.02, &error));
+  EXPECT_EQ("legLF1: no reply", error);
+  EXPECT_EQ(0u, f.pipeline.pending());
+}
+
+TEST(RequestPipeline, ConnectionLossCompletesRequests)
+{
+  Fixture f(200000);
+  ASSERT_TRUE(f.start());
+  aibo::UrbiRequest r = f.pipeline.get("legLF1.val");
+  f.server.stop();
+  ASSERT_TRUE(ready(r.reply));
+  aibo::UrbiMessage m = r.reply.get();
+  EXPECT_EQ(aibo::MESSAGE_ERROR, m.type());
+  EXPECT_EQ(aibo::UrbiConnection::CLIENTERROR_TAG, m.tag().str());
+  EXPECT_EQ(0u, f.pipeline.pending());
+}
+
+TEST(RequestPipeline, SendFailure)
+{
+  aibo::UrbiConnection none("localhost");
+  aibo::RequestPipeline pipeline(none);
+  aibo::UrbiRequest r = pipeline.get("legLF1.val");
+  ASSERT_TRUE(ready(r.reply, 0));
+  EXPECT_EQ(aibo::MESSAGE_ERROR, r.reply.get().type());
+  std::vector<std::string> devices(1, "legLF1");
+  std::vector<double> values;
+  std::string error;
+  EXPECT_EQ(-1, pipeline.getDevices(devices, values, 1.0, &error));
+  EXPECT_EQ(0u, error.find("legLF1: ")) << error;
+  EXPECT_EQ(0u, pipeline.pending());
+}
@@ -0,0 +1,175 @@
+/// \file test/test_send_queue.cc
+/// \brief SendQueue ordering, lane budgets and shutdown.
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "aibo_server/send_queue.hh"
+
+namespace
+{
+  /// A socket pair whose far end is read into received() by a thread.
+  class SendQueueTest: public ::testing::Test
+  {
+  protected:
+    virtual void SetUp()
+    {
+      ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv_));
+      reader_ = std::thread([this]
+			    {
+			      char buf[4096];
+			      ssize_t n;
+			      while ((n = read(sv_[1], buf, sizeof buf)) > 0)
+				received_.append(buf, n);
+			    });
+    }
+
+    virtual void TearDown()
+    {
+      if (reader_.joinable())
+	received();
+      ::close(sv_[1]);
+    }
+
+    /// Everything sent; call once the queue is stopped.
+    const std::string& received()
+    {
+      shutdown(sv_[0], SHUT_WR);
+      reader_.join();
+      ::close(sv_[0]);
+      return received_;
+    }
+
+    int sv_[2];
+    std::thread reader_;
+    std::string received_;
+  };
+}
+
+TEST_F(SendQueueTest, LanesHaveTheirOwnSlots)
+{
+  aibo::SendQueue q(sv_[0], 16);
+  EXPECT_EQ(4u, q.laneDepth(aibo::PRIORITY_HIGH));
+  EXPECT_EQ(8u, q.laneDepth(aibo::PRIORITY_NORMAL));
+  EXPECT_EQ(4u, q.laneDepth(aibo::PRIORITY_LOW));
+  EXPECT_EQ(16u, q.depth());
+
+  // Not started: nothing drains.  A full low lane leaves the high
+  // lane its slots.
+  for (int i = 0; i < 4; ++i)
+    EXPECT_EQ(0, q.push("l", 1, aibo::PRIORITY_LOW, false));
+  EXPECT_EQ(-1, q.push("l", 1, aibo::PRIORITY_LOW, false));
+  for (int i = 0; i < 4; ++i)
+    EXPECT_EQ(0, q.push("h", 1, aibo::PRIORITY_HIGH, false));
+  EXPECT_EQ(-1, q.push("h", 1, aibo::PRIORITY_HIGH, false));
+}
+
+TEST_F(SendQueueTest, UrgentFirstInPushOrder)
+{
+  {
+    aibo::SendQueue q(sv_[0], 64);
+    for (char c = 'a'; c < 'e'; ++c)
+      ASSERT_EQ(0, q.push(&c, 1, aibo::PRIORITY_LOW));
+    for (char c = 'e'; c < 'i'; ++c)
+      ASSERT_EQ(0, q.pushf(aibo::PRIORITY_NORMAL, "%c", c));
+    std::string big(1000, 'X');
+    ASSERT_EQ(0, q.push(big.data(), big.size(), aibo::PRIORITY_NORMAL));
+    for (char c = 'i'; c < 'm'; ++c)
+      ASSERT_EQ(0, q.push(&c, 1, aibo::PRIORITY_HIGH));
+    q.start();
+    q.stop();
+    EXPECT_EQ(13u, q.commandsSent());
+  }
+  EXPECT_EQ("ijklefgh" + std::string(1000, 'X') + "abcd", received());
+}
+
+TEST_F(SendQueueTest, StopSendsEveryAcceptedPush)
+{
+  std::atomic<size_t> accepted(0);
+  {
+    aibo::SendQueue q(sv_[0], 16);
+    q.setMaxInFlight(256);
+    q.start();
+    std::vector<std::thread> producers;
+    for (int t = 0; t < 4; ++t)
+      producers.push_back(std::thread([&q, &accepted, t]
+				      {
+					for (int i = 0; i < 5000; ++i)
+					  if (!q.push("0123456789", 10,
+						      aibo::SendPriority(t % 3)))
+					    accepted += 10;
+				      }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    q.stop();
+    for (size_t t = 0; t < producers.size(); ++t)
+      producers[t].join();
+    EXPECT_EQ(-1, q.push("x", 1));
+    EXPECT_EQ(-1, q.pushf(aibo::PRIORITY_HIGH, "x"));
+  }
+  EXPECT_EQ(accepted.load(), received().size());
+}
+
+TEST_F(SendQueueTest, WriteErrorFailsPushes)
+{
+  aibo::SendQueue q(sv_[0], 16);
+  q.start();
+  shutdown(sv_[1], SHUT_RDWR);
+  reader_.join();
+  // The first writes may still succeed into the socket buffer.
+  for (int i = 0; i < 1000 && !q.failed(); ++i)
+  {
+    q.push("x", 1);
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  EXPECT_TRUE(q.failed());
+  EXPECT_EQ(EPIPE, q.error());
+  EXPECT_EQ(-1, q.push("x", 1));
+  q.stop();
+  ::close(sv_[0]);
+}
+
+TEST(SendQueue, StopGivesUpWhenThePeerDoesNotRead)
+{
+  // Without an in-flight limit the flusher blocks in a write larger
+  // than the socket buffer; with one it waits for room that never
+  // comes.  Either way stop() returns after its timeout.
+  for (int limited = 0; limited < 2; ++limited)
+  {
+    int sv[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    {
+      aibo::SendQueue q(sv[0], 256);
+      q.setMaxInFlight(limited ? 4096 : 0);
+      q.start();
+      if (limited)
+      {
+	std::string cmd(1000, 'x');
+	for (int i = 0; i < 100; ++i)
+	  ASSERT_EQ(0, q.push(cmd.data(), cmd.size()));
+      }
+      else
+      {
+	std::string big(4 << 20, 'x');
+	ASSERT_EQ(0, q.push(big.data(), big.size()));
+      }
+      std::chrono::steady_clock::time_point start =
+	std::chrono::steady_clock::now();
+      q.stop(0.1);
+      EXPECT_LT(std::chrono::steady_clock::now() - start,
+		std::chrono::seconds(2)) << "limited " << limited;
+      EXPECT_TRUE(q.failed());
+      EXPECT_EQ(ETIMEDOUT, q.error());
+      EXPECT_EQ(-1, q.push("x", 1));
+    }
+    ::close(sv[0]);
+    ::close(sv[1]);
+  }
+}
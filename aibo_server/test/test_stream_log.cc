@@ -0,0 +1,297 @@
+/// \file test/test_stream_log.cc
+/// \brief Streams recorded with StreamRecorder read back identical from
+/// StreamLog and through StreamReplayServer.
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "aibo_server/stream_log.hh"
+#include "aibo_server/stream_replay_server.hh"
+#include "aibo_server/urbi_connection.hh"
+
+namespace
+{
+  /// Raw messages and what the parser makes of them.
+  class Collector: public aibo::UrbiMessageHandler
+  {
+  public:
+    virtual void onMessage(const aibo::UrbiMessageView& msg)
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      raw.push_back(msg.raw.str());
+      tags.push_back(msg.tag.str());
+      timestamps.push_back(msg.timestamp);
+    }
+
+    size_t size() const
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      return raw.size();
+    }
+
+    std::vector<std::string> raw;
+    std::vector<std::string> tags;
+    std::vector<int> timestamps;
+
+  private:
+    mutable std::mutex lock_;
+  };
+
+  /// Joint readings, a camera binary and replies, \a count times over,
+  /// with increasing server timestamps.
+  std::string session(size_t count)
+  {
+    std::string s;
+    char buf[128];
+    for (size_t i = 0; i < count; ++i)
+    {
+      int t = 32 * i;
+      snprintf(buf, sizeof buf, "[%08d:aibo_joints] [%zu, 0.5, -0.25]\n",
+	       t, i);
+      s += buf;
+      if (i % 3 == 0)
+      {
+	std::string data(100 + i % 50, char('A' + i % 26));
+	data[0] = '\n';
+	snprintf(buf, sizeof buf, "[%08d:aibo_cam] BIN %zu jpeg 208 160\n",
+		 t + 1, data.size());
+	s += buf + data + "\n";
+      }
+      if (i % 7 == 0)
+      {
+	snprintf(buf, sizeof buf, "[%08d:aibo_req_%zu] %zu.5\n", t + 2, i, i);
+	s += buf;
+      }
+    }
+    return s;
+  }
+
+  /// Indexes what a parser frames, as UrbiConnection does.
+  class Indexer: public aibo::UrbiMessageHandler
+  {
+  public:
+    Indexer(aibo::StreamRecorder& recorder, aibo::UrbiStreamParser& parser)
+      : recorder_(recorder),
+	parser_(parser)
+    {}
+
+    virtual void onMessage(const aibo::UrbiMessageView& msg)
+    {
+      recorder_.index(msg, parser_.offset());
+    }
+
+  private:
+    aibo::StreamRecorder& recorder_;
+    aibo::UrbiStreamParser& parser_;
+  };
+
+  class StreamLogTest: public ::testing::Test
+  {
+  protected:
+    virtual void SetUp()
+    {
+      char tmp[] = "/tmp/aibo_server_test_XXXXXX";
+      ASSERT_TRUE(mkdtemp(tmp));
+      tmp_ = tmp;
+      dir_ = tmp_ + "/log";
+    }
+
+    virtual void TearDown()
+    {
+      removeLog(dir_);
+      removeLog(tmp_ + "/copy");
+      rmdir(tmp_.c_str());
+    }
+
+    static void removeLog(const std::string& dir)
+    {
+      if (DIR* d = opendir(dir.c_str()))
+      {
+	while (dirent* e = readdir(d))
+	  if (e->d_name[0] != '.')
+	    unlink((dir + "/" + e->d_name).c_str());
+	closedir(d);
+      }
+      rmdir(dir.c_str());
+    }
+
+    /// Record \a s in chunks of varying size, as recv() would return.
+    void record(const std::string& s, size_t segmentSize)
+    {
+      aibo::StreamRecorder recorder(segmentSize);
+      ASSERT_EQ(0, recorder.open(dir_)) << recorder.errorMessage();
+      aibo::UrbiStreamParser parser;
+      Indexer indexer(recorder, parser);
+      size_t chunk = 1;
+      for (size_t pos = 0; pos < s.size(); pos += chunk)
+      {
+	chunk = std::min(s.size() - pos, chunk * 7 % 1499 + 1);
+	unsigned long long position = parser.offset() + parser.pending();
+	ASSERT_TRUE(parser.feed(s.data() + pos, chunk));
+	ASSERT_EQ(0, recorder.record(s.data() + pos, chunk, position));
+	parser.parse(indexer);
+	++chunks_;
+      }
+      EXPECT_EQ(s.size(), recorder.bytes());
+      recorder.close();
+    }
+
+    std::string tmp_;
+    std::string dir_;
+    size_t chunks_ = 0;
+  };
+
+  void parse(const std::string& s, Collector& c)
+  {
+    aibo::UrbiStreamParser parser;
+    parser.feed(s.data(), s.size());
+    parser.parse(c);
+  }
+}
+
+TEST_F(StreamLogTest, RecordsReadBack)
+{
+  const std::string s = session(500);
+  // Small segments, so that the stream spans several.
+  record(s, 8192);
+
+  aibo::StreamLog log;
+  ASSERT_EQ(0, log.open(dir_)) << log.errorMessage();
+  EXPECT_EQ(s.size(), log.size());
+  EXPECT_EQ(chunks_, log.recordCount());
+  uint64_t offset = 0;
+  for (size_t i = 0; i < log.recordCount(); ++i)
+  {
+    aibo::LogRecord r = log.record(i);
+    ASSERT_EQ(offset, r.offset);
+    ASSERT_EQ(s.substr(offset, r.data.size()), r.data.str());
+    offset += r.data.size();
+  }
+  std::string copy;
+  log.copy(0, log.size(), copy);
+  EXPECT_EQ(s, copy);
+  copy.clear();
+  log.copy(1000, 3000, copy);
+  EXPECT_EQ(s.substr(1000, 2000), copy);
+}
+
+TEST_F(StreamLogTest, IndexMatchesMessages)
+{
+  const std::string s = session(200);
+  record(s, 4096);
+  Collector expected;
+  parse(s, expected);
+
+  aibo::StreamLog log;
+  ASSERT_EQ(0, log.open(dir_)) << log.errorMessage();
+  ASSERT_EQ(expected.raw.size(), log.indexSize());
+  for (size_t i = 0; i < log.indexSize(); ++i)
+  {
+    const aibo::IndexEntry& e = log.entry(i);
+    ASSERT_EQ(expected.tags[i], e.tagRef().str());
+    ASSERT_EQ(expected.timestamps[i], e.timestamp);
+    ASSERT_EQ(expected.raw[i], s.substr(e.offset, expected.raw[i].size()));
+  }
+
+  size_t cam = log.findTag(aibo::StringRef("aibo_cam"));
+  ASSERT_LT(cam, log.indexSize());
+  EXPECT_EQ("aibo_cam", log.entry(cam).tagRef().str());
+  EXPECT_EQ(log.indexSize(), log.findTag(aibo::StringRef("nothing")));
+  size_t t = log.seekTimestamp(32 * 100);
+  ASSERT_LT(t, log.indexSize());
+  EXPECT_EQ(32 * 100, log.entry(t).timestamp);
+}
+
+TEST_F(StreamLogTest, IndexStartsWithTheRecording)
+{
+  // The parser saw a message and a half before recording began; the
+  // half message is not in the log, so it is not indexed either.
+  const std::string before = "[00000001:a] 1\n[00000002:b] 2";
+  const std::string after = "2\n[00000003:c] 3\n";
+  aibo::UrbiStreamParser parser;
+  Collector ignored;
+  parser.feed(before.data(), before.size());
+  parser.parse(ignored);
+  {
+    aibo::StreamRecorder recorder;
+    ASSERT_EQ(0, recorder.open(dir_)) << recorder.errorMessage();
+    Indexer indexer(recorder, parser);
+    unsigned long long position = parser.offset() + parser.pending();
+    parser.feed(after.data(), after.size());
+    ASSERT_EQ(0, recorder.record(after.data(), after.size(), position));
+    parser.parse(indexer);
+    EXPECT_EQ(1u, recorder.messages());
+  }
+  aibo::StreamLog log;
+  ASSERT_EQ(0, log.open(dir_)) << log.errorMessage();
+  ASSERT_EQ(1u, log.indexSize());
+  EXPECT_EQ("c", log.entry(0).tagRef().str());
+  EXPECT_EQ(2u, log.entry(0).offset);
+}
+
+TEST_F(StreamLogTest, RefusesToOverwrite)
+{
+  record(session(10), 4096);
+  aibo::StreamRecorder recorder;
+  EXPECT_NE(0, recorder.open(dir_));
+  EXPECT_FALSE(recorder.errorMessage().empty());
+}
+
+TEST_F(StreamLogTest, ReplayServesTheSameMessages)
+{
+  const std::string s = session(300);
+  record(s, 8192);
+  Collector expected;
+  parse(s, expected);
+
+  aibo::StreamLog log;
+  ASSERT_EQ(0, log.open(dir_)) << log.errorMessage();
+  aibo::StreamReplayServer server(log, 0);
+  server.setSpeed(0);
+  ASSERT_EQ(0, server.start());
+
+  // Record the replay too: the connection indexes what it parses.
+  const std::string copyDir = tmp_ + "/copy";
+  aibo::StreamRecorder recorder;
+  ASSERT_EQ(0, recorder.open(copyDir)) << recorder.errorMessage();
+  Collector got;
+  aibo::UrbiConnection connection("localhost", server.port());
+  ASSERT_EQ(0, connection.connect()) << connection.errorMessage();
+  connection.setHandler(&got);
+  connection.setRecorder(&recorder);
+  connection.start();
+  // The server hangs up at the end of the log, which the connection
+  // reports as one more message.
+  for (int i = 0; i < 500 && got.size() <= expected.raw.size(); ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  connection.close();
+  server.stop();
+
+  ASSERT_EQ(expected.raw.size() + 1, got.raw.size());
+  for (size_t i = 0; i < expected.raw.size(); ++i)
+    ASSERT_EQ(expected.raw[i], got.raw[i]) << "message " << i;
+  EXPECT_EQ(aibo::UrbiConnection::CLIENTERROR_TAG, got.tags.back());
+  EXPECT_EQ(s.size(), server.bytesSent());
+  EXPECT_EQ(1u, server.playbacks());
+
+  recorder.close();
+  aibo::StreamLog copy;
+  ASSERT_EQ(0, copy.open(copyDir)) << copy.errorMessage();
+  ASSERT_EQ(log.indexSize(), copy.indexSize());
+  EXPECT_EQ(log.indexSize(), recorder.messages());
+  for (size_t i = 0; i < log.indexSize(); ++i)
+  {
+    ASSERT_EQ(log.entry(i).offset, copy.entry(i).offset) << "message " << i;
+    ASSERT_EQ(log.entry(i).tagRef().str(), copy.entry(i).tagRef().str());
+  }
+}
@@ -0,0 +1,208 @@
+/// \file test/test_urbi_stream_parser.cc
+/// \brief Messages come out the same however the stream is split.
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include "aibo_server/urbi_stream_parser.hh"
+
+namespace
+{
+  /// A dispatched message, copied out of the parser buffer.
+  struct Seen
+  {
+    int timestamp;
+    std::string tag;
+    aibo::MessageType type;
+    std::string text;
+    std::vector<std::string> binaries;
+
+    bool operator==(const Seen& o) const
+    {
+      return timestamp == o.timestamp && tag == o.tag && type == o.type
+	&& text == o.text && binaries == o.binaries;
+    }
+  };
+
+  class Collector: public aibo::UrbiMessageHandler
+  {
+  public:
+    virtual void onMessage(const aibo::UrbiMessageView& msg)
+    {
+      Seen s;
+      s.timestamp = msg.timestamp;
+      s.tag = msg.tag.str();
+      s.type = msg.type;
+      s.text = msg.text.str();
+      for (size_t i = 0; i < msg.binaryCount; ++i)
+	s.binaries.push_back(msg.binaries[i].data.str());
+      seen.push_back(s);
+    }
+
+    std::vector<Seen> seen;
+  };
+
+  /// Text, strings holding brackets, quotes and newlines, a system and
+  /// an error message, and binaries whose data holds line breaks and
+  /// message headers.
+  std::string stream()
+  {
+    std::string s;
+    s += "[00000010:notag] 12.5\n";
+    s += "[00000020:aibo_req_1] \"a ] [ \\\"quoted\\\" \\n string\"\n";
+    s += "[00000030:aibo_req_2] [1, 2, \"three\", [4]]\n";
+    s += "[00000040:start] *** begin client\n";
+    s += "[00000050:aibo_req_3] !!! 1.39-1.40: syntax error\n";
+    std::string data("ab\n[00000000:fake] x\n\0z", 24);
+    s += "[00000060:aibo_cam] BIN 24 jpeg 208 160\n" + data + "\n";
+    s += "[00000070:aibo_micro] BIN 4 raw 2 16000 16 1\n\r\n\r\n\n";
+    s += "[00000080:aibo_joints] [0.1, -0.2, 0.3]\n";
+    return s;
+  }
+
+  std::vector<Seen> parseAll(const std::string& s,
+			     const std::vector<size_t>& cuts)
+  {
+    aibo::UrbiStreamParser parser;
+    Collector c;
+    size_t from = 0;
+    for (size_t i = 0; i <= cuts.size(); ++i)
+    {
+      size_t to = i < cuts.size() ? cuts[i] : s.size();
+      EXPECT_TRUE(parser.feed(s.data() + from, to - from));
+      parser.parse(c);
+      from = to;
+    }
+    EXPECT_EQ(0u, parser.pending());
+    return c.seen;
+  }
+}
+
+TEST(UrbiStreamParser, WholeStream)
+{
+  std::vector<Seen> seen = parseAll(stream(), std::vector<size_t>());
+  ASSERT_EQ(8u, seen.size());
+  EXPECT_EQ(10, seen[0].timestamp);
+  EXPECT_EQ("notag", seen[0].tag);
+  EXPECT_EQ("12.5", seen[0].text);
+  EXPECT_EQ("[1, 2, \"three\", [4]]", seen[2].text);
+  EXPECT_EQ(aibo::MESSAGE_SYSTEM, seen[3].type);
+  EXPECT_EQ(aibo::MESSAGE_ERROR, seen[4].type);
+  ASSERT_EQ(1u, seen[5].binaries.size());
+  EXPECT_EQ(std::string("ab\n[00000000:fake] x\n\0z", 24),
+	    seen[5].binaries[0]);
+  ASSERT_EQ(1u, seen[6].binaries.size());
+  EXPECT_EQ("\r\n\r\n", seen[6].binaries[0]);
+  EXPECT_EQ("aibo_joints", seen[7].tag);
+}
+
+TEST(UrbiStreamParser, EverySplitPoint)
+{
+  const std::string s = stream();
+  const std::vector<Seen> whole = parseAll(s, std::vector<size_t>());
+  for (size_t cut = 1; cut < s.size(); ++cut)
+  {
+    std::vector<size_t> cuts(1, cut);
+    ASSERT_TRUE(parseAll(s, cuts) == whole) << "split at " << cut;
+  }
+}
+
+TEST(UrbiStreamParser, ByteAtATime)
+{
+  const std::string s = stream();
+  std::vector<size_t> cuts;
+  for (size_t i = 1; i < s.size(); ++i)
+    cuts.push_back(i);
+  EXPECT_TRUE(parseAll(s, cuts) == parseAll(s, std::vector<size_t>()));
+}
+
+TEST(UrbiStreamParser, OffsetsCountEveryByte)
+{
+  const std::string s = stream();
+  aibo::UrbiStreamParser parser;
+  Collector c;
+  parser.feed(s.data(), 7);
+  parser.parse(c);
+  parser.feed(s.data() + 7, s.size() - 7);
+  parser.parse(c);
+  EXPECT_EQ(s.size(), parser.offset());
+}
+
+TEST(UrbiStreamParser, ResyncsOnBadBinarySize)
+{
+  // Negative, missing, and larger than the buffer can ever hold: each
+  // message is dropped, and parsing resumes at the next header.
+  const char* bad[] = {
+    "[00000001:bad] BIN -5 raw\nabcde\n",
+    "[00000001:bad] BIN raw\n",
+    "[00000001:bad] BIN \n5 raw\n",
+    "[00000001:bad] BIN 99999999999999999999999 raw\n",
+    "[00000001:bad] BIN 70000000 raw\n",
+  };
+  for (size_t i = 0; i < sizeof bad / sizeof *bad; ++i)
+  {
+    aibo::UrbiStreamParser parser;
+    Collector c;
+    std::string s = std::string(bad[i]) + "[00000002:good] 1\n";
+    parser.feed(s.data(), s.size());
+    parser.parse(c);
+    ASSERT_EQ(1u, c.seen.size()) << bad[i];
+    EXPECT_EQ("good", c.seen[0].tag);
+    EXPECT_EQ(s.size(), parser.offset());
+  }
+}
+
+TEST(UrbiStreamParser, BinaryLargerThanBufferIsDropped)
+{
+  aibo::UrbiStreamParser parser(1024, 4096);
+  Collector c;
+  std::string s = "[00000001:big] BIN 5000 raw\n[00000002:good] 1\n";
+  parser.feed(s.data(), s.size());
+  parser.parse(c);
+  ASSERT_EQ(1u, c.seen.size());
+  EXPECT_EQ("good", c.seen[0].tag);
+}
+
+TEST(UrbiMessage, CopyOwnsTheText)
+{
+  aibo::UrbiMessage kept;
+  {
+    std::string s = "[00000001:aibo_cam] BIN 3 raw\nabc\n";
+    aibo::UrbiStreamParser parser;
+    struct Keep: public aibo::UrbiMessageHandler
+    {
+      explicit Keep(aibo::UrbiMessage& m)
+	: m(m)
+      {}
+
+      virtual void onMessage(const aibo::UrbiMessageView& v)
+      {
+	m = aibo::UrbiMessage(v);
+      }
+
+      aibo::UrbiMessage& m;
+    } keep(kept);
+    parser.feed(s.data(), s.size());
+    parser.parse(keep);
+  }
+  aibo::UrbiMessage copy(kept);
+  EXPECT_EQ("aibo_cam", copy.tag().str());
+  ASSERT_EQ(1u, copy.binaryCount());
+  EXPECT_EQ("abc", copy.binary(0).data.str());
+  EXPECT_EQ("raw", copy.binary(0).header.str());
+
+  // Client errors are built with a static tag outside their text.
+  char text[] = "!!! lost";
+  aibo::UrbiMessageView v;
+  v.tag = "client_error";
+  v.type = aibo::MESSAGE_ERROR;
+  v.text = v.raw = text;
+  v.message = v.text.substr(4);
+  aibo::UrbiMessage err(v);
+  text[4] = 'X';
+  aibo::UrbiMessage errCopy(err);
+  EXPECT_EQ("client_error", errCopy.tag().str());
+  EXPECT_EQ("lost", errCopy.message().str());
+}
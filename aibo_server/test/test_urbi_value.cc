@@ -0,0 +1,133 @@
+/// \file test/test_urbi_value.cc
+/// \brief Parsing, copying and moving UrbiValue, including from its own
+/// elements.
+
+#include <gtest/gtest.h>
+
+#include <type_traits>
+#include <utility>
+
+#include "aibo_server/urbi_value.hh"
+
+using aibo::StringRef;
+using aibo::UrbiValue;
+
+static_assert(std::is_nothrow_move_constructible<UrbiValue>::value,
+	      "UrbiValue must move without throwing");
+static_assert(std::is_nothrow_move_assignable<UrbiValue>::value,
+	      "UrbiValue must move without throwing");
+
+namespace
+{
+  const char* const NESTED = "[1, \"a\", [2, \"b\"]]";
+}
+
+TEST(UrbiValue, ParseTypes)
+{
+  UrbiValue v;
+  ASSERT_TRUE(v.parse(StringRef(" 12.5 ")));
+  EXPECT_EQ(aibo::VALUE_DOUBLE, v.type());
+  EXPECT_DOUBLE_EQ(12.5, v.number());
+
+  ASSERT_TRUE(v.parse(StringRef("\"a \\\"b\\\"\"")));
+  EXPECT_EQ(aibo::VALUE_STRING, v.type());
+  EXPECT_EQ("a \"b\"", v.string());
+
+  ASSERT_TRUE(v.parse(StringRef("[0.5, -1, 2e3]")));
+  EXPECT_EQ(aibo::VALUE_NUMBERS, v.type());
+  ASSERT_EQ(3u, v.size());
+  EXPECT_DOUBLE_EQ(2000, v.numbers()[2]);
+
+  ASSERT_TRUE(v.parse(StringRef(NESTED)));
+  EXPECT_EQ(aibo::VALUE_LIST, v.type());
+  ASSERT_EQ(3u, v.size());
+  EXPECT_DOUBLE_EQ(1, v.list()[0].number());
+  EXPECT_EQ("a", v.list()[1].string());
+  EXPECT_EQ("b", v.list()[2].list()[1].string());
+
+  ASSERT_TRUE(v.parse(StringRef("BIN 3 raw\nabc")));
+  EXPECT_EQ(aibo::VALUE_BINARY, v.type());
+  EXPECT_EQ("raw", v.header().str());
+  EXPECT_EQ("abc", v.data().str());
+
+  EXPECT_FALSE(v.parse(StringRef("[1, ")));
+  EXPECT_EQ(aibo::VALUE_VOID, v.type());
+}
+
+TEST(UrbiValue, CopyAndMove)
+{
+  UrbiValue a;
+  ASSERT_TRUE(a.parse(StringRef(NESTED)));
+  UrbiValue b(a);
+  EXPECT_EQ(3u, b.size());
+  EXPECT_EQ("b", b.list()[2].list()[1].string());
+
+  UrbiValue c(std::move(b));
+  EXPECT_EQ(3u, c.size());
+  EXPECT_EQ("a", c.list()[1].string());
+
+  UrbiValue d(1.0);
+  d = c;
+  EXPECT_EQ(aibo::VALUE_LIST, d.type());
+  d = std::move(c);
+  EXPECT_EQ("b", d.list()[2].list()[1].string());
+
+  UrbiValue numbers(std::vector<double>(3, 4.0));
+  d = numbers;
+  EXPECT_EQ(aibo::VALUE_NUMBERS, d.type());
+  EXPECT_DOUBLE_EQ(4.0, d.numbers()[2]);
+}
+
+TEST(UrbiValue, SelfAssignment)
+{
+  UrbiValue v;
+  ASSERT_TRUE(v.parse(StringRef(NESTED)));
+  const UrbiValue& self = v;
+  v = self;
+  EXPECT_EQ(3u, v.size());
+  v = std::move(v);
+  EXPECT_EQ(aibo::VALUE_LIST, v.type());
+}
+
+TEST(UrbiValue, AssignFromOwnElement)
+{
+  UrbiValue v;
+  ASSERT_TRUE(v.parse(StringRef(NESTED)));
+  v = v.list()[1];
+  EXPECT_EQ(aibo::VALUE_STRING, v.type());
+  EXPECT_EQ("a", v.string());
+
+  ASSERT_TRUE(v.parse(StringRef(NESTED)));
+  v = v.list()[2];
+  ASSERT_EQ(aibo::VALUE_LIST, v.type());
+  EXPECT_EQ("b", v.list()[1].string());
+
+  ASSERT_TRUE(v.parse(StringRef(NESTED)));
+  v = std::move(const_cast<UrbiValue&>(v.list()[2]));
+  ASSERT_EQ(2u, v.size());
+  EXPECT_EQ("b", v.list()[1].string());
+}
+
+TEST(UrbiValue, ReparseReusesStorage)
+{
+  UrbiValue v;
+  ASSERT_TRUE(v.parse(StringRef("[1, 2, 3]")));
+  const double* numbers = v.numbers();
+  ASSERT_TRUE(v.parse(StringRef("[4, 5, 6]")));
+  EXPECT_EQ(numbers, v.numbers());
+  EXPECT_DOUBLE_EQ(6, v.numbers()[2]);
+
+  ASSERT_TRUE(v.parse(StringRef("[1, \"a\", 3]")));
+  const UrbiValue* list = v.list().data();
+  ASSERT_TRUE(v.parse(StringRef("[4, \"bb\", 5]")));
+  EXPECT_EQ(list, v.list().data());
+  EXPECT_EQ("bb", v.list()[1].string());
+  EXPECT_DOUBLE_EQ(5, v.list()[2].number());
+
+  // Shapes change freely.
+  ASSERT_TRUE(v.parse(StringRef("[1, 2]")));
+  EXPECT_EQ(aibo::VALUE_NUMBERS, v.type());
+  ASSERT_TRUE(v.parse(StringRef("[]")));
+  EXPECT_EQ(aibo::VALUE_NUMBERS, v.type());
+  EXPECT_EQ(0u, v.size());
+}